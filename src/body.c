@@ -1,14 +1,164 @@
+#define _POSIX_C_SOURCE 200809L
 #include "body.h"
-#include <immintrin.h>
 
 #include "utils.h"
 #include <math.h>
+#include <string.h>
+#include <sys/mman.h>
+
+static void
+bodies_init_func(struct bodies *bodies, size_t start, size_t stop, size_t worker)
+{
+    (void)worker;
+    size_t size = sizeof(float) * (stop - start);
+    memset(bodies->mass + start, 0, size);
+    memset(bodies->x + start, 0, size);
+    memset(bodies->y + start, 0, size);
+    memset(bodies->velocity_x + start, 0, size);
+    memset(bodies->velocity_y + start, 0, size);
+    memset(bodies->acceleration_x + start, 0, size);
+    memset(bodies->acceleration_y + start, 0, size);
+    memset(bodies->step_level + start, 0, stop - start);
+    for (size_t i = start; i < stop; i++)
+        bodies->id[i] = i;
+}
+
+// The arrays are first touched by the workers owning their part, see pool_run_owned.
+// Padding bodies have no mass so they can be fed to the SIMD kernels.
+void
+bodies_init(struct bodies *bodies, size_t count, struct pool *pool)
+{
+    size_t padded_count = (count + 7) / 8 * 8;
+    size_t size = sizeof(float) * padded_count;
+    bodies->count = count;
+    bodies->map = NULL;
+    bodies->mass = xaligned_alloc(32, size);
+    bodies->x = xaligned_alloc(32, size);
+    bodies->y = xaligned_alloc(32, size);
+    bodies->velocity_x = xaligned_alloc(32, size);
+    bodies->velocity_y = xaligned_alloc(32, size);
+    bodies->acceleration_x = xaligned_alloc(32, size);
+    bodies->acceleration_y = xaligned_alloc(32, size);
+    bodies->step_level = xaligned_alloc(32, padded_count);
+    bodies->id = xaligned_alloc(32, sizeof(uint32_t) * padded_count);
+    pool_run_owned(pool, (pool_func)bodies_init_func, bodies, padded_count, 4096);
+}
+
+void
+bodies_destroy(struct bodies *bodies)
+{
+    if (bodies->map != NULL)
+    {
+        munmap(bodies->map, bodies->map_size);
+        memset(bodies, 0, sizeof *bodies);
+        return;
+    }
+    free(bodies->mass);
+    free(bodies->x);
+    free(bodies->y);
+    free(bodies->velocity_x);
+    free(bodies->velocity_y);
+    free(bodies->acceleration_x);
+    free(bodies->acceleration_y);
+    free(bodies->step_level);
+    free(bodies->id);
+    memset(bodies, 0, sizeof *bodies);
+}
+
+void
+bodies_set(struct bodies *bodies, size_t i, const struct body *body)
+{
+    bodies->mass[i] = body->mass;
+    bodies->x[i] = body->x;
+    bodies->y[i] = body->y;
+    bodies->velocity_x[i] = body->velocity_x;
+    bodies->velocity_y[i] = body->velocity_y;
+    bodies->acceleration_x[i] = body->acceleration_x;
+    bodies->acceleration_y[i] = body->acceleration_y;
+}
+
+struct body
+bodies_get(const struct bodies *bodies, size_t i)
+{
+    return (struct body){
+        .mass = bodies->mass[i],
+        .x = bodies->x[i],
+        .y = bodies->y[i],
+        .velocity_x = bodies->velocity_x[i],
+        .velocity_y = bodies->velocity_y[i],
+        .acceleration_x = bodies->acceleration_x[i],
+        .acceleration_y = bodies->acceleration_y[i],
+    };
+}
+
+struct bodies_permute_job
+{
+    const struct bodies *bodies;
+    struct bodies       *scratch;
+    const uint32_t      *order;
+};
+
+static void
+bodies_permute_func(const struct bodies_permute_job *job,
+                    size_t                           start,
+                    size_t                           stop,
+                    size_t                           worker)
+{
+    (void)worker;
+    const struct bodies *bodies = job->bodies;
+    struct bodies       *scratch = job->scratch;
+    for (size_t i = start; i < stop; i++)
+    {
+        uint32_t j = job->order[i];
+        scratch->mass[i] = bodies->mass[j];
+        scratch->x[i] = bodies->x[j];
+        scratch->y[i] = bodies->y[j];
+        scratch->velocity_x[i] = bodies->velocity_x[j];
+        scratch->velocity_y[i] = bodies->velocity_y[j];
+        scratch->acceleration_x[i] = bodies->acceleration_x[j];
+        scratch->acceleration_y[i] = bodies->acceleration_y[j];
+        scratch->step_level[i] = bodies->step_level[j];
+        scratch->id[i] = bodies->id[j];
+    }
+}
+
+// Reorder bodies so that the i-th body becomes the body at `order[i]`.
+// `scratch` needs to be initialized with the same count, its arrays are swapped with the ones of
+// `bodies`.
+void
+bodies_permute(struct bodies  *bodies,
+               struct bodies  *scratch,
+               const uint32_t *order,
+               struct pool    *pool)
+{
+    struct bodies_permute_job job = {.bodies = bodies, .scratch = scratch, .order = order};
+    pool_run_owned(pool, (pool_func)bodies_permute_func, &job, bodies->count, 0);
+    struct bodies tmp = *bodies;
+    *bodies = *scratch;
+    *scratch = tmp;
+}
+
+// Both need to be initialized with the same count
+void
+bodies_copy(struct bodies *destination, const struct bodies *source)
+{
+    size_t size = sizeof(float) * ((source->count + 7) / 8 * 8);
+    memcpy(destination->mass, source->mass, size);
+    memcpy(destination->x, source->x, size);
+    memcpy(destination->y, source->y, size);
+    memcpy(destination->velocity_x, source->velocity_x, size);
+    memcpy(destination->velocity_y, source->velocity_y, size);
+    memcpy(destination->acceleration_x, source->acceleration_x, size);
+    memcpy(destination->acceleration_y, source->acceleration_y, size);
+    memcpy(destination->step_level, source->step_level, (source->count + 7) / 8 * 8);
+    memcpy(destination->id, source->id, sizeof(uint32_t) * ((source->count + 7) / 8 * 8));
+}
 
 void
-body_init_random_uniform(struct body *body)
+body_init_random_uniform(struct body *body, struct rng *rng)
 {
-    body->x = frand();
-    body->y = frand();
+    body->x = rng_float(rng);
+    body->y = rng_float(rng);
     // body->mass = frand() + 0.3;
     body->mass = 0.1f;
     body->velocity_x = 0.0f;  // (frand() - 0.5) / 10000;
@@ -16,11 +166,11 @@ body_init_random_uniform(struct body *body)
 }
 
 void
-body_init_random_circle(struct body *body)
+body_init_random_circle(struct body *body, struct rng *rng)
 {
     do
     {
-        body_init_random_uniform(body);
+        body_init_random_uniform(body, rng);
         body->x = body->x * 2.0f - 1.0f;
         body->y = body->y * 2.0f - 1.0f;
     } while (sqrtf(body->x * body->x + body->y * body->y) > 0.5f);
@@ -29,9 +179,9 @@ body_init_random_circle(struct body *body)
 }
 
 void
-body_init_random_circle_spin(struct body *body)
+body_init_random_circle_spin(struct body *body, struct rng *rng)
 {
-    body_init_random_circle(body);
+    body_init_random_circle(body, rng);
     float x = body->x - 0.5f;
     float y = body->y - 0.5f;
     float magnitude = sqrtf(x * x + y * y);
@@ -43,10 +193,10 @@ body_init_random_circle_spin(struct body *body)
 }
 
 void
-body_init_random_two_circle(struct body *body)
+body_init_random_two_circle(struct body *body, struct rng *rng)
 {
-    body_init_random_circle(body);
-    if (frand() < 0.5f)
+    body_init_random_circle(body, rng);
+    if (rng_float(rng) < 0.5f)
     {
         body->x -= 0.5f;
         body->velocity_x = 0.7f;
@@ -59,11 +209,11 @@ body_init_random_two_circle(struct body *body)
 }
 
 void
-body_init_random_thorus(struct body *body)
+body_init_random_thorus(struct body *body, struct rng *rng)
 {
     do
     {
-        body_init_random_uniform(body);
+        body_init_random_uniform(body, rng);
         body->x = body->x * 2.0f - 1.0f;
         body->y = body->y * 2.0f - 1.0f;
     } while (sqrtf(body->x * body->x + body->y * body->y) > 0.5f ||
@@ -72,7 +222,8 @@ body_init_random_thorus(struct body *body)
     body->y += 0.5f;
 }
 
-static const float too_close_threshold = 0.0001f;
+float body_too_close_threshold = 0.0001f;
+float body_softening = 0.0f;
 
 void
 body_gravitational_force(const struct body *b1,
@@ -83,18 +234,20 @@ body_gravitational_force(const struct body *b1,
 {
     *force_x = 0.0f;
     *force_y = 0.0f;
-    if (fabsf(b1->x - b2->x) < too_close_threshold || fabsf(b1->y - b2->y) < too_close_threshold)
+    if (fabsf(b1->x - b2->x) <= body_too_close_threshold ||
+        fabsf(b1->y - b2->y) <= body_too_close_threshold)
         return;
     float distance_x = b1->x - b2->x;
     float distance_y = b1->y - b2->y;
-    float distance_square = distance_x * distance_x + distance_y * distance_y;
+    float distance_square =
+        distance_x * distance_x + distance_y * distance_y + body_softening * body_softening;
     float force = (b1->mass * b2->mass * gravity) /
                   distance_square;  // maybe we can remove the `b1->mass *` because we end up
                                     // dividing by it at the end
 
     float dx = b1->x - b2->x;
     float dy = b1->y - b2->y;
-    float magnitude_inverse = rsqrt(dx * dx + dy * dy);
+    float magnitude_inverse = rsqrt(distance_square);
     dx *= magnitude_inverse;
     dy *= magnitude_inverse;
     dx *= force;
@@ -107,76 +260,118 @@ body_gravitational_force(const struct body *b1,
 }
 
 void
-body_gravitational_force_avx2(const struct body *dest_body,
-                              const struct body  bodies[8],
-                              const float        gravity,
-                              float             *force_x,
-                              float             *force_y)
+body_gravitational_force_scalar(const struct body *dest_body,
+                                const float       *bodies_x,
+                                const float       *bodies_y,
+                                const float       *bodies_mass,
+                                size_t             count,
+                                const float        gravity,
+                                float             *force_x,
+                                float             *force_y)
 {
-    *force_x = 0.0f;
-    *force_y = 0.0f;
+    float softening_square = body_softening * body_softening;
+    float sum_x = 0.0f;
+    float sum_y = 0.0f;
+    for (size_t i = 0; i < count; i++)
+    {
+        float dx = dest_body->x - bodies_x[i];
+        float dy = dest_body->y - bodies_y[i];
+        if (fabsf(dx) <= body_too_close_threshold || fabsf(dy) <= body_too_close_threshold)
+            continue;
+        float inverse = 1.0f / sqrtf(dx * dx + dy * dy + softening_square);
+        float scale = dest_body->mass * bodies_mass[i] * gravity * inverse * inverse * inverse;
+        sum_x += dx * scale;
+        sum_y += dy * scale;
+    }
+    *force_x += sum_x;
+    *force_y += sum_y;
+}
+
+// With S the quadrupole, r from the center of mass to the body and q = r.S.r the force is
+//   G m (M r / r^3 - 3 S r / r^5 + (15/2 q / r^7 - 3/2 trace(S) / r^5) r)
+void
+body_gravitational_moments_scalar(const struct body         *dest_body,
+                                  const struct body_moments *moments,
+                                  size_t                     count,
+                                  const float                gravity,
+                                  float                     *force_x,
+                                  float                     *force_y)
+{
+    float softening_square = body_softening * body_softening;
+    float sum_x = 0.0f;
+    float sum_y = 0.0f;
+    for (size_t i = 0; i < count; i++)
+    {
+        float dx = dest_body->x - moments->x[i];
+        float dy = dest_body->y - moments->y[i];
+        if (fabsf(dx) <= body_too_close_threshold || fabsf(dy) <= body_too_close_threshold)
+            continue;
+        float inverse_square = 1.0f / (dx * dx + dy * dy + softening_square);
+        float inverse_cube = inverse_square * sqrtf(inverse_square);
+        float inverse_fifth = inverse_cube * inverse_square;
+        float quadrupole_x = moments->xx[i] * dx + moments->xy[i] * dy;
+        float quadrupole_y = moments->xy[i] * dx + moments->yy[i] * dy;
+        float quadrupole = dx * quadrupole_x + dy * quadrupole_y;
+        float trace = moments->xx[i] + moments->yy[i];
+        float radial = moments->mass[i] * inverse_cube +
+                       (7.5f * quadrupole * inverse_square - 1.5f * trace) * inverse_fifth;
+        sum_x += radial * dx - 3.0f * inverse_fifth * quadrupole_x;
+        sum_y += radial * dy - 3.0f * inverse_fifth * quadrupole_y;
+    }
+    *force_x += sum_x * dest_body->mass * gravity;
+    *force_y += sum_y * dest_body->mass * gravity;
+}
+
+// Best kernel first
+static const struct body_kernel kernels[] = {
+#ifdef HAVE_AVX512
+    {"avx512", body_gravitational_force_avx512, body_gravitational_moments_avx512},
+#endif
+#ifdef HAVE_AVX2
+    {"avx2", body_gravitational_force_avx2, body_gravitational_moments_avx2},
+#endif
+    {"scalar", body_gravitational_force_scalar, body_gravitational_moments_scalar},
+};
+
+const struct body_kernel *body_kernel = &kernels[ARRAY_LEN(kernels) - 1];
 
-    const __m256 bodies_x = _mm256_set_ps(bodies[0].x,
-                                          bodies[1].x,
-                                          bodies[2].x,
-                                          bodies[3].x,
-                                          bodies[4].x,
-                                          bodies[5].x,
-                                          bodies[6].x,
-                                          bodies[7].x);
-    const __m256 bodies_y = _mm256_set_ps(bodies[0].y,
-                                          bodies[1].y,
-                                          bodies[2].y,
-                                          bodies[3].y,
-                                          bodies[4].y,
-                                          bodies[5].y,
-                                          bodies[6].y,
-                                          bodies[7].y);
-    const __m256 bodies_mass = _mm256_set_ps(bodies[0].mass,
-                                             bodies[1].mass,
-                                             bodies[2].mass,
-                                             bodies[3].mass,
-                                             bodies[4].mass,
-                                             bodies[5].mass,
-                                             bodies[6].mass,
-                                             bodies[7].mass);
-
-    const __m256 dest_x = _mm256_set1_ps(dest_body->x);
-    const __m256 dest_y = _mm256_set1_ps(dest_body->y);
-    const __m256 dest_mass = _mm256_set1_ps(dest_body->mass);
-
-    const __m256 distance_x = _mm256_sub_ps(bodies_x, dest_x);
-    const __m256 distance_y = _mm256_sub_ps(bodies_y, dest_y);
-    const __m256 distance_square =
-        _mm256_add_ps(_mm256_mul_ps(distance_x, distance_x), _mm256_mul_ps(distance_y, distance_y));
-    const __m256 force =
-        _mm256_div_ps(_mm256_mul_ps(_mm256_mul_ps(dest_mass, bodies_mass), _mm256_set1_ps(gravity)),
-                      distance_square);
-
-    __m256 dx = _mm256_sub_ps(dest_x, bodies_x);
-    __m256 dy = _mm256_sub_ps(dest_y, bodies_y);
-
-    const __m256 magnitude_inverse =
-        _mm256_rsqrt_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)));
-
-    dx = _mm256_mul_ps(dx, magnitude_inverse);
-    dy = _mm256_mul_ps(dy, magnitude_inverse);
-    dx = _mm256_mul_ps(dx, force);
-    dy = _mm256_mul_ps(dy, force);
-
-    const __m256i too_close_mask = _mm256_cvtps_epi32(_mm256_and_ps(
-        _mm256_cmp_ps(_mm256_andnot_ps(_mm256_sub_ps(dest_x, bodies_x), _mm256_set1_ps(-0.0f)),
-                      _mm256_set1_ps(too_close_threshold),
-                      _CMP_GT_OQ),
-        _mm256_cmp_ps(_mm256_andnot_ps(_mm256_sub_ps(dest_y, bodies_y), _mm256_set1_ps(-0.0f)),
-                      _mm256_set1_ps(too_close_threshold),
-                      _CMP_GT_OQ)));
-
-    float dxs[8] = {0.0f};
-    float dys[8] = {0.0f};
-    _mm256_maskstore_ps(dxs, too_close_mask, dx);
-    _mm256_maskstore_ps(dys, too_close_mask, dy);
-
-    *force_x = dxs[0] + dxs[1] + dxs[2] + dxs[3] + dxs[4] + dxs[5] + dxs[6] + dxs[7];
-    *force_y = dys[0] + dys[1] + dys[2] + dys[3] + dys[4] + dys[5] + dys[6] + dys[7];
+bool
+body_kernel_supported(const struct body_kernel *kernel)
+{
+#ifdef HAVE_AVX512
+    if (kernel->force == body_gravitational_force_avx512)
+        return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("fma");
+#endif
+#ifdef HAVE_AVX2
+    if (kernel->force == body_gravitational_force_avx2)
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+    return true;
+}
+
+const struct body_kernel *
+body_kernels(size_t *count)
+{
+    *count = ARRAY_LEN(kernels);
+    return kernels;
+}
+
+void
+body_kernel_select(const char *name)
+{
+    __builtin_cpu_init();
+    for (size_t i = 0; i < ARRAY_LEN(kernels); i++)
+    {
+        if (name != NULL && strcmp(kernels[i].name, name) != 0)
+            continue;
+        if (!body_kernel_supported(&kernels[i]))
+        {
+            if (name != NULL)
+                die("Kernel %s is not supported by this CPU", name);
+            continue;
+        }
+        body_kernel = &kernels[i];
+        return;
+    }
+    die("Kernel %s is not available in this build", name);
 }
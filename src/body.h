@@ -1,6 +1,12 @@
 #ifndef BODY_H
 #define BODY_H
 
+#include "pool.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Single body, used to initialize bodies and as a value in the scalar force code
 struct body
 {
     float mass;
@@ -12,16 +18,53 @@ struct body
     float acceleration_y;
 };
 
+// Simulation state stored as structure of arrays, every array is 32 bytes aligned and
+// padded to a multiple of 8 elements so it can be loaded with aligned AVX2 loads.
+struct bodies
+{
+    size_t    count;
+    float    *mass;
+    float    *x;
+    float    *y;
+    float    *velocity_x;
+    float    *velocity_y;
+    float    *acceleration_x;
+    float    *acceleration_y;
+    uint8_t  *step_level;  // block time steps, the body is kicked every time_step / 2^step_level
+    uint32_t *id;          // index of the body at initialization, the sorts move bodies around
+    void     *map;         // arrays point into this mapping when restarted from a checkpoint
+    size_t    map_size;
+};
+
+void
+bodies_init(struct bodies *bodies, size_t count, struct pool *pool);
+void
+bodies_destroy(struct bodies *bodies);
+void
+bodies_set(struct bodies *bodies, size_t i, const struct body *body);
+struct body
+bodies_get(const struct bodies *bodies, size_t i);
+void
+bodies_permute(struct bodies  *bodies,
+               struct bodies  *scratch,
+               const uint32_t *order,
+               struct pool    *pool);
+void
+bodies_copy(struct bodies *destination, const struct bodies *source);
+
+struct rng;
+
+// Initializations draw from `rng`, bodies initialized from the same stream are the same
 void
-body_init_random_uniform(struct body *body);
+body_init_random_uniform(struct body *body, struct rng *rng);
 void
-body_init_random_circle(struct body *body);
+body_init_random_circle(struct body *body, struct rng *rng);
 void
-body_init_random_two_circle(struct body *body);
+body_init_random_two_circle(struct body *body, struct rng *rng);
 void
-body_init_random_circle_spin(struct body *body);
+body_init_random_circle_spin(struct body *body, struct rng *rng);
 void
-body_init_random_thorus(struct body *body);
+body_init_random_thorus(struct body *body, struct rng *rng);
 void
 body_gravitational_force(const struct body *b1,
                          const struct body *b2,
@@ -29,11 +72,115 @@ body_gravitational_force(const struct body *b1,
                          float             *force_x,
                          float             *force_y);
 
+// Bodies at most this far apart on either axis don't attract each other, with 0 this still
+// skips a body acting on itself
+extern float body_too_close_threshold;
+// Plummer softening length: the forces and the potential use sqrt(r^2 + softening^2) as the
+// distance, which keeps them smooth in close encounters when the cutoff above is 0
+extern float body_softening;
+
+// Add the force of `count` bodies stored as lanes of 32 bytes aligned arrays to `force_x/y`.
+// `count` is a multiple of 8 for the SIMD kernels, unused lanes need a mass of 0.
+typedef void (*body_force_func)(const struct body *dest_body,
+                                const float       *bodies_x,
+                                const float       *bodies_y,
+                                const float       *bodies_mass,
+                                size_t             count,
+                                const float        gravity,
+                                float             *force_x,
+                                float             *force_y);
+
+// Approximated groups of bodies as structure of arrays of their center of mass, mass and
+// quadrupole (second moments of the masses around the center of mass).
+struct body_moments
+{
+    const float *x;
+    const float *y;
+    const float *mass;
+    const float *xx;
+    const float *xy;
+    const float *yy;
+};
+
+// Add the force of `count` groups of bodies approximated by their moments to `force_x/y`.
+// Same layout rules as `body_force_func`, unused lanes need a mass and quadrupole of 0.
+typedef void (*body_moments_func)(const struct body         *dest_body,
+                                  const struct body_moments *moments,
+                                  size_t                     count,
+                                  const float                gravity,
+                                  float                     *force_x,
+                                  float                     *force_y);
+
+struct body_kernel
+{
+    const char       *name;
+    body_force_func   force;
+    body_moments_func moments;
+};
+
+// Kernel used by the force computation, the scalar one until `body_kernel_select` is called
+extern const struct body_kernel *body_kernel;
+
+void
+body_gravitational_force_scalar(const struct body *dest_body,
+                                const float       *bodies_x,
+                                const float       *bodies_y,
+                                const float       *bodies_mass,
+                                size_t             count,
+                                const float        gravity,
+                                float             *force_x,
+                                float             *force_y);
+void
+body_gravitational_moments_scalar(const struct body         *dest_body,
+                                  const struct body_moments *moments,
+                                  size_t                     count,
+                                  const float                gravity,
+                                  float                     *force_x,
+                                  float                     *force_y);
+#ifdef HAVE_AVX2
 void
 body_gravitational_force_avx2(const struct body *dest_body,
-                              const struct body  bodies[8],
+                              const float       *bodies_x,
+                              const float       *bodies_y,
+                              const float       *bodies_mass,
+                              size_t             count,
                               const float        gravity,
                               float             *force_x,
                               float             *force_y);
+void
+body_gravitational_moments_avx2(const struct body         *dest_body,
+                                const struct body_moments *moments,
+                                size_t                     count,
+                                const float                gravity,
+                                float                     *force_x,
+                                float                     *force_y);
+#endif
+#ifdef HAVE_AVX512
+void
+body_gravitational_force_avx512(const struct body *dest_body,
+                                const float       *bodies_x,
+                                const float       *bodies_y,
+                                const float       *bodies_mass,
+                                size_t             count,
+                                const float        gravity,
+                                float             *force_x,
+                                float             *force_y);
+void
+body_gravitational_moments_avx512(const struct body         *dest_body,
+                                  const struct body_moments *moments,
+                                  size_t                     count,
+                                  const float                gravity,
+                                  float                     *force_x,
+                                  float                     *force_y);
+#endif
+
+// Select the kernel named `name` or the fastest one supported by the CPU if `name` is NULL
+void
+body_kernel_select(const char *name);
+bool
+body_kernel_supported(const struct body_kernel *kernel);
+// All kernels compiled in, supported or not
+const struct body_kernel *
+body_kernels(size_t *count);
 
 #endif
@@ -0,0 +1,140 @@
+#include "body.h"
+#include <immintrin.h>
+
+// Compiled with -mavx2 -mfma, only called when the CPU supports both
+
+static inline float
+horizontal_sum_avx2(__m256 v)
+{
+    __m128 sum = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_movehdup_ps(sum));
+    return _mm_cvtss_f32(sum);
+}
+
+void
+body_gravitational_force_avx2(const struct body *dest_body,
+                              const float       *bodies_x,
+                              const float       *bodies_y,
+                              const float       *bodies_mass,
+                              size_t             count,
+                              const float        gravity,
+                              float             *force_x,
+                              float             *force_y)
+{
+    const __m256 dest_x = _mm256_set1_ps(dest_body->x);
+    const __m256 dest_y = _mm256_set1_ps(dest_body->y);
+    const __m256 dest_mass_gravity = _mm256_set1_ps(dest_body->mass * gravity);
+    const __m256 absolute_mask = _mm256_set1_ps(-0.0f);
+    const __m256 threshold = _mm256_set1_ps(body_too_close_threshold);
+    const __m256 softening_square = _mm256_set1_ps(body_softening * body_softening);
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 three_halves = _mm256_set1_ps(1.5f);
+    __m256       sum_x = _mm256_setzero_ps();
+    __m256       sum_y = _mm256_setzero_ps();
+
+    for (size_t i = 0; i < count; i += 8)
+    {
+        const __m256 dx = _mm256_sub_ps(dest_x, _mm256_load_ps(&bodies_x[i]));
+        const __m256 dy = _mm256_sub_ps(dest_y, _mm256_load_ps(&bodies_y[i]));
+        const __m256 mass = _mm256_load_ps(&bodies_mass[i]);
+        const __m256 distance_square =
+            _mm256_fmadd_ps(dx, dx, _mm256_fmadd_ps(dy, dy, softening_square));
+
+        // rsqrt is only 12 bits precise, one Newton-Raphson step gets close to full precision
+        __m256 inverse = _mm256_rsqrt_ps(distance_square);
+        inverse = _mm256_mul_ps(
+            inverse,
+            _mm256_fnmadd_ps(_mm256_mul_ps(half, distance_square),
+                             _mm256_mul_ps(inverse, inverse),
+                             three_halves));
+        // G * m1 * m2 / d^2 along the unit vector (dx, dy) / d
+        const __m256 inverse_cube = _mm256_mul_ps(_mm256_mul_ps(inverse, inverse), inverse);
+
+        // Same cutoff as the scalar version: ignore bodies too close on either axis,
+        // that also drops the body itself and the NaN it would produce
+        const __m256 absolute_dx = _mm256_andnot_ps(absolute_mask, dx);
+        const __m256 absolute_dy = _mm256_andnot_ps(absolute_mask, dy);
+        const __m256 far_mask = _mm256_and_ps(_mm256_cmp_ps(absolute_dx, threshold, _CMP_GT_OQ),
+                                              _mm256_cmp_ps(absolute_dy, threshold, _CMP_GT_OQ));
+        const __m256 scale = _mm256_and_ps(
+            _mm256_mul_ps(_mm256_mul_ps(dest_mass_gravity, mass), inverse_cube), far_mask);
+        sum_x = _mm256_fmadd_ps(dx, scale, sum_x);
+        sum_y = _mm256_fmadd_ps(dy, scale, sum_y);
+    }
+    *force_x += horizontal_sum_avx2(sum_x);
+    *force_y += horizontal_sum_avx2(sum_y);
+}
+
+void
+body_gravitational_moments_avx2(const struct body         *dest_body,
+                                const struct body_moments *moments,
+                                size_t                     count,
+                                const float                gravity,
+                                float                     *force_x,
+                                float                     *force_y)
+{
+    const __m256 dest_x = _mm256_set1_ps(dest_body->x);
+    const __m256 dest_y = _mm256_set1_ps(dest_body->y);
+    const __m256 absolute_mask = _mm256_set1_ps(-0.0f);
+    const __m256 threshold = _mm256_set1_ps(body_too_close_threshold);
+    const __m256 softening_square = _mm256_set1_ps(body_softening * body_softening);
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 three_halves = _mm256_set1_ps(1.5f);
+    const __m256 three = _mm256_set1_ps(3.0f);
+    const __m256 fifteen_halves = _mm256_set1_ps(7.5f);
+    __m256       sum_x = _mm256_setzero_ps();
+    __m256       sum_y = _mm256_setzero_ps();
+
+    for (size_t i = 0; i < count; i += 8)
+    {
+        const __m256 dx = _mm256_sub_ps(dest_x, _mm256_load_ps(&moments->x[i]));
+        const __m256 dy = _mm256_sub_ps(dest_y, _mm256_load_ps(&moments->y[i]));
+        const __m256 mass = _mm256_load_ps(&moments->mass[i]);
+        const __m256 xx = _mm256_load_ps(&moments->xx[i]);
+        const __m256 xy = _mm256_load_ps(&moments->xy[i]);
+        const __m256 yy = _mm256_load_ps(&moments->yy[i]);
+        const __m256 distance_square =
+            _mm256_fmadd_ps(dx, dx, _mm256_fmadd_ps(dy, dy, softening_square));
+
+        __m256 inverse = _mm256_rsqrt_ps(distance_square);
+        inverse = _mm256_mul_ps(
+            inverse,
+            _mm256_fnmadd_ps(_mm256_mul_ps(half, distance_square),
+                             _mm256_mul_ps(inverse, inverse),
+                             three_halves));
+        const __m256 inverse_square = _mm256_mul_ps(inverse, inverse);
+        const __m256 inverse_cube = _mm256_mul_ps(inverse_square, inverse);
+        const __m256 inverse_fifth = _mm256_mul_ps(inverse_cube, inverse_square);
+
+        // Same formula as the scalar version
+        const __m256 quadrupole_x = _mm256_fmadd_ps(xx, dx, _mm256_mul_ps(xy, dy));
+        const __m256 quadrupole_y = _mm256_fmadd_ps(xy, dx, _mm256_mul_ps(yy, dy));
+        const __m256 quadrupole =
+            _mm256_fmadd_ps(dx, quadrupole_x, _mm256_mul_ps(dy, quadrupole_y));
+        const __m256 trace = _mm256_add_ps(xx, yy);
+        const __m256 radial = _mm256_fmadd_ps(
+            mass,
+            inverse_cube,
+            _mm256_mul_ps(_mm256_fmsub_ps(_mm256_mul_ps(fifteen_halves, quadrupole),
+                                          inverse_square,
+                                          _mm256_mul_ps(three_halves, trace)),
+                          inverse_fifth));
+        const __m256 tangent = _mm256_mul_ps(three, inverse_fifth);
+
+        const __m256 absolute_dx = _mm256_andnot_ps(absolute_mask, dx);
+        const __m256 absolute_dy = _mm256_andnot_ps(absolute_mask, dy);
+        const __m256 far_mask = _mm256_and_ps(_mm256_cmp_ps(absolute_dx, threshold, _CMP_GT_OQ),
+                                              _mm256_cmp_ps(absolute_dy, threshold, _CMP_GT_OQ));
+        sum_x = _mm256_add_ps(
+            sum_x,
+            _mm256_and_ps(_mm256_fnmadd_ps(tangent, quadrupole_x, _mm256_mul_ps(radial, dx)),
+                          far_mask));
+        sum_y = _mm256_add_ps(
+            sum_y,
+            _mm256_and_ps(_mm256_fnmadd_ps(tangent, quadrupole_y, _mm256_mul_ps(radial, dy)),
+                          far_mask));
+    }
+    *force_x += horizontal_sum_avx2(sum_x) * dest_body->mass * gravity;
+    *force_y += horizontal_sum_avx2(sum_y) * dest_body->mass * gravity;
+}
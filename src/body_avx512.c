@@ -0,0 +1,136 @@
+#include "body.h"
+#include <immintrin.h>
+
+// Compiled with -mavx512f -mfma, only called when the CPU supports AVX-512F
+
+void
+body_gravitational_force_avx512(const struct body *dest_body,
+                                const float       *bodies_x,
+                                const float       *bodies_y,
+                                const float       *bodies_mass,
+                                size_t             count,
+                                const float        gravity,
+                                float             *force_x,
+                                float             *force_y)
+{
+    const __m512 dest_x = _mm512_set1_ps(dest_body->x);
+    const __m512 dest_y = _mm512_set1_ps(dest_body->y);
+    const __m512 dest_mass_gravity = _mm512_set1_ps(dest_body->mass * gravity);
+    const __m512 threshold = _mm512_set1_ps(body_too_close_threshold);
+    const __m512 softening_square = _mm512_set1_ps(body_softening * body_softening);
+    const __m512 half = _mm512_set1_ps(0.5f);
+    const __m512 three_halves = _mm512_set1_ps(1.5f);
+    __m512       sum_x = _mm512_setzero_ps();
+    __m512       sum_y = _mm512_setzero_ps();
+
+    // Lanes come padded to a multiple of 8, the last 8 are loaded with a mask
+    for (size_t i = 0; i < count; i += 16)
+    {
+        const __mmask16 lanes_mask = count - i >= 16 ? 0xffff : 0x00ff;
+        const __m512    dx = _mm512_sub_ps(dest_x, _mm512_maskz_loadu_ps(lanes_mask, &bodies_x[i]));
+        const __m512    dy = _mm512_sub_ps(dest_y, _mm512_maskz_loadu_ps(lanes_mask, &bodies_y[i]));
+        const __m512    mass = _mm512_maskz_loadu_ps(lanes_mask, &bodies_mass[i]);
+        const __m512    distance_square =
+            _mm512_fmadd_ps(dx, dx, _mm512_fmadd_ps(dy, dy, softening_square));
+
+        // rsqrt14 is 14 bits precise, one Newton-Raphson step gets close to full precision
+        __m512 inverse = _mm512_rsqrt14_ps(distance_square);
+        inverse = _mm512_mul_ps(
+            inverse,
+            _mm512_fnmadd_ps(_mm512_mul_ps(half, distance_square),
+                             _mm512_mul_ps(inverse, inverse),
+                             three_halves));
+        const __m512 inverse_cube = _mm512_mul_ps(_mm512_mul_ps(inverse, inverse), inverse);
+
+        // Same cutoff as the scalar version: ignore bodies too close on either axis
+        const __mmask16 far_mask =
+            _mm512_mask_cmp_ps_mask(_mm512_cmp_ps_mask(_mm512_abs_ps(dx), threshold, _CMP_GT_OQ),
+                                    _mm512_abs_ps(dy),
+                                    threshold,
+                                    _CMP_GT_OQ);
+        const __m512 scale = _mm512_maskz_mul_ps(
+            far_mask, _mm512_mul_ps(dest_mass_gravity, mass), inverse_cube);
+        sum_x = _mm512_fmadd_ps(dx, scale, sum_x);
+        sum_y = _mm512_fmadd_ps(dy, scale, sum_y);
+    }
+    *force_x += _mm512_reduce_add_ps(sum_x);
+    *force_y += _mm512_reduce_add_ps(sum_y);
+}
+
+void
+body_gravitational_moments_avx512(const struct body         *dest_body,
+                                  const struct body_moments *moments,
+                                  size_t                     count,
+                                  const float                gravity,
+                                  float                     *force_x,
+                                  float                     *force_y)
+{
+    const __m512 dest_x = _mm512_set1_ps(dest_body->x);
+    const __m512 dest_y = _mm512_set1_ps(dest_body->y);
+    const __m512 threshold = _mm512_set1_ps(body_too_close_threshold);
+    const __m512 softening_square = _mm512_set1_ps(body_softening * body_softening);
+    const __m512 half = _mm512_set1_ps(0.5f);
+    const __m512 three_halves = _mm512_set1_ps(1.5f);
+    const __m512 three = _mm512_set1_ps(3.0f);
+    const __m512 fifteen_halves = _mm512_set1_ps(7.5f);
+    __m512       sum_x = _mm512_setzero_ps();
+    __m512       sum_y = _mm512_setzero_ps();
+
+    for (size_t i = 0; i < count; i += 16)
+    {
+        const __mmask16 lanes_mask = count - i >= 16 ? 0xffff : 0x00ff;
+        const __m512    x = _mm512_maskz_loadu_ps(lanes_mask, &moments->x[i]);
+        const __m512    y = _mm512_maskz_loadu_ps(lanes_mask, &moments->y[i]);
+        const __m512    dx = _mm512_sub_ps(dest_x, x);
+        const __m512    dy = _mm512_sub_ps(dest_y, y);
+        const __m512    mass = _mm512_maskz_loadu_ps(lanes_mask, &moments->mass[i]);
+        const __m512    xx = _mm512_maskz_loadu_ps(lanes_mask, &moments->xx[i]);
+        const __m512    xy = _mm512_maskz_loadu_ps(lanes_mask, &moments->xy[i]);
+        const __m512    yy = _mm512_maskz_loadu_ps(lanes_mask, &moments->yy[i]);
+        const __m512    distance_square =
+            _mm512_fmadd_ps(dx, dx, _mm512_fmadd_ps(dy, dy, softening_square));
+
+        __m512 inverse = _mm512_rsqrt14_ps(distance_square);
+        inverse = _mm512_mul_ps(
+            inverse,
+            _mm512_fnmadd_ps(_mm512_mul_ps(half, distance_square),
+                             _mm512_mul_ps(inverse, inverse),
+                             three_halves));
+        const __m512 inverse_square = _mm512_mul_ps(inverse, inverse);
+        const __m512 inverse_cube = _mm512_mul_ps(inverse_square, inverse);
+        const __m512 inverse_fifth = _mm512_mul_ps(inverse_cube, inverse_square);
+
+        // Same formula as the scalar version
+        const __m512 quadrupole_x = _mm512_fmadd_ps(xx, dx, _mm512_mul_ps(xy, dy));
+        const __m512 quadrupole_y = _mm512_fmadd_ps(xy, dx, _mm512_mul_ps(yy, dy));
+        const __m512 quadrupole =
+            _mm512_fmadd_ps(dx, quadrupole_x, _mm512_mul_ps(dy, quadrupole_y));
+        const __m512 trace = _mm512_add_ps(xx, yy);
+        const __m512 radial = _mm512_fmadd_ps(
+            mass,
+            inverse_cube,
+            _mm512_mul_ps(_mm512_fmsub_ps(_mm512_mul_ps(fifteen_halves, quadrupole),
+                                          inverse_square,
+                                          _mm512_mul_ps(three_halves, trace)),
+                          inverse_fifth));
+        const __m512 tangent = _mm512_mul_ps(three, inverse_fifth);
+
+        const __mmask16 far_mask =
+            _mm512_mask_cmp_ps_mask(_mm512_cmp_ps_mask(_mm512_abs_ps(dx), threshold, _CMP_GT_OQ),
+                                    _mm512_abs_ps(dy),
+                                    threshold,
+                                    _CMP_GT_OQ);
+        sum_x = _mm512_mask_add_ps(
+            sum_x,
+            far_mask,
+            sum_x,
+            _mm512_fnmadd_ps(tangent, quadrupole_x, _mm512_mul_ps(radial, dx)));
+        sum_y = _mm512_mask_add_ps(
+            sum_y,
+            far_mask,
+            sum_y,
+            _mm512_fnmadd_ps(tangent, quadrupole_y, _mm512_mul_ps(radial, dy)));
+    }
+    *force_x += _mm512_reduce_add_ps(sum_x) * dest_body->mass * gravity;
+    *force_y += _mm512_reduce_add_ps(sum_y) * dest_body->mass * gravity;
+}
@@ -0,0 +1,116 @@
+#define _POSIX_C_SOURCE 200809L
+#include "checkpoint.h"
+#include "utils.h"
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Arrays of `struct bodies` in the order they are stored
+static const struct
+{
+    size_t offset;  // of the array pointer in `struct bodies`
+    size_t size;    // of an element
+} checkpoint_arrays[] = {
+    {offsetof(struct bodies, mass), sizeof(float)},
+    {offsetof(struct bodies, x), sizeof(float)},
+    {offsetof(struct bodies, y), sizeof(float)},
+    {offsetof(struct bodies, velocity_x), sizeof(float)},
+    {offsetof(struct bodies, velocity_y), sizeof(float)},
+    {offsetof(struct bodies, acceleration_x), sizeof(float)},
+    {offsetof(struct bodies, acceleration_y), sizeof(float)},
+    {offsetof(struct bodies, step_level), sizeof(uint8_t)},
+    {offsetof(struct bodies, id), sizeof(uint32_t)},
+};
+
+static void **
+checkpoint_array(struct bodies *bodies, size_t i)
+{
+    return (void **)((char *)bodies + checkpoint_arrays[i].offset);
+}
+
+// Bytes of an array in the file, rounded up to keep the next one aligned
+static size_t
+checkpoint_array_size(size_t i, size_t count)
+{
+    size_t size = checkpoint_arrays[i].size * ((count + 7) / 8 * 8);
+    return (size + 31) / 32 * 32;
+}
+
+void
+checkpoint_write(const char *path, const struct bodies *bodies, uint64_t step, uint32_t seed)
+{
+    size_t path_length = strlen(path);
+    char  *tmp_path = xmalloc(path_length + sizeof ".tmp");
+    memcpy(tmp_path, path, path_length);
+    memcpy(tmp_path + path_length, ".tmp", sizeof ".tmp");
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        die("Cannot open %s", tmp_path);
+    struct checkpoint_header header = {
+        .version = CHECKPOINT_VERSION,
+        .seed = seed,
+        .count = bodies->count,
+        .step = step,
+    };
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof header.magic);
+    xwrite(fd, &header, sizeof header);
+    static const char padding[32] = {0};
+    for (size_t i = 0; i < ARRAY_LEN(checkpoint_arrays); i++)
+    {
+        size_t size = checkpoint_arrays[i].size * ((bodies->count + 7) / 8 * 8);
+        xwrite(fd, *checkpoint_array((struct bodies *)bodies, i), size);
+        xwrite(fd, padding, checkpoint_array_size(i, bodies->count) - size);
+    }
+    // The data has to be on disk before the rename replaces the previous checkpoint
+    if (fsync(fd) != 0)
+        die("Cannot sync %s", tmp_path);
+    if (close(fd) != 0)
+        die("Cannot close %s", tmp_path);
+    if (rename(tmp_path, path) != 0)
+        die("Cannot rename %s to %s", tmp_path, path);
+    free(tmp_path);
+}
+
+void
+checkpoint_map(const char *path, struct bodies *bodies, uint64_t *step, uint32_t *seed)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        die("Cannot open %s", path);
+    struct stat stat;
+    if (fstat(fd, &stat) != 0)
+        die("Cannot stat %s", path);
+    struct checkpoint_header header;
+    if ((size_t)stat.st_size < sizeof header || read(fd, &header, sizeof header) != sizeof header)
+        die("%s is not a checkpoint", path);
+    if (memcmp(header.magic, CHECKPOINT_MAGIC, sizeof header.magic) != 0)
+        die("%s is not a checkpoint", path);
+    if (header.version != CHECKPOINT_VERSION)
+        die("%s has version %u, expected %u", path, header.version, CHECKPOINT_VERSION);
+    size_t size = sizeof header;
+    for (size_t i = 0; i < ARRAY_LEN(checkpoint_arrays); i++)
+        size += checkpoint_array_size(i, header.count);
+    if ((size_t)stat.st_size != size)
+        die("%s has %zu bytes, expected %zu", path, (size_t)stat.st_size, size);
+
+    // Private mapping, pages are only copied when the simulation writes to them
+    char *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        die("Cannot map %s", path);
+    close(fd);
+    memset(bodies, 0, sizeof *bodies);
+    bodies->count = header.count;
+    bodies->map = map;
+    bodies->map_size = size;
+    size_t offset = sizeof header;
+    for (size_t i = 0; i < ARRAY_LEN(checkpoint_arrays); i++)
+    {
+        *checkpoint_array(bodies, i) = map + offset;
+        offset += checkpoint_array_size(i, header.count);
+    }
+    *step = header.step;
+    *seed = header.seed;
+}
@@ -0,0 +1,30 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "body.h"
+#include <stdint.h>
+
+// Checkpoint file: this header followed by the arrays of `struct bodies` (padding included),
+// each one starting on 32 bytes so they can be used in place once the file is mapped.
+// Numbers are stored in the byte order of the machine that wrote the file.
+#define CHECKPOINT_MAGIC "NBODYCKP"
+#define CHECKPOINT_VERSION 1
+
+struct checkpoint_header
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t seed;   // of the random number generator
+    uint64_t count;  // bodies
+    uint64_t step;   // steps done when the checkpoint was written
+};
+
+// Write to `path` with a ".tmp" suffix then rename it, a crash leaves the previous checkpoint
+void
+checkpoint_write(const char *path, const struct bodies *bodies, uint64_t step, uint32_t seed);
+// Map a checkpoint copy-on-write, the arrays of `bodies` point into the mapping so the file is
+// neither read up front nor modified by the simulation
+void
+checkpoint_map(const char *path, struct bodies *bodies, uint64_t *step, uint32_t *seed);
+
+#endif
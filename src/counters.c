@@ -0,0 +1,96 @@
+#define _GNU_SOURCE
+#include "counters.h"
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+const char *counter_names[COUNTER_COUNT] = {
+    "cycles",
+    "instructions",
+    "cache_misses",
+    "branch_misses",
+    "task_clock",
+};
+
+#ifdef __linux__
+static const struct
+{
+    uint32_t type;
+    uint64_t config;
+} counter_events[COUNTER_COUNT] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+};
+#endif
+
+bool
+counters_open(struct counters *counters)
+{
+    counters->leader = -1;
+    counters->available = 0;
+    for (size_t i = 0; i < COUNTER_COUNT; i++)
+        counters->fds[i] = -1;
+#ifdef __linux__
+    for (size_t i = 0; i < COUNTER_COUNT; i++)
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof attr);
+        attr.size = sizeof attr;
+        attr.type = counter_events[i].type;
+        attr.config = counter_events[i].config;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                           PERF_FORMAT_TOTAL_TIME_RUNNING;
+        // The whole group is enabled at once through its leader
+        attr.disabled = counters->leader == -1;
+        counters->fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, counters->leader, 0);
+        if (counters->fds[i] < 0)
+            continue;
+        if (counters->leader == -1)
+            counters->leader = counters->fds[i];
+        counters->available |= 1u << i;
+    }
+    if (counters->leader != -1)
+        ioctl(counters->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+    // Other systems have no perf_event_open, the profile only has times
+    return counters->leader != -1;
+}
+
+void
+counters_close(struct counters *counters)
+{
+    for (size_t i = 0; i < COUNTER_COUNT; i++)
+    {
+        if (counters->fds[i] >= 0)
+            close(counters->fds[i]);
+        counters->fds[i] = -1;
+    }
+    counters->leader = -1;
+    counters->available = 0;
+}
+
+void
+counters_read(const struct counters *counters, uint64_t values[COUNTER_COUNT])
+{
+    memset(values, 0, sizeof(uint64_t) * COUNTER_COUNT);
+    if (counters->leader == -1)
+        return;
+    // Number of counters, time enabled, time running, then the counters in the order opened
+    uint64_t buffer[3 + COUNTER_COUNT];
+    if (read(counters->leader, buffer, sizeof buffer) < (ssize_t)(3 * sizeof(uint64_t)))
+        return;
+    double scale = buffer[2] == 0 ? 0.0 : (double)buffer[1] / (double)buffer[2];
+    size_t next = 3;
+    for (size_t i = 0; i < COUNTER_COUNT; i++)
+        if (counters->available & (1u << i))
+            values[i] = (uint64_t)((double)buffer[next++] * scale);
+}
@@ -0,0 +1,39 @@
+#ifndef COUNTERS_H
+#define COUNTERS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Performance counters of the calling thread in user space through perf_event_open, which only
+// Linux has. Each counter is opened on its own in one group and the ones the kernel or the machine
+// doesn't have are left out (virtual machines often have no hardware counters).
+enum counter
+{
+    COUNTER_CYCLES,
+    COUNTER_INSTRUCTIONS,
+    COUNTER_CACHE_MISSES,  // last level cache
+    COUNTER_BRANCH_MISSES,
+    COUNTER_TASK_CLOCK,  // nanoseconds on a CPU, software
+    COUNTER_COUNT,
+};
+
+extern const char *counter_names[COUNTER_COUNT];
+
+struct counters
+{
+    int      fds[COUNTER_COUNT];  // -1 when not available
+    int      leader;
+    uint32_t available;  // bit per counter
+};
+
+// False if no counter could be opened
+bool
+counters_open(struct counters *counters);
+void
+counters_close(struct counters *counters);
+// Values since counters_open, scaled up when the kernel had to multiplex the group,
+// the counters not available are 0
+void
+counters_read(const struct counters *counters, uint64_t values[COUNTER_COUNT]);
+
+#endif
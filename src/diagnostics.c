@@ -0,0 +1,67 @@
+#include "diagnostics.h"
+#include "utils.h"
+#include <stdlib.h>
+
+// Sums of a worker, on their own cache line
+struct diagnostics_sums
+{
+    _Alignas(64) struct diagnostics diagnostics;
+};
+
+struct diagnostics_job
+{
+    const struct bodies     *bodies;
+    const struct quadtree   *quadtree;
+    float                    gravity;
+    struct diagnostics_sums *sums;
+};
+
+static void
+diagnostics_func(const struct diagnostics_job *job, size_t start, size_t stop, size_t worker)
+{
+    const struct bodies *bodies = job->bodies;
+    struct diagnostics  *sums = &job->sums[worker].diagnostics;
+    for (size_t i = start; i < stop; i++)
+    {
+        double      mass = bodies->mass[i];
+        double      velocity_x = bodies->velocity_x[i];
+        double      velocity_y = bodies->velocity_y[i];
+        struct body body = bodies_get(bodies, i);
+        sums->kinetic += 0.5 * mass * (velocity_x * velocity_x + velocity_y * velocity_y);
+        // Each pair is seen from both bodies
+        sums->potential += 0.5 * quadtree_potential(job->quadtree, &body, job->gravity);
+        sums->momentum_x += mass * velocity_x;
+        sums->momentum_y += mass * velocity_y;
+        sums->angular_momentum += mass * (bodies->x[i] * velocity_y - bodies->y[i] * velocity_x);
+    }
+}
+
+void
+diagnostics_compute(struct diagnostics    *diagnostics,
+                    const struct bodies   *bodies,
+                    const struct quadtree *quadtree,
+                    const float            gravity,
+                    struct pool           *pool)
+{
+    size_t                 workers_count = pool_workers_count(pool);
+    struct diagnostics_job job = {
+        .bodies = bodies,
+        .quadtree = quadtree,
+        .gravity = gravity,
+        .sums = xaligned_alloc(64, sizeof(struct diagnostics_sums) * workers_count),
+    };
+    for (size_t i = 0; i < workers_count; i++)
+        job.sums[i].diagnostics = (struct diagnostics){0};
+    pool_run(pool, (pool_func)diagnostics_func, &job, bodies->count, 64);
+    *diagnostics = (struct diagnostics){0};
+    for (size_t i = 0; i < workers_count; i++)
+    {
+        const struct diagnostics *sums = &job.sums[i].diagnostics;
+        diagnostics->kinetic += sums->kinetic;
+        diagnostics->potential += sums->potential;
+        diagnostics->momentum_x += sums->momentum_x;
+        diagnostics->momentum_y += sums->momentum_y;
+        diagnostics->angular_momentum += sums->angular_momentum;
+    }
+    free(job.sums);
+}
@@ -0,0 +1,28 @@
+#ifndef DIAGNOSTICS_H
+#define DIAGNOSTICS_H
+
+#include "body.h"
+#include "pool.h"
+#include "quadtree.h"
+
+// Conserved quantities of the whole system, summed in double precision.
+// Angular momentum is taken around the origin.
+struct diagnostics
+{
+    double kinetic;
+    double potential;
+    double momentum_x;
+    double momentum_y;
+    double angular_momentum;
+};
+
+// The potential comes from a walk of `quadtree`, which needs to be built and flattened on the
+// current positions. Velocities need to be at the same time as the positions.
+void
+diagnostics_compute(struct diagnostics    *diagnostics,
+                    const struct bodies   *bodies,
+                    const struct quadtree *quadtree,
+                    const float            gravity,
+                    struct pool           *pool);
+
+#endif
@@ -0,0 +1,120 @@
+#include "direct.h"
+#include "utils.h"
+#include <math.h>
+
+void
+direct_force(const struct bodies *bodies,
+             const struct body   *body,
+             const float          gravity,
+             float               *force_x,
+             float               *force_y)
+{
+    *force_x = 0.0f;
+    *force_y = 0.0f;
+    // Padding bodies have no mass
+    body_kernel->force(body,
+                       bodies->x,
+                       bodies->y,
+                       bodies->mass,
+                       (bodies->count + 7) / 8 * 8,
+                       gravity,
+                       force_x,
+                       force_y);
+}
+
+struct direct_forces_job
+{
+    const struct bodies *bodies;
+    const uint32_t      *indices;
+    float                gravity;
+    float               *force_x;
+    float               *force_y;
+};
+
+static void
+direct_forces_func(const struct direct_forces_job *job, size_t start, size_t stop, size_t worker)
+{
+    (void)worker;
+    for (size_t i = start; i < stop; i++)
+    {
+        struct body body = bodies_get(job->bodies, job->indices[i]);
+        direct_force(job->bodies, &body, job->gravity, &job->force_x[i], &job->force_y[i]);
+    }
+}
+
+void
+direct_forces(const struct bodies *bodies,
+              const uint32_t      *indices,
+              size_t               count,
+              const float          gravity,
+              float               *force_x,
+              float               *force_y,
+              struct pool         *pool)
+{
+    struct direct_forces_job job = {
+        .bodies = bodies,
+        .indices = indices,
+        .gravity = gravity,
+        .force_x = force_x,
+        .force_y = force_y,
+    };
+    pool_run(pool, (pool_func)direct_forces_func, &job, count, 1);
+}
+
+struct direct_error_job
+{
+    const struct bodies *bodies;
+    const float         *force_x;
+    const float         *force_y;
+    float                gravity;
+    size_t               stride;
+    double              *errors;  // squared error and squared norm of each sample
+};
+
+static void
+direct_error_func(const struct direct_error_job *job, size_t start, size_t stop, size_t worker)
+{
+    (void)worker;
+    for (size_t i = start; i < stop; i++)
+    {
+        size_t      index = i * job->stride;
+        struct body body = bodies_get(job->bodies, index);
+        float       force_x, force_y;
+        direct_force(job->bodies, &body, job->gravity, &force_x, &force_y);
+        double error_x = (double)job->force_x[index] - force_x;
+        double error_y = (double)job->force_y[index] - force_y;
+        job->errors[2 * i] = error_x * error_x + error_y * error_y;
+        job->errors[2 * i + 1] = (double)force_x * force_x + (double)force_y * force_y;
+    }
+}
+
+double
+direct_force_error(const struct bodies *bodies,
+                   const float         *force_x,
+                   const float         *force_y,
+                   const float          gravity,
+                   size_t               samples,
+                   struct pool         *pool)
+{
+    if (samples > bodies->count)
+        samples = bodies->count;
+    if (samples == 0)
+        return 0.0;
+    struct direct_error_job job = {
+        .bodies = bodies,
+        .force_x = force_x,
+        .force_y = force_y,
+        .gravity = gravity,
+        .stride = bodies->count / samples,
+        .errors = xmalloc(sizeof(double) * 2 * samples),
+    };
+    pool_run(pool, (pool_func)direct_error_func, &job, samples, 1);
+    double error = 0.0, norm = 0.0;
+    for (size_t i = 0; i < samples; i++)
+    {
+        error += job.errors[2 * i];
+        norm += job.errors[2 * i + 1];
+    }
+    free(job.errors);
+    return norm == 0.0 ? 0.0 : sqrt(error / norm);
+}
@@ -0,0 +1,36 @@
+#ifndef DIRECT_H
+#define DIRECT_H
+
+#include "body.h"
+#include "pool.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Exact O(n) force on one body from all the others, used as the reference for the
+// approximations of the tree solvers.
+void
+direct_force(const struct bodies *bodies,
+             const struct body   *body,
+             const float          gravity,
+             float               *force_x,
+             float               *force_y);
+// Exact forces on the bodies `indices[0..count)`, computed in parallel
+void
+direct_forces(const struct bodies *bodies,
+              const uint32_t      *indices,
+              size_t               count,
+              const float          gravity,
+              float               *force_x,
+              float               *force_y,
+              struct pool         *pool);
+// Relative RMS error of the forces `force_x/y` (indexed like `bodies`) against the direct sum,
+// measured on `samples` bodies spread evenly over the arrays.
+double
+direct_force_error(const struct bodies *bodies,
+                   const float         *force_x,
+                   const float         *force_y,
+                   const float          gravity,
+                   size_t               samples,
+                   struct pool         *pool);
+
+#endif
@@ -1,5 +1,7 @@
+#define _POSIX_C_SOURCE 200809L
 #include "draw.h"
 #include "utils.h"
+#include <math.h>
 
 static const uint32_t window_width = 1000;
 static const uint32_t window_height = 1000;
@@ -9,6 +11,31 @@ static TTF_Font      *font = NULL;
 static const char    *font_paths[] = {"/usr/share/fonts/noto/NotoSansMono-SemiBold.ttf",
                                       "/System/Library/Fonts/SFNSMono.ttf"};
 
+// Bodies are splatted by the workers of `splat_pool` in their own accumulation buffer, the buffers
+// are then summed and tone mapped in `splat_texture`
+static struct pool   *splat_pool = NULL;
+static SDL_Texture   *splat_texture = NULL;
+static float         *splat_buffers = NULL;  // one per worker, window_width * window_height each
+static float         *splat_maxima = NULL;   // one per worker, 16 floats apart to not share lines
+
+// What the workers splat, collected from the nodes in the view: the bodies of a leaf, or a node
+// smaller than a pixel as a whole from its center of mass
+struct splat_item
+{
+    uint32_t node;
+    bool     aggregate;
+};
+static struct splat_item *splat_items = NULL;
+static size_t             splat_items_count = 0;
+static SDL_Rect          *quadtree_rects = NULL;  // of the visited nodes in debug mode
+static size_t             quadtree_rects_count = 0;
+static size_t             nodes_capacity = 0;  // of the two arrays above
+
+// World coordinates at the center of the window and pixels per unit of length
+static float camera_x;
+static float camera_y;
+static float camera_scale;
+
 #define SDL_ASSERT_NO_ERROR                                                           \
     do                                                                                \
     {                                                                                 \
@@ -22,12 +49,42 @@ static const char    *font_paths[] = {"/usr/share/fonts/noto/NotoSansMono-SemiBo
 static struct timespec previous_time;
 
 static void
-draw_bodies(struct body *bodies, size_t bodies_count, bool mass);
+draw_bodies(const struct snapshot *snapshot, bool mass, bool quadtree);
+
+// Shows [-0.5, 1.5] on both axes
+static void
+camera_reset(void)
+{
+    camera_x = 0.5f;
+    camera_y = 0.5f;
+    camera_scale = (float)window_width / 2.0f;
+}
+
+// Multiply the scale by `factor` keeping the point under the canvas position in place
 static void
-draw_quadtree(struct quadtree *quadtree, unsigned int depth);
+camera_zoom(float factor, float canvas_x, float canvas_y)
+{
+    float offset_x = canvas_x - (float)window_width / 2.0f;
+    float offset_y = canvas_y - (float)window_height / 2.0f;
+    camera_x += offset_x / camera_scale - offset_x / (camera_scale * factor);
+    camera_y += offset_y / camera_scale - offset_y / (camera_scale * factor);
+    camera_scale *= factor;
+}
+
+static inline float
+canvas_x(float x)
+{
+    return (x - camera_x) * camera_scale + (float)window_width / 2.0f;
+}
+
+static inline float
+canvas_y(float y)
+{
+    return (y - camera_y) * camera_scale + (float)window_height / 2.0f;
+}
 
 void
-draw_init()
+draw_init(struct pool *pool)
 {
     SDL_Init(SDL_INIT_VIDEO);
     SDL_ASSERT_NO_ERROR;
@@ -46,12 +103,30 @@ draw_init()
     if (font == NULL)
         die("Cannot open font");
     SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_ADD);
+    splat_texture = SDL_CreateTexture(renderer,
+                                      SDL_PIXELFORMAT_ARGB8888,
+                                      SDL_TEXTUREACCESS_STREAMING,
+                                      window_width,
+                                      window_height);
+    SDL_ASSERT_NO_ERROR;
+    splat_pool = pool;
+    size_t workers_count = pool_workers_count(pool);
+    size_t pixels_count = (size_t)window_width * window_height;
+    splat_buffers = xaligned_alloc(64, sizeof(float) * pixels_count * workers_count);
+    memset(splat_buffers, 0, sizeof(float) * pixels_count * workers_count);
+    splat_maxima = xaligned_alloc(64, sizeof(float) * 16 * workers_count);
+    camera_reset();
     clock_gettime(CLOCK_MONOTONIC, &previous_time);
 }
 
 void
 draw_quit()
 {
+    free(splat_buffers);
+    free(splat_maxima);
+    free(splat_items);
+    free(quadtree_rects);
+    SDL_DestroyTexture(splat_texture);
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     TTF_CloseFont(font);
@@ -59,46 +134,74 @@ draw_quit()
     SDL_Quit();
 }
 
-void
+bool
 draw_handle_events(bool *running, bool *paused)
 {
+    float     previous_x = camera_x;
+    float     previous_y = camera_y;
+    float     previous_scale = camera_scale;
+    float     pan = 50.0f / camera_scale;
     SDL_Event e;
     while (SDL_PollEvent(&e))
     {
         switch (e.type)
         {
         case SDL_QUIT: *running = false; break;
+        case SDL_MOUSEWHEEL:
+        {
+            int mouse_x, mouse_y;
+            SDL_GetMouseState(&mouse_x, &mouse_y);
+            camera_zoom(powf(1.25f, e.wheel.y), mouse_x, mouse_y);
+            break;
+        }
+        case SDL_MOUSEMOTION:
+            if (e.motion.state & SDL_BUTTON_LMASK)
+            {
+                camera_x -= e.motion.xrel / camera_scale;
+                camera_y -= e.motion.yrel / camera_scale;
+            }
+            break;
         case SDL_KEYDOWN:
             switch (e.key.keysym.sym)
             {
             case SDLK_q:
             case SDLK_ESCAPE: *running = false; break;
             case SDLK_SPACE: *paused = !(*paused); break;
+            case SDLK_PLUS:
+            case SDLK_EQUALS:
+            case SDLK_KP_PLUS: camera_zoom(1.25f, window_width / 2.0f, window_height / 2.0f); break;
+            case SDLK_MINUS:
+            case SDLK_KP_MINUS: camera_zoom(0.8f, window_width / 2.0f, window_height / 2.0f); break;
+            case SDLK_LEFT: camera_x -= pan; break;
+            case SDLK_RIGHT: camera_x += pan; break;
+            case SDLK_UP: camera_y -= pan; break;
+            case SDLK_DOWN: camera_y += pan; break;
+            case SDLK_r: camera_reset(); break;
             }
         }
     }
+    return camera_x != previous_x || camera_y != previous_y || camera_scale != previous_scale;
 }
 
+// The simulation runs at its own rate, steps_per_second is shown next to the frames per second
 long int
-draw_update(struct body *bodies, size_t bodies_count, bool mass, struct quadtree *quadtree)
+draw_update(const struct snapshot *snapshot, bool mass, bool quadtree, double steps_per_second)
 {
     SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
     SDL_RenderClear(renderer);
-    if (quadtree != NULL)
-        draw_quadtree(quadtree, 0);
-    draw_bodies(bodies, bodies_count, mass);
+    draw_bodies(snapshot, mass, quadtree);
 
     // Compute FPS and display it
     struct timespec current_time;
     clock_gettime(CLOCK_MONOTONIC, &current_time);
-    long int time_difference = current_time.tv_nsec - previous_time.tv_nsec;
-    time_difference /= 1000000;
+    double   elapsed = (double)(current_time.tv_sec - previous_time.tv_sec) +
+                       (double)(current_time.tv_nsec - previous_time.tv_nsec) / 1e9;
     long int fps = 0;
-    if (time_difference > 0)
+    if (elapsed > 0.0)
     {
-        fps = 1000 / time_difference;
+        fps = lround(1.0 / elapsed);
         char     buf[128] = {0};
-        snprintf(buf, 128, "%ld fps", fps);
+        snprintf(buf, 128, "%ld fps, %.0f steps/s", fps, steps_per_second);
         SDL_Surface *surface = TTF_RenderText_Solid(font, buf, (SDL_Color){100, 255, 100, 255});
         SDL_Texture *texture = SDL_CreateTextureFromSurface(renderer, surface);
         SDL_FreeSurface(surface);
@@ -112,56 +215,171 @@ draw_update(struct body *bodies, size_t bodies_count, bool mass, struct quadtree
     return fps;
 }
 
+struct splat_job
+{
+    const struct snapshot *snapshot;
+    bool                   mass;
+    uint32_t              *pixels;
+    size_t                 pitch;  // in pixels
+    float                  scale;  // of the tone mapping, 1 / log(1 + maximum)
+};
+
+static inline void
+splat_add(float *buffer, float x, float y, float weight)
+{
+    float pixel_x = canvas_x(x);
+    float pixel_y = canvas_y(y);
+    // Also false for NaN
+    if (!(pixel_x >= 0.0f && pixel_x < (float)window_width && pixel_y >= 0.0f &&
+          pixel_y < (float)window_height))
+        return;
+    buffer[(uint32_t)pixel_y * window_width + (uint32_t)pixel_x] += weight;
+}
+
+// Add the items to the buffer of the worker, bodies are weighted by their mass or 1
+static void
+splat_items_func(const struct splat_job *job, size_t start, size_t stop, size_t worker)
+{
+    const struct snapshot *snapshot = job->snapshot;
+    float                 *buffer = splat_buffers + worker * window_width * window_height;
+    for (size_t i = start; i < stop; i++)
+    {
+        uint32_t                    index = splat_items[i].node;
+        const struct quadtree_node *node = &snapshot->nodes[index];
+        if (splat_items[i].aggregate)
+        {
+            float weight = job->mass ? node->total_mass : snapshot->nodes_bodies_count[index];
+            splat_add(buffer, node->center_of_mass_x, node->center_of_mass_y, weight);
+            continue;
+        }
+        const uint32_t *bodies = &snapshot->bucket_index[node->external.bucket];
+        for (uint32_t k = 0; k < node->external.bodies_count; k++)
+        {
+            uint32_t j = bodies[k];
+            splat_add(buffer, snapshot->x[j], snapshot->y[j], job->mass ? snapshot->mass[j] : 1.0f);
+        }
+    }
+}
+
+// Visit the nodes in the view down to the leaves or to nodes smaller than a pixel, so that the
+// bodies out of the view are never touched and a dense region costs as much as its pixels
+static void
+splat_collect(const struct snapshot *snapshot, uint32_t index, bool quadtree)
+{
+    const struct quadtree_node *node = &snapshot->nodes[index];
+    if (node->type == QUADTREE_EMPTY)
+        return;
+    float start_x = canvas_x(node->start_x);
+    float start_y = canvas_y(node->start_y);
+    float end_x = canvas_x(node->end_x);
+    float end_y = canvas_y(node->end_y);
+    if (end_x < 0.0f || start_x >= (float)window_width || end_y < 0.0f ||
+        start_y >= (float)window_height)
+        return;
+    if (quadtree)
+        quadtree_rects[quadtree_rects_count++] = (SDL_Rect){
+            .x = start_x,
+            .y = start_y,
+            .w = end_x - start_x,
+            .h = end_y - start_y,
+        };
+    if (end_x - start_x < 1.0f && end_y - start_y < 1.0f)
+        splat_items[splat_items_count++] = (struct splat_item){.node = index, .aggregate = true};
+    else if (node->type == QUADTREE_EXTERNAL)
+        splat_items[splat_items_count++] = (struct splat_item){.node = index, .aggregate = false};
+    else
+    {
+        splat_collect(snapshot, node->internal.nw, quadtree);
+        splat_collect(snapshot, node->internal.ne, quadtree);
+        splat_collect(snapshot, node->internal.sw, quadtree);
+        splat_collect(snapshot, node->internal.se, quadtree);
+    }
+}
+
+// Sum the buffers of a range of rows into the first one, clearing the others for the next frame
 static void
-draw_bodies(struct body *bodies, size_t bodies_count, bool mass)
-{
-    static SDL_Point *bodies_points = NULL;
-    if (bodies_points == NULL)
-        bodies_points = xmalloc(sizeof(SDL_Point) * bodies_count);
-    SDL_SetRenderDrawColor(renderer, 255, 255, 255, 100);
-    size_t points_i = 0;
-    for (size_t i = 0; i < bodies_count; i++)
+splat_merge_func(const struct splat_job *job, size_t start, size_t stop, size_t worker)
+{
+    (void)job;
+    size_t workers_count = pool_workers_count(splat_pool);
+    size_t pixels_count = (size_t)window_width * window_height;
+    float  maximum = splat_maxima[worker * 16];
+    for (size_t i = start * window_width; i < stop * window_width; i++)
     {
-        uint32_t canvas_x = (bodies[i].x / 2.0f + 0.25f) * (float)window_width;
-        uint32_t canvas_y = (bodies[i].y / 2.0f + 0.25f) * (float)window_height;
-        if (!mass)
+        float sum = splat_buffers[i];
+        for (size_t w = 1; w < workers_count; w++)
         {
-            if (canvas_x > window_width || canvas_y > window_height)
-                continue;
-            bodies_points[points_i].x = canvas_x;
-            bodies_points[points_i].y = canvas_y;
-            points_i++;
+            sum += splat_buffers[w * pixels_count + i];
+            splat_buffers[w * pixels_count + i] = 0.0f;
         }
-        else
+        splat_buffers[i] = sum;
+        if (sum > maximum)
+            maximum = sum;
+    }
+    splat_maxima[worker * 16] = maximum;
+}
+
+// Logarithmic tone mapping of a range of rows in the texture, the densest pixel is white
+static void
+splat_tone_map_func(const struct splat_job *job, size_t start, size_t stop, size_t worker)
+{
+    (void)worker;
+    for (size_t y = start; y < stop; y++)
+    {
+        float    *row = splat_buffers + y * window_width;
+        uint32_t *pixels = job->pixels + y * job->pitch;
+        for (size_t x = 0; x < window_width; x++)
         {
-            uint32_t radius = 30 * bodies[i].mass;
-            aacircleRGBA(renderer, canvas_x, canvas_y, radius, 255, 255, 255, 255);
+            // Most of the window is empty
+            if (row[x] == 0.0f)
+            {
+                pixels[x] = 0xff000000;
+                continue;
+            }
+            uint32_t level = 255.0f * log1pf(row[x]) * job->scale;
+            pixels[x] = 0xff000000 | level << 16 | level << 8 | level;
+            row[x] = 0.0f;
         }
     }
-    if (!mass)
-        SDL_RenderDrawPoints(renderer, bodies_points, points_i);
 }
 
 static void
-draw_quadtree(struct quadtree *quadtree, unsigned int depth)
-{
-    int32_t canvas_start_x = (quadtree->start_x / 2.0f + 0.25f) * (float)window_width;
-    int32_t canvas_start_y = (quadtree->start_y / 2.0f + 0.25f) * (float)window_height;
-    int32_t canvas_end_x = (quadtree->end_x / 2.0f + 0.25f) * (float)window_width;
-    int32_t canvas_end_y = (quadtree->end_y / 2.0f + 0.25f) * (float)window_height;
-    SDL_SetRenderDrawColor(renderer, 255, 255, 255, 50);
-    SDL_Rect r = {
-        .x = canvas_start_x,
-        .y = canvas_start_y,
-        .w = canvas_end_x - canvas_start_x,
-        .h = canvas_end_y - canvas_start_y,
-    };
-    SDL_RenderDrawRect(renderer, &r);
-    if (quadtree->type == QUADTREE_INTERNAL)
+draw_bodies(const struct snapshot *snapshot, bool mass, bool quadtree)
+{
+    if (snapshot->nodes_count > nodes_capacity)
+    {
+        free(splat_items);
+        free(quadtree_rects);
+        nodes_capacity = snapshot->nodes_count;
+        splat_items = xmalloc(sizeof(struct splat_item) * nodes_capacity);
+        quadtree_rects = xmalloc(sizeof(SDL_Rect) * nodes_capacity);
+    }
+    splat_items_count = 0;
+    quadtree_rects_count = 0;
+    splat_collect(snapshot, QUADTREE_ROOT, quadtree);
+
+    struct splat_job job = {.snapshot = snapshot, .mass = mass};
+    size_t           workers_count = pool_workers_count(splat_pool);
+    for (size_t w = 0; w < workers_count; w++)
+        splat_maxima[w * 16] = 0.0f;
+    pool_run(splat_pool, (pool_func)splat_items_func, &job, splat_items_count, 16);
+    pool_run(splat_pool, (pool_func)splat_merge_func, &job, window_height, 16);
+    float maximum = 0.0f;
+    for (size_t w = 0; w < workers_count; w++)
+        maximum = fmaxf(maximum, splat_maxima[w * 16]);
+    job.scale = maximum > 0.0f ? 1.0f / log1pf(maximum) : 0.0f;
+
+    void *pixels;
+    int   pitch;
+    SDL_LockTexture(splat_texture, NULL, &pixels, &pitch);
+    job.pixels = pixels;
+    job.pitch = pitch / sizeof(uint32_t);
+    pool_run(splat_pool, (pool_func)splat_tone_map_func, &job, window_height, 16);
+    SDL_UnlockTexture(splat_texture);
+    SDL_RenderCopy(renderer, splat_texture, NULL, NULL);
+    if (quadtree)
     {
-        draw_quadtree(quadtree->internal.nw, depth + 1);
-        draw_quadtree(quadtree->internal.ne, depth + 1);
-        draw_quadtree(quadtree->internal.sw, depth + 1);
-        draw_quadtree(quadtree->internal.se, depth + 1);
+        SDL_SetRenderDrawColor(renderer, 255, 255, 255, 50);
+        SDL_RenderDrawRects(renderer, quadtree_rects, quadtree_rects_count);
     }
 }
@@ -2,20 +2,24 @@
 #define DRAW_H
 
 #include "body.h"
+#include "pool.h"
 #include "quadtree.h"
+#include "snapshot.h"
 #include <SDL2/SDL.h>
 #include <SDL2/SDL2_gfxPrimitives.h>
 #include <SDL2/SDL_ttf.h>
 #include <stdbool.h>
 #include <time.h>
 
+// Bodies are drawn in parallel on `pool`, which must not be used by another thread meanwhile
 void
-draw_init();
+draw_init(struct pool *pool);
 void
 draw_quit();
-void
+// True if the camera moved
+bool
 draw_handle_events(bool *running, bool *paused);
 long int
-draw_update(struct body *bodies, size_t bodies_count, bool mass, struct quadtree *quadtree);
+draw_update(const struct snapshot *snapshot, bool mass, bool quadtree, double steps_per_second);
 
 #endif
@@ -0,0 +1,528 @@
+#include "fmm.h"
+#include "body.h"
+#include "utils.h"
+#include <math.h>
+#include <stdlib.h>
+
+static inline size_t
+fmm_index(unsigned int a, unsigned int b)
+{
+    unsigned int n = a + b;
+    return n * (n + 1) / 2 + b;
+}
+
+void
+fmm_init(struct fmm *fmm, unsigned int order)
+{
+    if (order > FMM_MAX_ORDER)
+        die("Expansion order %u is greater than the maximum of %u", order, FMM_MAX_ORDER);
+    memset(fmm, 0, sizeof *fmm);
+    fmm->order = order;
+    fmm->coefficients_count = (order + 1) * (order + 2) / 2;
+    double factorial = 1.0;
+    for (unsigned int n = 0; n <= FMM_MAX_ORDER; n++)
+    {
+        if (n > 0)
+            factorial *= n;
+        fmm->factorial_inverse[n] = 1.0 / factorial;
+        for (unsigned int k = 0; k <= n; k++)
+            fmm->binomial[n][k] =
+                k == 0 || k == n ? 1.0 : fmm->binomial[n - 1][k - 1] + fmm->binomial[n - 1][k];
+    }
+    for (unsigned int n1 = 0; n1 <= order; n1++)
+        for (unsigned int b1 = 0; b1 <= n1; b1++)
+            for (unsigned int n2 = 0; n2 <= order - n1; n2++)
+                for (unsigned int b2 = 0; b2 <= n2; b2++)
+                    fmm->sum_index[fmm_index(n1 - b1, b1)][fmm_index(n2 - b2, b2)] =
+                        fmm_index(n1 - b1 + n2 - b2, b1 + b2);
+}
+
+void
+fmm_destroy(struct fmm *fmm)
+{
+    free(fmm->multipoles);
+    free(fmm->locals);
+    free(fmm->radius);
+    free(fmm->force_x);
+    free(fmm->force_y);
+    free(fmm->tasks);
+    memset(fmm, 0, sizeof *fmm);
+}
+
+static void
+fmm_reserve(struct fmm *fmm, size_t nodes_count, size_t bodies_count)
+{
+    if (fmm->nodes_capacity < nodes_count)
+    {
+        free(fmm->multipoles);
+        free(fmm->locals);
+        free(fmm->radius);
+        fmm->multipoles = xmalloc(sizeof(double) * fmm->coefficients_count * nodes_count);
+        fmm->locals = xmalloc(sizeof(double) * fmm->coefficients_count * nodes_count);
+        fmm->radius = xmalloc(sizeof(float) * nodes_count);
+        fmm->nodes_capacity = nodes_count;
+    }
+    if (fmm->bodies_capacity < bodies_count)
+    {
+        free(fmm->force_x);
+        free(fmm->force_y);
+        fmm->force_x = xmalloc(sizeof(float) * bodies_count);
+        fmm->force_y = xmalloc(sizeof(float) * bodies_count);
+        fmm->bodies_capacity = bodies_count;
+    }
+}
+
+static void
+fmm_powers(double x, unsigned int order, double *powers)
+{
+    powers[0] = 1.0;
+    for (unsigned int i = 1; i <= order; i++)
+        powers[i] = powers[i - 1] * x;
+}
+
+// x^i / i!
+static void
+fmm_scaled_powers(const struct fmm *fmm, double x, double *powers)
+{
+    fmm_powers(x, fmm->order, powers);
+    for (unsigned int i = 0; i <= fmm->order; i++)
+        powers[i] *= fmm->factorial_inverse[i];
+}
+
+// Partial derivatives d^(t+u) / dx^t dy^u of 1 / r at (x, y) up to `order` with the
+// McMurchie-Davidson recursion on the Hermite integrals r[n][t][u]:
+//   r[n][0][0] = (-1)^n (2n - 1)!! / r^(2n + 1)
+//   r[n][t + 1][u] = t r[n + 1][t - 1][u] + x r[n + 1][t][u]  (same for u with y)
+static void
+fmm_derivatives(unsigned int order, double x, double y, double *derivatives)
+{
+    double r[FMM_MAX_ORDER + 1][FMM_MAX_ORDER + 1][FMM_MAX_ORDER + 1];
+    double inverse_square = 1.0 / (x * x + y * y);
+    double value = sqrt(inverse_square);
+    for (unsigned int n = 0; n <= order; n++)
+    {
+        r[n][0][0] = value;
+        value *= -(double)(2 * n + 1) * inverse_square;
+    }
+    for (unsigned int s = 1; s <= order; s++)
+        for (unsigned int n = 0; n <= order - s; n++)
+            for (unsigned int t = 0; t <= s; t++)
+            {
+                unsigned int u = s - t;
+                if (t > 0)
+                    r[n][t][u] = x * r[n + 1][t - 1][u] +
+                                 (t > 1 ? (t - 1) * r[n + 1][t - 2][u] : 0.0);
+                else
+                    r[n][t][u] = y * r[n + 1][t][u - 1] +
+                                 (u > 1 ? (u - 1) * r[n + 1][t][u - 2] : 0.0);
+            }
+    for (unsigned int s = 0; s <= order; s++)
+        for (unsigned int u = 0; u <= s; u++)
+            derivatives[fmm_index(s - u, u)] = r[0][s - u][u];
+}
+
+// P2M: M(a, b) = sum of m dx^a dy^b / (a! b!) with (dx, dy) from the center of mass
+static void
+fmm_leaf_multipole(struct fmm *fmm, const struct quadtree *quadtree, uint32_t index)
+{
+    const struct quadtree_node *node = &quadtree->nodes[index];
+    double                     *multipole = &fmm->multipoles[index * fmm->coefficients_count];
+    double                      powers_x[FMM_MAX_ORDER + 1];
+    double                      powers_y[FMM_MAX_ORDER + 1];
+    memset(multipole, 0, sizeof(double) * fmm->coefficients_count);
+    fmm->radius[index] = 0.0f;
+    for (uint32_t lane = node->external.bucket;
+         lane < node->external.bucket + node->external.bodies_count;
+         lane++)
+    {
+        double mass = quadtree->bucket_mass[lane];
+        float  dx = quadtree->bucket_x[lane] - node->center_of_mass_x;
+        float  dy = quadtree->bucket_y[lane] - node->center_of_mass_y;
+        fmm->radius[index] = fmaxf(fmm->radius[index], sqrtf(dx * dx + dy * dy));
+        fmm_scaled_powers(fmm, dx, powers_x);
+        fmm_scaled_powers(fmm, dy, powers_y);
+        for (unsigned int n = 0; n <= fmm->order; n++)
+            for (unsigned int b = 0; b <= n; b++)
+                multipole[fmm_index(n - b, b)] += mass * powers_x[n - b] * powers_y[b];
+        fmm->force_x[quadtree->bucket_index[lane]] = 0.0f;
+        fmm->force_y[quadtree->bucket_index[lane]] = 0.0f;
+    }
+}
+
+// M2M: move a multipole expansion by (dx, dy) = old center - new center and add it to `parent`
+static void
+fmm_multipole_translate(const struct fmm *fmm,
+                        const double     *child,
+                        double            dx,
+                        double            dy,
+                        double           *parent)
+{
+    double powers_x[FMM_MAX_ORDER + 1];
+    double powers_y[FMM_MAX_ORDER + 1];
+    fmm_scaled_powers(fmm, dx, powers_x);
+    fmm_scaled_powers(fmm, dy, powers_y);
+    for (unsigned int n = 0; n <= fmm->order; n++)
+        for (unsigned int b = 0; b <= n; b++)
+        {
+            unsigned int a = n - b;
+            double       sum = 0.0;
+            for (unsigned int child_a = 0; child_a <= a; child_a++)
+                for (unsigned int child_b = 0; child_b <= b; child_b++)
+                    sum += child[fmm_index(child_a, child_b)] * powers_x[a - child_a] *
+                           powers_y[b - child_b];
+            parent[fmm_index(a, b)] += sum;
+        }
+}
+
+// M2L: local expansion at (dx, dy) = local center - multipole center of a multipole expansion
+//   L(b) = 1 / b! sum over a of (-1)^|a| M(a) D(a + b)
+static void
+fmm_multipole_to_local(const struct fmm *fmm,
+                       const double     *multipole,
+                       double            dx,
+                       double            dy,
+                       double           *local)
+{
+    double derivatives[FMM_MAX_COEFFICIENTS];
+    double signed_multipole[FMM_MAX_COEFFICIENTS];
+    fmm_derivatives(fmm->order, dx, dy, derivatives);
+    for (unsigned int n = 0; n <= fmm->order; n++)
+        for (size_t i = n * (n + 1) / 2; i < (n + 1) * (n + 2) / 2; i++)
+            signed_multipole[i] = n % 2 == 0 ? multipole[i] : -multipole[i];
+    for (unsigned int local_n = 0; local_n <= fmm->order; local_n++)
+    {
+        // Orders of the multipole that fit with this order of the local expansion
+        size_t multipole_count = (fmm->order - local_n + 1) * (fmm->order - local_n + 2) / 2;
+        for (unsigned int local_b = 0; local_b <= local_n; local_b++)
+        {
+            unsigned int   local_a = local_n - local_b;
+            size_t         local_index = fmm_index(local_a, local_b);
+            const uint8_t *sum_index = fmm->sum_index[local_index];
+            double         sum = 0.0;
+            for (size_t i = 0; i < multipole_count; i++)
+                sum += signed_multipole[i] * derivatives[sum_index[i]];
+            local[local_index] +=
+                sum * fmm->factorial_inverse[local_a] * fmm->factorial_inverse[local_b];
+        }
+    }
+}
+
+// L2L: move a local expansion by (dx, dy) = new center - old center and add it to `child`
+static void
+fmm_local_translate(const struct fmm *fmm,
+                    const double     *parent,
+                    double            dx,
+                    double            dy,
+                    double           *child)
+{
+    double powers_x[FMM_MAX_ORDER + 1];
+    double powers_y[FMM_MAX_ORDER + 1];
+    fmm_powers(dx, fmm->order, powers_x);
+    fmm_powers(dy, fmm->order, powers_y);
+    for (unsigned int child_n = 0; child_n <= fmm->order; child_n++)
+        for (unsigned int child_b = 0; child_b <= child_n; child_b++)
+        {
+            unsigned int child_a = child_n - child_b;
+            double       sum = 0.0;
+            for (unsigned int n = child_n; n <= fmm->order; n++)
+                for (unsigned int b = child_b; b <= n - child_a; b++)
+                {
+                    unsigned int a = n - b;
+                    sum += parent[fmm_index(a, b)] * fmm->binomial[a][child_a] *
+                           fmm->binomial[b][child_b] * powers_x[a - child_a] *
+                           powers_y[b - child_b];
+                }
+            child[fmm_index(child_a, child_b)] += sum;
+        }
+}
+
+// L2P: gradient of the potential of a local expansion at (dx, dy) from its center
+static void
+fmm_local_gradient(const struct fmm *fmm,
+                   const double     *local,
+                   double            dx,
+                   double            dy,
+                   double           *gradient_x,
+                   double           *gradient_y)
+{
+    double powers_x[FMM_MAX_ORDER + 1];
+    double powers_y[FMM_MAX_ORDER + 1];
+    fmm_powers(dx, fmm->order, powers_x);
+    fmm_powers(dy, fmm->order, powers_y);
+    *gradient_x = 0.0;
+    *gradient_y = 0.0;
+    for (unsigned int n = 1; n <= fmm->order; n++)
+        for (unsigned int b = 0; b <= n; b++)
+        {
+            unsigned int a = n - b;
+            double       coefficient = local[fmm_index(a, b)];
+            if (a > 0)
+                *gradient_x += coefficient * a * powers_x[a - 1] * powers_y[b];
+            if (b > 0)
+                *gradient_y += coefficient * b * powers_x[a] * powers_y[b - 1];
+        }
+}
+
+// Multipole and radius of an internal node from the ones of its children
+static void
+fmm_upward_internal(struct fmm *fmm, const struct quadtree *quadtree, uint32_t index)
+{
+    const struct quadtree_node *node = &quadtree->nodes[index];
+    const uint32_t              children[4] = {
+        node->internal.nw, node->internal.ne, node->internal.sw, node->internal.se};
+    double *multipole = &fmm->multipoles[index * fmm->coefficients_count];
+    memset(multipole, 0, sizeof(double) * fmm->coefficients_count);
+    fmm->radius[index] = 0.0f;
+    for (unsigned int i = 0; i < 4; i++)
+    {
+        const struct quadtree_node *child = &quadtree->nodes[children[i]];
+        if (child->type == QUADTREE_EMPTY)
+            continue;
+        float dx = child->center_of_mass_x - node->center_of_mass_x;
+        float dy = child->center_of_mass_y - node->center_of_mass_y;
+        fmm_multipole_translate(fmm,
+                                &fmm->multipoles[children[i] * fmm->coefficients_count],
+                                dx,
+                                dy,
+                                multipole);
+        fmm->radius[index] =
+            fmaxf(fmm->radius[index], sqrtf(dx * dx + dy * dy) + fmm->radius[children[i]]);
+    }
+}
+
+// Multipoles of a subtree, also clears the local expansions and forces it will receive
+static void
+fmm_upward_node(struct fmm *fmm, const struct quadtree *quadtree, uint32_t index)
+{
+    const struct quadtree_node *node = &quadtree->nodes[index];
+    if (node->type == QUADTREE_EMPTY)
+        return;
+    memset(&fmm->locals[index * fmm->coefficients_count],
+           0,
+           sizeof(double) * fmm->coefficients_count);
+    if (node->type == QUADTREE_EXTERNAL)
+    {
+        fmm_leaf_multipole(fmm, quadtree, index);
+        return;
+    }
+    fmm_upward_node(fmm, quadtree, node->internal.nw);
+    fmm_upward_node(fmm, quadtree, node->internal.ne);
+    fmm_upward_node(fmm, quadtree, node->internal.sw);
+    fmm_upward_node(fmm, quadtree, node->internal.se);
+    fmm_upward_internal(fmm, quadtree, index);
+}
+
+// Multipoles of the nodes above the tasks, once the workers are done with the tasks
+static void
+fmm_upward_top(struct fmm *fmm, const struct quadtree *quadtree, uint32_t index, unsigned depth)
+{
+    const struct quadtree_node *node = &quadtree->nodes[index];
+    if (node->type != QUADTREE_INTERNAL || depth == fmm->tasks_depth)
+        return;
+    fmm_upward_top(fmm, quadtree, node->internal.nw, depth + 1);
+    fmm_upward_top(fmm, quadtree, node->internal.ne, depth + 1);
+    fmm_upward_top(fmm, quadtree, node->internal.sw, depth + 1);
+    fmm_upward_top(fmm, quadtree, node->internal.se, depth + 1);
+    fmm_upward_internal(fmm, quadtree, index);
+}
+
+// P2P: direct force of the bodies of `source` on the bodies of `target`
+static void
+fmm_direct(struct fmm                 *fmm,
+           const struct quadtree      *quadtree,
+           const struct quadtree_node *target,
+           const struct quadtree_node *source,
+           const float                 gravity)
+{
+    for (uint32_t lane = target->external.bucket;
+         lane < target->external.bucket + target->external.bodies_count;
+         lane++)
+    {
+        struct body body = {
+            .x = quadtree->bucket_x[lane],
+            .y = quadtree->bucket_y[lane],
+            .mass = quadtree->bucket_mass[lane],
+        };
+        uint32_t j = quadtree->bucket_index[lane];
+        body_kernel->force(&body,
+                           &quadtree->bucket_x[source->external.bucket],
+                           &quadtree->bucket_y[source->external.bucket],
+                           &quadtree->bucket_mass[source->external.bucket],
+                           (source->external.bodies_count + 7) / 8 * 8,
+                           gravity,
+                           &fmm->force_x[j],
+                           &fmm->force_y[j]);
+    }
+}
+
+// Dual tree traversal: cells far enough from each other go through M2L, close leaves through
+// P2P and otherwise the bigger cell is split. Two cells are far enough if their radiuses add up
+// to less than the theta of the quadtree times the distance between their centers.
+// Only `target` and its subtree are written.
+static void
+fmm_interact(struct fmm            *fmm,
+             const struct quadtree *quadtree,
+             uint32_t               target,
+             uint32_t               source,
+             const float            gravity)
+{
+    const struct quadtree_node *target_node = &quadtree->nodes[target];
+    const struct quadtree_node *source_node = &quadtree->nodes[source];
+    if (source_node->type == QUADTREE_EMPTY)
+        return;
+    float dx = target_node->center_of_mass_x - source_node->center_of_mass_x;
+    float dy = target_node->center_of_mass_y - source_node->center_of_mass_y;
+    float radius = fmm->radius[target] + fmm->radius[source];
+    if (radius * radius < quadtree->theta * quadtree->theta * (dx * dx + dy * dy))
+    {
+        fmm_multipole_to_local(fmm,
+                               &fmm->multipoles[source * fmm->coefficients_count],
+                               dx,
+                               dy,
+                               &fmm->locals[target * fmm->coefficients_count]);
+        return;
+    }
+    if (target_node->type == QUADTREE_EXTERNAL && source_node->type == QUADTREE_EXTERNAL)
+    {
+        fmm_direct(fmm, quadtree, target_node, source_node, gravity);
+        return;
+    }
+    if (source_node->type == QUADTREE_EXTERNAL ||
+        (target_node->type == QUADTREE_INTERNAL && fmm->radius[target] >= fmm->radius[source]))
+    {
+        const uint32_t children[4] = {target_node->internal.nw,
+                                      target_node->internal.ne,
+                                      target_node->internal.sw,
+                                      target_node->internal.se};
+        for (unsigned int i = 0; i < 4; i++)
+            if (quadtree->nodes[children[i]].type != QUADTREE_EMPTY)
+                fmm_interact(fmm, quadtree, children[i], source, gravity);
+        return;
+    }
+    fmm_interact(fmm, quadtree, target, source_node->internal.nw, gravity);
+    fmm_interact(fmm, quadtree, target, source_node->internal.ne, gravity);
+    fmm_interact(fmm, quadtree, target, source_node->internal.sw, gravity);
+    fmm_interact(fmm, quadtree, target, source_node->internal.se, gravity);
+}
+
+// L2L down to the leaves then L2P on their bodies
+static void
+fmm_downward(struct fmm *fmm, const struct quadtree *quadtree, uint32_t index, const float gravity)
+{
+    const struct quadtree_node *node = &quadtree->nodes[index];
+    const double               *local = &fmm->locals[index * fmm->coefficients_count];
+    if (node->type == QUADTREE_EXTERNAL)
+    {
+        for (uint32_t lane = node->external.bucket;
+             lane < node->external.bucket + node->external.bodies_count;
+             lane++)
+        {
+            double gradient_x, gradient_y;
+            fmm_local_gradient(fmm,
+                               local,
+                               (double)quadtree->bucket_x[lane] - node->center_of_mass_x,
+                               (double)quadtree->bucket_y[lane] - node->center_of_mass_y,
+                               &gradient_x,
+                               &gradient_y);
+            // The force is -G m grad(potential), pointing away from the sources like the kernels
+            uint32_t j = quadtree->bucket_index[lane];
+            double   scale = (double)gravity * quadtree->bucket_mass[lane];
+            fmm->force_x[j] -= (float)(scale * gradient_x);
+            fmm->force_y[j] -= (float)(scale * gradient_y);
+        }
+        return;
+    }
+    const uint32_t children[4] = {
+        node->internal.nw, node->internal.ne, node->internal.sw, node->internal.se};
+    for (unsigned int i = 0; i < 4; i++)
+    {
+        const struct quadtree_node *child = &quadtree->nodes[children[i]];
+        if (child->type == QUADTREE_EMPTY)
+            continue;
+        fmm_local_translate(fmm,
+                            local,
+                            (double)child->center_of_mass_x - node->center_of_mass_x,
+                            (double)child->center_of_mass_y - node->center_of_mass_y,
+                            &fmm->locals[children[i] * fmm->coefficients_count]);
+        fmm_downward(fmm, quadtree, children[i], gravity);
+    }
+}
+
+// Subtrees at `tasks_depth` (or shallower leaves) are independent targets for the workers
+static void
+fmm_collect_tasks(struct fmm            *fmm,
+                  const struct quadtree *quadtree,
+                  uint32_t               index,
+                  unsigned int           depth)
+{
+    const struct quadtree_node *node = &quadtree->nodes[index];
+    if (node->type == QUADTREE_EMPTY)
+        return;
+    if (node->type == QUADTREE_EXTERNAL || depth == fmm->tasks_depth)
+    {
+        if (fmm->tasks_count == fmm->tasks_capacity)
+        {
+            fmm->tasks_capacity = fmm->tasks_capacity == 0 ? 64 : fmm->tasks_capacity * 2;
+            fmm->tasks = realloc(fmm->tasks, sizeof(uint32_t) * fmm->tasks_capacity);
+            if (fmm->tasks == NULL)
+                die("Cannot grow multipole tasks");
+        }
+        fmm->tasks[fmm->tasks_count++] = index;
+        return;
+    }
+    fmm_collect_tasks(fmm, quadtree, node->internal.nw, depth + 1);
+    fmm_collect_tasks(fmm, quadtree, node->internal.ne, depth + 1);
+    fmm_collect_tasks(fmm, quadtree, node->internal.sw, depth + 1);
+    fmm_collect_tasks(fmm, quadtree, node->internal.se, depth + 1);
+}
+
+struct fmm_job
+{
+    struct fmm            *fmm;
+    const struct quadtree *quadtree;
+    float                  gravity;
+};
+
+static void
+fmm_upward_func(const struct fmm_job *job, size_t start, size_t stop, size_t worker)
+{
+    (void)worker;
+    for (size_t i = start; i < stop; i++)
+        fmm_upward_node(job->fmm, job->quadtree, job->fmm->tasks[i]);
+}
+
+static void
+fmm_downward_func(const struct fmm_job *job, size_t start, size_t stop, size_t worker)
+{
+    (void)worker;
+    for (size_t i = start; i < stop; i++)
+    {
+        uint32_t task = job->fmm->tasks[i];
+        fmm_interact(job->fmm, job->quadtree, task, QUADTREE_ROOT, job->gravity);
+        fmm_downward(job->fmm, job->quadtree, task, job->gravity);
+    }
+}
+
+// Compute the force on every body in `fmm->force_x/y`, needs the masses of the tree.
+// Each task subtree is a target: its multipoles are computed in parallel, then the top of the
+// tree, then every task is traversed against the whole tree and its local expansions are
+// pushed down to its bodies, no two workers ever write the same node.
+void
+fmm_force(struct fmm            *fmm,
+          const struct quadtree *quadtree,
+          size_t                 bodies_count,
+          const float            gravity,
+          struct pool           *pool)
+{
+    fmm_reserve(fmm, quadtree->nodes_count, bodies_count);
+    fmm->tasks_depth = 1;
+    for (size_t subtrees = 4; subtrees < 8 * pool_workers_count(pool); subtrees *= 4)
+        fmm->tasks_depth++;
+    fmm->tasks_count = 0;
+    fmm_collect_tasks(fmm, quadtree, QUADTREE_ROOT, 0);
+
+    struct fmm_job job = {.fmm = fmm, .quadtree = quadtree, .gravity = gravity};
+    pool_run(pool, (pool_func)fmm_upward_func, &job, fmm->tasks_count, 1);
+    fmm_upward_top(fmm, quadtree, QUADTREE_ROOT, 0);
+    pool_run(pool, (pool_func)fmm_downward_func, &job, fmm->tasks_count, 1);
+}
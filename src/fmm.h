@@ -0,0 +1,51 @@
+#ifndef FMM_H
+#define FMM_H
+
+#include "pool.h"
+#include "quadtree.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Highest expansion order supported, coefficients are stored for the order chosen at runtime
+#define FMM_MAX_ORDER 10
+#define FMM_MAX_COEFFICIENTS ((FMM_MAX_ORDER + 1) * (FMM_MAX_ORDER + 2) / 2)
+
+// Fast multipole method on the quadtree built for Barnes-Hut.
+// Expansions are Cartesian Taylor series of the 1/r potential in (x, y), coefficient (a, b)
+// of order a + b is stored at `n * (n + 1) / 2 + b` with n = a + b.
+// Every node has a multipole expansion of its bodies around its center of mass and a local
+// expansion of the far field around the same point.
+struct fmm
+{
+    unsigned int order;
+    size_t       coefficients_count;
+    double      *multipoles;
+    double      *locals;
+    float       *radius;  // bound on the distance from the center of mass to the bodies
+    size_t       nodes_capacity;
+    float       *force_x;  // indexed like `struct bodies`
+    float       *force_y;
+    size_t       bodies_capacity;
+    // Subtrees computed independently by the workers
+    uint32_t    *tasks;
+    size_t       tasks_count;
+    size_t       tasks_capacity;
+    unsigned int tasks_depth;
+    double       factorial_inverse[FMM_MAX_ORDER + 1];
+    double       binomial[FMM_MAX_ORDER + 1][FMM_MAX_ORDER + 1];
+    // Index of the coefficient (a1 + a2, b1 + b2) from the indices of (a1, b1) and (a2, b2)
+    uint8_t      sum_index[FMM_MAX_COEFFICIENTS][FMM_MAX_COEFFICIENTS];
+};
+
+void
+fmm_init(struct fmm *fmm, unsigned int order);
+void
+fmm_destroy(struct fmm *fmm);
+void
+fmm_force(struct fmm            *fmm,
+          const struct quadtree *quadtree,
+          size_t                 bodies_count,
+          const float            gravity,
+          struct pool           *pool);
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef GPU_H
+#define GPU_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Acceleration of every body from the forces of all the others, summed on the GPU. Pairs closer
+// than too_close_threshold on either axis are skipped and the distances softened like in the CPU
+// kernels.
+void
+gpu_forces(const float *x,
+           const float *y,
+           const float *mass,
+           size_t       count,
+           float        gravity,
+           float        too_close_threshold,
+           float        softening,
+           float       *acceleration_x,
+           float       *acceleration_y);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,6 +1,6 @@
-#include "body.h"
-#include <string.h>
+#include "gpu.h"
 #include <stdio.h>
+#include <stdlib.h>
 
 #define CUDA_CHECK(x) do {                                                      \
         cudaError_t cuda_check_result;                                          \
@@ -12,201 +12,108 @@
         }                                                                       \
     } while(0);
 
-const float time_step = 0.001f;
-
-// __global__ void bodies_gravitational_force_update(
-//     struct body *bodies,
-//     struct body *bodies_origin,
-//     size_t bodies_count,
-//     float gravity
-// ) {
-//     size_t b1_id = blockIdx.x * blockDim.x + threadIdx.x;
-//     size_t b2_id = blockIdx.y * blockDim.y + threadIdx.y;
-//     if (b1_id >= bodies_count || b2_id >= bodies_count)
-//         return;
-//     struct body *b1 = &bodies_origin[b1_id];
-//     struct body *b2 = &bodies_origin[b2_id];
-//     if (fabsf(b1->x - b2->x) < 0.01f || fabsf(b1->y - b2->y) < 0.01f)
-//         return;
-//     float distance_x = b1->x - b2->x;
-//     float distance_y = b1->y - b2->y;
-//     float distance_square = distance_x * distance_x + distance_y * distance_y;
-//     float force = (b1->mass * b2->mass * gravity) / distance_square;
-//     float dx = b1->x - b2->x;
-//     float dy = b1->y - b2->y;
-//     float magnitude_inverse = 1.0 / sqrt(dx * dx + dy * dy);
-//     dx *= magnitude_inverse;
-//     dy *= magnitude_inverse;
-//     dx *= force;
-//     dy *= force;
-//
-//     if (!isnan(dx) && !isnan(dy))
-//     {
-//         bodies[b1_id].acceleration_x += dx;
-//         bodies[b1_id].acceleration_y += dy;
-//     }
-// }
-//
-// __global__ void update_bodies_position(struct body *bodies)
-// {
-//     size_t i = blockIdx.x * blockDim.x + threadIdx.x;
-//     bodies[i].acceleration_x /= bodies[i].mass;
-//     bodies[i].acceleration_y /= bodies[i].mass;
-//     bodies[i].velocity_y -= bodies[i].acceleration_y * time_step;
-//     bodies[i].velocity_x -= bodies[i].acceleration_x * time_step;
-//     bodies[i].x += bodies[i].velocity_x * time_step;
-//     bodies[i].y += bodies[i].velocity_y * time_step;
-// }
-
-// extern "C" void update_bodies_naive(struct body *bodies_host, size_t bodies_count, float gravity) {
-//     for (size_t i = 0; i < bodies_count; i++)
-//     {
-//         bodies_host[i].acceleration_x = 0.0;
-//         bodies_host[i].acceleration_y = 0.0;
-//     }
-//
-//     size_t bodies_bytes = sizeof(struct body) * bodies_count;
-//     if (bodies == NULL || bodies_origin == NULL)
-//     {
-//         CUDA_CHECK(cudaMalloc(&bodies, bodies_bytes));
-//         CUDA_CHECK(cudaMalloc(&bodies_origin, bodies_bytes));
-//     }
-//     CUDA_CHECK(cudaMemcpy(bodies, bodies_host, bodies_bytes, cudaMemcpyHostToDevice));
-//     CUDA_CHECK(cudaMemcpy(bodies_origin, bodies, bodies_bytes, cudaMemcpyDeviceToDevice));
-//
-//     size_t threads_count = 32;
-//     size_t blocks_count = (bodies_count + threads_count - 1) / threads_count;
-//     dim3 threads_dim(threads_count, threads_count);
-//     dim3 blocks_dim(blocks_count, blocks_count);
-//     bodies_gravitational_force_update<<<blocks_dim, threads_dim>>>(
-//         bodies,
-//         bodies_origin,
-//         bodies_count,
-//         gravity
-//     );
-//     cudaDeviceSynchronize();
-//     threads_count = 256;
-//     blocks_count = (bodies_count + threads_count - 1) / threads_count;
-//     threads_dim = dim3(threads_count);
-//     blocks_dim = dim3(blocks_count);
-//     update_bodies_position<<<blocks_dim, threads_dim>>>(bodies);
-//
-//     CUDA_CHECK(cudaMemcpy(bodies_host, bodies, bodies_bytes, cudaMemcpyDeviceToHost));
-// }
-
-// #include <thrust/extrema.h>
-
-__global__ void bodies_struct_to_arrays(
-    struct body *bodies,
-    float *bodies_x,
-    float *bodies_y,
-    float *bodies_velocity_x,
-    float *bodies_velocity_y)
-{
-    size_t idx = blockIdx.x * blockDim.x + threadIdx.x;
-    bodies_x[idx] = bodies[idx].x;
-    bodies_y[idx] = bodies[idx].y;
-    bodies_velocity_x[idx] = bodies[idx].velocity_x;
-    bodies_velocity_y[idx] = bodies[idx].velocity_y;
-}
-
 #define THREADS_COUNT 256
 
-__global__ void min_max_element_kernel(float *xs, size_t count, float *mins, float *maxs)
-{
-    __shared__ float partial_min[THREADS_COUNT];
-    __shared__ float partial_max[THREADS_COUNT];
-    size_t idx = threadIdx.x + blockIdx.x * blockDim.x;
-    // Current minimum of the binary tree level (start of the level range)
-    partial_min[threadIdx.x] = (idx < count) ? xs[idx] : INFINITY;
-    partial_max[threadIdx.x] = (idx < count) ? xs[idx] : -INFINITY;
-    __syncthreads();
-    // Compare the current element with the powers of 2 (min/max solved by another thread)
-    // for (int stride = 1; stride < blockDim.x; stride <<= 1)
-    for (int stride = blockDim.x / 2; stride > 0; stride >>= 1) // Better for data locality than the above?
+// One thread per body, the bodies are loaded in shared memory one tile of THREADS_COUNT at a
+// time so every thread of the block reads them from there
+__global__ void gpu_forces_kernel(
+    const float *x,
+    const float *y,
+    const float *mass,
+    unsigned int count,
+    float gravity,
+    float too_close_threshold,
+    float softening_square,
+    float *acceleration_x,
+    float *acceleration_y
+) {
+    __shared__ float tile_x[THREADS_COUNT];
+    __shared__ float tile_y[THREADS_COUNT];
+    __shared__ float tile_mass[THREADS_COUNT];
+    unsigned int i = blockIdx.x * blockDim.x + threadIdx.x;
+    float body_x = i < count ? x[i] : 0.0f;
+    float body_y = i < count ? y[i] : 0.0f;
+    float sum_x = 0.0f;
+    float sum_y = 0.0f;
+    for (unsigned int tile = 0; tile < count; tile += THREADS_COUNT)
     {
-        // if (threadIdx.x % stride == 0) {
-        if (threadIdx.x < stride) {
-            partial_min[threadIdx.x] = min(partial_min[threadIdx.x], partial_min[threadIdx.x + stride]);
-            partial_max[threadIdx.x] = max(partial_max[threadIdx.x], partial_max[threadIdx.x + stride]);
+        // Padding bodies have no mass
+        unsigned int j = tile + threadIdx.x;
+        tile_x[threadIdx.x] = j < count ? x[j] : 0.0f;
+        tile_y[threadIdx.x] = j < count ? y[j] : 0.0f;
+        tile_mass[threadIdx.x] = j < count ? mass[j] : 0.0f;
+        __syncthreads();
+        for (unsigned int k = 0; k < THREADS_COUNT; k++)
+        {
+            float dx = body_x - tile_x[k];
+            float dy = body_y - tile_y[k];
+            if (fabsf(dx) <= too_close_threshold || fabsf(dy) <= too_close_threshold)
+                continue;
+            float inverse = rsqrtf(dx * dx + dy * dy + softening_square);
+            float inverse_cube = inverse * inverse * inverse * tile_mass[k];
+            sum_x += dx * inverse_cube;
+            sum_y += dy * inverse_cube;
         }
         __syncthreads();
     }
-    // Set the min/max element in the *global* memory, the first thread of the block ends up with
-    // the min/max element
-    if (threadIdx.x == 0)
-    {
-        mins[blockIdx.x] = partial_min[0];
-        maxs[blockIdx.x] = partial_max[0];
-    }
-    __syncthreads();
-    // Lastly the first thread of the first block computes the min/max of all the other blocks
-    if (blockIdx.x == 0 && threadIdx.x == 0)
+    if (i < count)
     {
-        for (size_t i = 1; i < gridDim.x; i++)
-        {
-            mins[0] = min(mins[0], mins[i]);
-            maxs[0] = max(maxs[0], maxs[i]);
-        }
+        acceleration_x[i] = sum_x * gravity;
+        acceleration_y[i] = sum_y * gravity;
     }
 }
 
-void min_max_element(float *xs, size_t count, float *pmin, float *pmax)
-{
-    size_t blocks_count = (count + THREADS_COUNT - 1) / THREADS_COUNT;
-    dim3 threads_dim = dim3(THREADS_COUNT);
-    dim3 blocks_dim = dim3(blocks_count);
-    float *mins, *maxs;
-    cudaMalloc(&mins, sizeof(float) * blocks_count);
-    cudaMalloc(&maxs, sizeof(float) * blocks_count);
-    min_max_element_kernel<<<blocks_dim, threads_dim>>>(xs, count, mins, maxs);
-    cudaMemcpy(pmin, mins, sizeof(float), cudaMemcpyDeviceToHost);
-    cudaMemcpy(pmax, maxs, sizeof(float), cudaMemcpyDeviceToHost);
-    cudaFree(mins);
-    cudaFree(maxs);
-}
-
-extern "C" void update_bodies_barnes_hut(struct body *bodies_host, size_t bodies_count, float gravity)
-{
-
-    static struct body *bodies = NULL, *bodies_origin = NULL;
-    static float *bodies_x = NULL, *bodies_y = NULL, *bodies_velocity_x = NULL, *bodies_velocity_y = NULL;
-
-    size_t bodies_bytes = sizeof(struct body) * bodies_count;
-    if (bodies == NULL || bodies_origin == NULL)
+extern "C" void gpu_forces(
+    const float *x,
+    const float *y,
+    const float *mass,
+    size_t count,
+    float gravity,
+    float too_close_threshold,
+    float softening,
+    float *acceleration_x,
+    float *acceleration_y
+) {
+    // Device arrays are kept from one step to the next
+    static float *device_x = NULL, *device_y = NULL, *device_mass = NULL;
+    static float *device_acceleration_x = NULL, *device_acceleration_y = NULL;
+    static size_t capacity = 0;
+    if (count > capacity)
     {
-        CUDA_CHECK(cudaMalloc(&bodies, bodies_bytes));
-        CUDA_CHECK(cudaMalloc(&bodies_origin, bodies_bytes));
-
-        CUDA_CHECK(cudaMalloc(&bodies_x, bodies_count * sizeof(float)));
-        CUDA_CHECK(cudaMalloc(&bodies_y, bodies_count * sizeof(float)));
-        CUDA_CHECK(cudaMalloc(&bodies_velocity_x, bodies_count * sizeof(float)));
-        CUDA_CHECK(cudaMalloc(&bodies_velocity_y, bodies_count * sizeof(float)));
+        CUDA_CHECK(cudaFree(device_x));
+        CUDA_CHECK(cudaFree(device_y));
+        CUDA_CHECK(cudaFree(device_mass));
+        CUDA_CHECK(cudaFree(device_acceleration_x));
+        CUDA_CHECK(cudaFree(device_acceleration_y));
+        CUDA_CHECK(cudaMalloc(&device_x, count * sizeof(float)));
+        CUDA_CHECK(cudaMalloc(&device_y, count * sizeof(float)));
+        CUDA_CHECK(cudaMalloc(&device_mass, count * sizeof(float)));
+        CUDA_CHECK(cudaMalloc(&device_acceleration_x, count * sizeof(float)));
+        CUDA_CHECK(cudaMalloc(&device_acceleration_y, count * sizeof(float)));
+        capacity = count;
     }
 
-    CUDA_CHECK(cudaMemcpy(bodies, bodies_host, bodies_bytes, cudaMemcpyHostToDevice));
-    CUDA_CHECK(cudaMemcpy(bodies_origin, bodies, bodies_bytes, cudaMemcpyDeviceToDevice));
+    // Bodies are already stored as arrays on the host
+    CUDA_CHECK(cudaMemcpy(device_x, x, count * sizeof(float), cudaMemcpyHostToDevice));
+    CUDA_CHECK(cudaMemcpy(device_y, y, count * sizeof(float), cudaMemcpyHostToDevice));
+    CUDA_CHECK(cudaMemcpy(device_mass, mass, count * sizeof(float), cudaMemcpyHostToDevice));
 
-    cudaDeviceSynchronize();
-
-    size_t blocks_count = (bodies_count + THREADS_COUNT - 1) / THREADS_COUNT;
-    // printf("%zu*%zu = %zu\n", threads_count, blocks_count, threads_count * blocks_count);
-    dim3 threads_dim = dim3(THREADS_COUNT);
-    dim3 blocks_dim = dim3(blocks_count);
-    bodies_struct_to_arrays<<<blocks_dim, threads_dim>>>(
-        bodies,
-        bodies_x,
-        bodies_y,
-        bodies_velocity_x,
-        bodies_velocity_y
+    size_t blocks_count = (count + THREADS_COUNT - 1) / THREADS_COUNT;
+    gpu_forces_kernel<<<blocks_count, THREADS_COUNT>>>(
+        device_x,
+        device_y,
+        device_mass,
+        count,
+        gravity,
+        too_close_threshold,
+        softening * softening,
+        device_acceleration_x,
+        device_acceleration_y
     );
+    CUDA_CHECK(cudaGetLastError());
 
-    float x_min, x_max, y_min, y_max;
-    min_max_element(bodies_x, bodies_count, &x_min, &x_max);
-    min_max_element(bodies_y, bodies_count, &y_min, &y_max);
-    printf("%.2f, %.2f -> %.2f, %.2f\n", x_min, y_min, x_max, y_max);
-
-
+    CUDA_CHECK(cudaMemcpy(
+        acceleration_x, device_acceleration_x, count * sizeof(float), cudaMemcpyDeviceToHost));
+    CUDA_CHECK(cudaMemcpy(
+        acceleration_y, device_acceleration_y, count * sizeof(float), cudaMemcpyDeviceToHost));
 }
-
-
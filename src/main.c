@@ -1,67 +1,1075 @@
 #define _XOPEN_SOURCE
 #include "body.h"
+#include "checkpoint.h"
+#include "direct.h"
 #include "draw.h"
+#include "diagnostics.h"
+#include "fmm.h"
+#include "gpu.h"
+#include "morton.h"
+#include "pool.h"
+#include "profile.h"
 #include "quadtree.h"
+#include "snapshot.h"
+#include "trajectory.h"
 #include "utils.h"
 #include <SDL2/SDL.h>
 #include <SDL2/SDL2_gfxPrimitives.h>
 #include <SDL2/SDL_ttf.h>
 #include <errno.h>
+#include <math.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <time.h>
 #include <unistd.h>
 
 // #define BODIES_COUNT 50000
-static size_t             bodies_count = 1000;
-static struct body       *bodies = NULL;
-static const float        time_step = 0.001f;
-static size_t             threads_count = 1;
-static pthread_t         *threads = NULL;
-static struct worker_arg *threads_args = NULL;
-static float              gravity = 0.0005f;
-static bool               flag_mass = false;
-static bool               flag_debug = false;
-static bool               flag_black_hole = false;
-static void (*flag_bodies_initialization_function)(struct body *) = body_init_random_circle;
-
-struct worker_arg
-{
-    size_t           start_index;
-    size_t           stop_index;
-    struct quadtree *quadtree;
+static size_t                bodies_count = 1000;
+static struct bodies         bodies;
+static float                 time_step = 0.001f;
+static size_t                threads_count = 1;
+static size_t                draw_threads_count = 0;  // -j, 0 for a quarter of the workers
+static struct pool          *pool = NULL;
+static struct quadtree       bodies_quadtree;
+static struct morton         bodies_morton;
+static struct bodies         bodies_scratch;
+static bool                  flag_insert = false;
+static bool                  flag_refit = false;
+static struct quadtree_stats build_stats;  // of the last build, refits are compared to it
+static size_t                builds_count = 0;
+static struct quadtree_list *workers_lists = NULL;
+static float                 gravity = 0.0005f;
+static bool                  flag_mass = false;
+static bool                  flag_debug = false;
+static bool                  flag_black_hole = false;
+static size_t                flag_steps = 0;
+static bool                  flag_seed = false;
+static unsigned int          seed = 0;
+static const char           *flag_kernel = NULL;
+static struct fmm            bodies_fmm;
+static unsigned int          fmm_order = 4;
+static float                 theta = QUADTREE_DEFAULT_THETA;
+static double                force_error = -1.0;  // measured on the first step with fmm
+static bool                  flag_check_kernels = false;
+static uint32_t              leaf_capacity = QUADTREE_DEFAULT_LEAF_CAPACITY;
+static double                calibration_budget = -1.0;  // relative RMS error, -C
+#define BLOCK_MAX_LEVELS 16
+
+// Block time steps: a step of time_step is made of 2^block_levels substeps and bodies are only
+// kicked, and their force only computed, at the substeps starting one of their own steps
+static unsigned int          block_levels = 0;
+static float                 block_accuracy = 0.000001f;  // distance moved by the acceleration
+static unsigned int          block_substep = 0;
+static size_t                force_evaluations = 0;
+static bool                  forces_current = false;  // accelerations of the current positions
+static size_t                diagnostics_interval = 0;  // steps between diagnostics, -E
+static double                initial_energy = 0.0;
+static const char           *trajectory_path = NULL;  // -O
+static size_t                trajectory_interval = 1;  // steps between frames, -F
+static uint32_t              trajectory_fields = 1u << TRAJECTORY_X | 1u << TRAJECTORY_Y;
+static struct trajectory     trajectory;
+static const char           *checkpoint_path = NULL;  // -W
+static size_t                checkpoint_interval = 1000;  // steps between checkpoints, -P
+static const char           *restart_path = NULL;  // -r
+static size_t                first_step = 0;  // of this run, from the checkpoint with -r
+static const char           *trace_path = NULL;  // -x
+static const char           *profile_csv_path = NULL;  // -X
+static bool                  flag_counters = false;  // -H
+static bool                  flag_pin = false;  // -a
+static size_t               *workers_interactions = NULL;  // one per worker, 8 apart
+static atomic_bool           running;
+static atomic_bool           paused;
+static struct snapshots      snapshots;  // positions drawn by the window
+static atomic_long           fps_sum;
+static atomic_long           fps_count;
+
+static const struct
+{
+    const char *name;
+    void (*function)(struct body *, struct rng *);
+} initializations[] = {
+    {"uniform", body_init_random_uniform},
+    {"circle", body_init_random_circle},
+    {"circle_spin", body_init_random_circle_spin},
+    {"two_circle", body_init_random_two_circle},
+    {"thorus", body_init_random_thorus},
 };
+static size_t flag_initialization = 1;  // circle
 
-static void *
-worker_func(struct worker_arg *arg)
+enum force
+{
+    FORCE_GROUP,
+    FORCE_WALK,
+    FORCE_FMM,
+    FORCE_NAIVE,
+    FORCE_CUDA,
+    FORCE_COUNT,
+};
+
+static const char *force_names[FORCE_COUNT] = {"group", "walk", "fmm", "naive", "cuda"};
+static enum force  flag_force = FORCE_GROUP;
+
+// Whether the force computation walks the quadtree, the others don't build it
+static bool
+force_uses_tree(void)
+{
+    return flag_force == FORCE_GROUP || flag_force == FORCE_WALK || flag_force == FORCE_FMM;
+}
+
+enum integrator
+{
+    INTEGRATOR_EULER,
+    INTEGRATOR_LEAPFROG,
+    INTEGRATOR_YOSHIDA,
+    INTEGRATOR_COUNT,
+};
+
+static const char     *integrator_names[INTEGRATOR_COUNT] = {"euler", "leapfrog", "yoshida"};
+static enum integrator flag_integrator = INTEGRATOR_COUNT;  // until -I or the default
+
+// Leapfrog steps of these fractions of the time step make a 4th order step (Yoshida 1990)
+static const float yoshida_weights[3] = {
+    1.3512071919596578f,
+    -1.7024143839193153f,
+    1.3512071919596578f,
+};
+
+enum phase
+{
+    PHASE_BOUNDS,
+    PHASE_SORT,
+    PHASE_TREE,
+    PHASE_MASS,
+    PHASE_FORCE,
+    PHASE_INTEGRATE,
+    PHASE_DRAW,
+    PHASE_COUNT,
+};
+
+static const char *phase_names[PHASE_COUNT] = {
+    "bounds",
+    "sort",
+    "tree",
+    "mass",
+    "force",
+    "integrate",
+    "draw",
+};
+static double      phase_seconds[PHASE_COUNT] = {0.0};
+
+static void
+store_acceleration(size_t i, float force_x, float force_y)
+{
+    bodies.acceleration_x[i] = force_x / bodies.mass[i];
+    bodies.acceleration_y[i] = force_y / bodies.mass[i];
+}
+
+// Whether the body starts one of its block steps at the current substep
+static bool
+body_active(size_t i)
+{
+    return (block_substep & ((1u << (block_levels - bodies.step_level[i])) - 1)) == 0;
+}
+
+struct integrate_job
+{
+    struct bodies *bodies;
+    float          duration;
+};
+
+static void
+kick_func(const struct integrate_job *job, size_t start, size_t stop, size_t worker)
+{
+    (void)worker;
+    struct bodies *bodies = job->bodies;
+    for (size_t i = start; i < stop; i++)
+    {
+        bodies->velocity_x[i] -= bodies->acceleration_x[i] * job->duration;
+        bodies->velocity_y[i] -= bodies->acceleration_y[i] * job->duration;
+    }
+}
+
+static void
+drift_func(const struct integrate_job *job, size_t start, size_t stop, size_t worker)
+{
+    (void)worker;
+    struct bodies *bodies = job->bodies;
+    for (size_t i = start; i < stop; i++)
+    {
+        bodies->x[i] += bodies->velocity_x[i] * job->duration;
+        bodies->y[i] += bodies->velocity_y[i] * job->duration;
+    }
+}
+
+// Walk the tree from the root for every body
+static void
+walk_force_func(const struct quadtree *quadtree, size_t start, size_t stop, size_t worker)
+{
+    (void)worker;
+    for (size_t i = start; i < stop; i++)
+    {
+        if (!body_active(i))
+            continue;
+        struct body body = {.x = bodies.x[i], .y = bodies.y[i], .mass = bodies.mass[i]};
+        float       force_x = 0.0, force_y = 0.0;
+        quadtree_force(quadtree, &body, gravity, &force_x, &force_y);
+        store_acceleration(i, force_x, force_y);
+    }
+}
+
+// Walk the tree once per external node and share the interaction list between its bodies
+static void
+group_force_func(const struct quadtree *quadtree, size_t start, size_t stop, size_t worker)
+{
+    struct quadtree_list *list = &workers_lists[worker];
+    for (size_t i = start; i < stop; i++)
+    {
+        const struct quadtree_node *node = &quadtree->nodes[i];
+        if (node->type != QUADTREE_EXTERNAL)
+            continue;
+        // Leaves without active bodies are skipped
+        uint32_t first = node->external.bucket;
+        uint32_t last = first + node->external.bodies_count;
+        uint32_t active = first;
+        while (active < last && !body_active(quadtree->bucket_index[active]))
+            active++;
+        if (active == last)
+            continue;
+        quadtree_list_build(quadtree, i, list);
+        for (uint32_t lane = active; lane < last; lane++)
+        {
+            size_t j = quadtree->bucket_index[lane];
+            if (!body_active(j))
+                continue;
+            struct body body = {.x = bodies.x[j], .y = bodies.y[j], .mass = bodies.mass[j]};
+            float       force_x, force_y;
+            quadtree_list_force(list, &body, gravity, &force_x, &force_y);
+            store_acceleration(j, force_x, force_y);
+            workers_interactions[worker * 8] += list->count + list->cells_count;
+        }
+    }
+}
+
+// Accelerations from the forces computed by the fast multipole method
+static void
+fmm_acceleration_func(const struct fmm *fmm, size_t start, size_t stop, size_t worker)
+{
+    (void)worker;
+    for (size_t i = start; i < stop; i++)
+        store_acceleration(i, fmm->force_x[i], fmm->force_y[i]);
+}
+
+// Every body draws from its own stream keyed by the seed and its index, the bodies don't depend
+// on the number of workers
+static void
+init_func(struct bodies *bodies, size_t start, size_t stop, size_t worker)
+{
+    (void)worker;
+    for (size_t i = start; i < stop; i++)
+    {
+        struct rng  rng;
+        struct body body = {0};
+        rng_init(&rng, seed, i);
+        initializations[flag_initialization].function(&body, &rng);
+        if (flag_mass)
+            body.mass = rng_float(&rng) + 0.3f;
+        bodies_set(bodies, i, &body);
+    }
+}
+
+// Sum the forces of all the bodies on every active body, O(n^2)
+static void
+naive_force_func(const struct bodies *bodies, size_t start, size_t stop, size_t worker)
+{
+    for (size_t i = start; i < stop; i++)
+    {
+        if (!body_active(i))
+            continue;
+        struct body body = bodies_get(bodies, i);
+        float       force_x, force_y;
+        direct_force(bodies, &body, gravity, &force_x, &force_y);
+        store_acceleration(i, force_x, force_y);
+        workers_interactions[worker * 8] += bodies->count;
+    }
+}
+
+// Deepest level whose step doesn't let the acceleration alone move the body by more than
+// block_accuracy, that is acceleration * step^2 / 2 <= block_accuracy
+static unsigned int
+block_level(float acceleration_x, float acceleration_y)
+{
+    float acceleration = sqrtf(acceleration_x * acceleration_x + acceleration_y * acceleration_y);
+    if (acceleration == 0.0f)
+        return 0;
+    float ratio = time_step / sqrtf(2.0f * block_accuracy / acceleration);
+    if (ratio <= 1.0f)
+        return 0;
+    unsigned int level = (unsigned int)ceilf(log2f(ratio));
+    return level < block_levels ? level : block_levels;
+}
+
+struct block_kick_job
+{
+    struct bodies *bodies;
+    bool           close;  // second half kick of the step ending at this substep
+    bool           open;   // first half kick of the next step, with a new level
+};
+
+// Kick of the active bodies at the boundary between two of their steps.
+// A step can only get longer at a substep where the longer step starts.
+static void
+block_kick_func(const struct block_kick_job *job, size_t start, size_t stop, size_t worker)
+{
+    (void)worker;
+    struct bodies *bodies = job->bodies;
+    for (size_t i = start; i < stop; i++)
+    {
+        if (!body_active(i))
+            continue;
+        float kick = 0.0f;
+        if (job->close)
+            kick += time_step / (float)(1u << bodies->step_level[i]) / 2.0f;
+        if (job->open)
+        {
+            unsigned int level =
+                block_level(bodies->acceleration_x[i], bodies->acceleration_y[i]);
+            while (level < bodies->step_level[i] &&
+                   (block_substep & ((1u << (block_levels - level)) - 1)) != 0)
+                level++;
+            bodies->step_level[i] = level;
+            kick += time_step / (float)(1u << level) / 2.0f;
+        }
+        bodies->velocity_x[i] -= bodies->acceleration_x[i] * kick;
+        bodies->velocity_y[i] -= bodies->acceleration_y[i] * kick;
+    }
+}
+
+// Pool jobs started until phase_end are profiled as part of the phase
+static double
+phase_begin(enum phase phase)
+{
+    profile_set_phase(phase);
+    profile_mark(phase, PROFILE_PHASE);
+    return time_seconds();
+}
+
+static void
+phase_end(enum phase phase, double start)
+{
+    double end = time_seconds();
+    phase_seconds[phase] += end - start;
+    profile_record(phase, PROFILE_PHASE, start, end);
+}
+
+// Build the quadtree from scratch
+static void
+build_tree(void)
+{
+    double phase_start = phase_begin(PHASE_BOUNDS);
+    quadtree_reset(&bodies_quadtree, &bodies, pool);
+    phase_end(PHASE_BOUNDS, phase_start);
+    if (flag_insert)
+    {
+        phase_start = phase_begin(PHASE_TREE);
+        for (size_t i = 0; i < bodies_count; i++)
+            quadtree_insert(&bodies_quadtree, &bodies, i);
+    }
+    else
+    {
+        phase_start = phase_begin(PHASE_SORT);
+        // Sort bodies along a Z-order curve so that bodies close in space are close in
+        // memory, then build the tree from the sorted ranges
+        const struct quadtree_node *root = &bodies_quadtree.nodes[QUADTREE_ROOT];
+        morton_sort(&bodies_morton,
+                    &bodies,
+                    root->start_x,
+                    root->start_y,
+                    root->end_x,
+                    root->end_y,
+                    pool);
+        bodies_permute(&bodies, &bodies_scratch, bodies_morton.order, pool);
+        phase_end(PHASE_SORT, phase_start);
+        phase_start = phase_begin(PHASE_TREE);
+        quadtree_build(&bodies_quadtree, &bodies, bodies_morton.keys, pool);
+    }
+    if (flag_refit)
+    {
+        build_stats = (struct quadtree_stats){0};
+        quadtree_stats(&bodies_quadtree, &build_stats);
+    }
+    builds_count++;
+    phase_end(PHASE_TREE, phase_start);
+}
+
+// Move the bodies of the previous tree, false when it needs to be built again
+static bool
+refit_tree(void)
+{
+    if (!quadtree_refit(&bodies_quadtree, &bodies, pool))
+        return false;
+    // Insertions split leaves and make branches deeper which slows the walks down, build again
+    // once there are a third more leaves than after the build, the tree is 2 levels deeper or
+    // half of the buckets are left over from emptied leaves
+    struct quadtree_stats stats = {0};
+    quadtree_stats(&bodies_quadtree, &stats);
+    return stats.external_count * 3 <= build_stats.external_count * 4 &&
+           stats.max_depth <= build_stats.max_depth + 2 &&
+           bodies_quadtree.buckets_count <= 2 * stats.external_count;
+}
+
+// Build or refit the quadtree of the current positions
+static void
+update_tree(void)
+{
+    double phase_start = phase_begin(PHASE_TREE);
+    bool   refitted = flag_refit && refit_tree();
+    if (flag_refit)
+        phase_end(PHASE_TREE, phase_start);
+    if (!refitted)
+        build_tree();
+    phase_start = phase_begin(PHASE_MASS);
+    quadtree_update_mass(&bodies_quadtree, pool);
+    quadtree_flatten(&bodies_quadtree);
+    phase_end(PHASE_MASS, phase_start);
+}
+
+// Store the acceleration of every body from the current positions
+static void
+compute_forces(void)
+{
+    // The tree is drawn in debug mode whatever computes the forces
+    if (force_uses_tree() || flag_debug)
+        update_tree();
+    double phase_start = phase_begin(PHASE_FORCE);
+    // Compute the gravitational forces, bodies are handed out in small chunks so that
+    // dense regions don't leave the other workers idle
+    switch (flag_force)
+    {
+    case FORCE_GROUP:
+        pool_run(
+            pool, (pool_func)group_force_func, &bodies_quadtree, bodies_quadtree.nodes_count, 16);
+        break;
+    case FORCE_WALK:
+        pool_run(pool, (pool_func)walk_force_func, &bodies_quadtree, bodies_count, 64);
+        break;
+    case FORCE_FMM:
+        fmm_force(&bodies_fmm, &bodies_quadtree, bodies_count, gravity, pool);
+        pool_run(pool, (pool_func)fmm_acceleration_func, &bodies_fmm, bodies_count, 1024);
+        break;
+    case FORCE_NAIVE:
+        pool_run(pool, (pool_func)naive_force_func, &bodies, bodies_count, 16);
+        break;
+    case FORCE_CUDA:
+#ifdef HAVE_CUDA
+        gpu_forces(bodies.x,
+                   bodies.y,
+                   bodies.mass,
+                   bodies_count,
+                   gravity,
+                   body_too_close_threshold,
+                   body_softening,
+                   bodies.acceleration_x,
+                   bodies.acceleration_y);
+#endif
+        break;
+    case FORCE_COUNT: break;
+    }
+    phase_end(PHASE_FORCE, phase_start);
+    forces_current = true;
+    // Only the CPU walks and sums skip the bodies not starting a block step
+    if (block_levels == 0 || flag_force == FORCE_FMM || flag_force == FORCE_CUDA)
+        force_evaluations += bodies_count;
+    else
+        for (size_t i = 0; i < bodies_count; i++)
+            force_evaluations += body_active(i);
+}
+
+static void
+kick(float duration)
+{
+    double               phase_start = phase_begin(PHASE_INTEGRATE);
+    struct integrate_job job = {.bodies = &bodies, .duration = duration};
+    pool_run_owned(pool, (pool_func)kick_func, &job, bodies_count, 1024);
+    phase_end(PHASE_INTEGRATE, phase_start);
+}
+
+static void
+drift(float duration)
+{
+    double               phase_start = phase_begin(PHASE_INTEGRATE);
+    struct integrate_job job = {.bodies = &bodies, .duration = duration};
+    pool_run_owned(pool, (pool_func)drift_func, &job, bodies_count, 1024);
+    forces_current = false;
+    phase_end(PHASE_INTEGRATE, phase_start);
+}
+
+// Kick, drift, kick: the forces at the end of the step are kept for the start of the next one
+static void
+leapfrog_step(float duration)
+{
+    kick(duration / 2.0f);
+    drift(duration);
+    compute_forces();
+    kick(duration / 2.0f);
+}
+
+static void
+block_kick(bool close, bool open)
+{
+    double                phase_start = phase_begin(PHASE_INTEGRATE);
+    struct block_kick_job job = {.bodies = &bodies, .close = close, .open = open};
+    pool_run_owned(pool, (pool_func)block_kick_func, &job, bodies_count, 1024);
+    phase_end(PHASE_INTEGRATE, phase_start);
+}
+
+// Advance the bodies by time_step with block time steps. It's a leapfrog for each body, with
+// the forces of the bodies not kicked at a substep left out and the tree built on the positions
+// of every body. Every step ends with the time step so the last substep closes all of them.
+static void
+block_step(void)
+{
+    const unsigned int substeps = 1u << block_levels;
+    for (block_substep = 0; block_substep < substeps; block_substep++)
+    {
+        if (block_substep != 0)
+            compute_forces();
+        block_kick(block_substep != 0, true);
+        drift(time_step / (float)substeps);
+    }
+    block_substep = 0;
+    compute_forces();
+    block_kick(true, false);
+}
+
+// Advance the bodies by time_step from the accelerations of the current positions.
+// Velocities are at the same time as the positions after every step.
+static void
+step(void)
+{
+    switch (flag_integrator)
+    {
+    case INTEGRATOR_EULER:
+        kick(time_step);
+        drift(time_step);
+        break;
+    case INTEGRATOR_LEAPFROG:
+        if (block_levels != 0)
+            block_step();
+        else
+            leapfrog_step(time_step);
+        break;
+    case INTEGRATOR_YOSHIDA:
+        for (size_t i = 0; i < ARRAY_LEN(yoshida_weights); i++)
+            leapfrog_step(yoshida_weights[i] * time_step);
+        break;
+    case INTEGRATOR_COUNT: break;
+    }
+}
+
+static void
+print_diagnostics(size_t steps)
+{
+    if (!forces_current)
+        compute_forces();
+    // The potential is summed with a walk of the tree
+    if (!force_uses_tree() && !flag_debug)
+        update_tree();
+    struct diagnostics diagnostics;
+    diagnostics_compute(&diagnostics, &bodies, &bodies_quadtree, gravity, pool);
+    double energy = diagnostics.kinetic + diagnostics.potential;
+    if (steps == first_step)
+        initial_energy = energy;
+    printf("{\"step\": %zu, \"time\": %.6f, \"kinetic\": %.9e, \"potential\": %.9e, "
+           "\"energy\": %.9e, \"energy_error\": %.3e, \"momentum_x\": %.6e, "
+           "\"momentum_y\": %.6e, \"angular_momentum\": %.9e}\n",
+           steps,
+           (double)steps * time_step,
+           diagnostics.kinetic,
+           diagnostics.potential,
+           energy,
+           initial_energy == 0.0 ? 0.0 : (energy - initial_energy) / fabs(initial_energy),
+           diagnostics.momentum_x,
+           diagnostics.momentum_y,
+           diagnostics.angular_momentum);
+    fflush(stdout);
+}
+
+static void
+print_report(size_t steps, double seconds)
+{
+    printf("{\"bodies\": %zu, \"workers\": %zu, \"init\": \"%s\", \"seed\": %u, "
+           "\"kernel\": \"%s\", \"force\": \"%s\", \"theta\": %.3f, \"leaf_capacity\": %u, "
+           "\"too_close_threshold\": %.1e, \"integrator\": \"%s\", \"time_step\": %g, "
+           "\"steps\": %zu, "
+           "\"seconds\": %.6f, \"steps_per_second\": %.3f, "
+           "\"body_steps_per_second\": %.1f, \"phase_seconds\": {",
+           bodies_count,
+           threads_count,
+           initializations[flag_initialization].name,
+           seed,
+           body_kernel->name,
+           force_names[flag_force],
+           (double)theta,
+           leaf_capacity,
+           (double)body_too_close_threshold,
+           integrator_names[flag_integrator],
+           (double)time_step,
+           steps,
+           seconds,
+           (double)steps / seconds,
+           (double)steps * (double)bodies_count / seconds);
+    // Reports are only printed by headless runs, which draw nothing
+    for (size_t i = 0; i < PHASE_COUNT; i++)
+        if (i != PHASE_DRAW)
+            printf("%s\"%s\": %.6f", i == 0 ? "" : ", ", phase_names[i], phase_seconds[i]);
+    printf("}");
+    if (flag_force == FORCE_FMM)
+        printf(", \"fmm_order\": %u, \"force_error\": %.3e", fmm_order, force_error);
+    if (flag_refit)
+        printf(", \"builds\": %zu", builds_count);
+    if (block_levels != 0)
+        printf(", \"block_levels\": %u", block_levels);
+    if (body_softening != 0.0f)
+        printf(", \"softening\": %.1e", (double)body_softening);
+    printf(", \"force_evaluations\": %zu", force_evaluations);
+    if (flag_counters)
+    {
+        // The other forces don't count their interactions, the counters are divided by the
+        // force evaluations instead
+        size_t interactions = 0;
+        for (size_t i = 0; i < threads_count; i++)
+            interactions += workers_interactions[i * 8];
+        printf(", \"interactions\": %zu, \"profile\": ", interactions);
+        profile_print_totals(stdout, interactions != 0 ? interactions : force_evaluations);
+    }
+    if (trajectory_path != NULL)
+        printf(", \"trajectory_frames\": %zu, \"trajectory_wait_seconds\": %.6f",
+               trajectory.frames_count,
+               trajectory.wait_seconds);
+    printf("}\n");
+}
+
+// Compare every supported kernel against a double precision sum on random bodies, and on the
+// same bodies seen as cells with a random quadrupole for the moments kernels
+static bool
+check_kernels(void)
+{
+    const size_t  count = 1000;
+    const size_t  padded_count = (count + 7) / 8 * 8;
+    struct bodies sources;
+    float        *quadrupoles[3];
+    bodies_init(&sources, count, pool);
+    for (size_t q = 0; q < 3; q++)
+        quadrupoles[q] = xaligned_alloc(32, sizeof(float) * padded_count);
+    for (size_t i = 0; i < padded_count; i++)
+    {
+        struct body body = {.mass = frand() + 0.3f, .x = frand(), .y = frand()};
+        if (i < count)
+            bodies_set(&sources, i, &body);
+        for (size_t q = 0; q < 3; q++)
+            quadrupoles[q][i] = i < count ? 0.01f * body.mass * (frand() - (q == 1 ? 0.5f : 0.0f))
+                                          : 0.0f;
+    }
+    const struct body_moments moments = {
+        .x = sources.x,
+        .y = sources.y,
+        .mass = sources.mass,
+        .xx = quadrupoles[0],
+        .xy = quadrupoles[1],
+        .yy = quadrupoles[2],
+    };
+
+    size_t                    kernels_count;
+    const struct body_kernel *kernels = body_kernels(&kernels_count);
+    bool                      ok = true;
+    for (size_t k = 0; k < kernels_count; k++)
+    {
+        if (!body_kernel_supported(&kernels[k]))
+        {
+            printf("%-8s unsupported\n", kernels[k].name);
+            continue;
+        }
+        double max_error = 0.0, max_moments_error = 0.0;
+        for (size_t i = 0; i < count; i += 7)
+        {
+            struct body dest = bodies_get(&sources, i);
+            double      expected_x = 0.0, expected_y = 0.0;
+            double      expected_moments_x = 0.0, expected_moments_y = 0.0;
+            for (size_t j = 0; j < count; j++)
+            {
+                double dx = (double)dest.x - sources.x[j];
+                double dy = (double)dest.y - sources.y[j];
+                if (fabs(dx) <= body_too_close_threshold || fabs(dy) <= body_too_close_threshold)
+                    continue;
+                double distance = sqrt(dx * dx + dy * dy + (double)body_softening * body_softening);
+                double inverse_cube = 1.0 / (distance * distance * distance);
+                double inverse_fifth = inverse_cube / (distance * distance);
+                double scale = (double)dest.mass * sources.mass[j] * gravity * inverse_cube;
+                expected_x += dx * scale;
+                expected_y += dy * scale;
+                double quadrupole_x = quadrupoles[0][j] * dx + quadrupoles[1][j] * dy;
+                double quadrupole_y = quadrupoles[1][j] * dx + quadrupoles[2][j] * dy;
+                double quadrupole = dx * quadrupole_x + dy * quadrupole_y;
+                double trace = (double)quadrupoles[0][j] + quadrupoles[2][j];
+                double radial =
+                    (7.5 * quadrupole / (distance * distance) - 1.5 * trace) * inverse_fifth;
+                double cell_scale = (double)dest.mass * gravity;
+                expected_moments_x +=
+                    dx * scale + cell_scale * (radial * dx - 3.0 * inverse_fifth * quadrupole_x);
+                expected_moments_y +=
+                    dy * scale + cell_scale * (radial * dy - 3.0 * inverse_fifth * quadrupole_y);
+            }
+            float force_x = 0.0f, force_y = 0.0f;
+            kernels[k].force(&dest,
+                             sources.x,
+                             sources.y,
+                             sources.mass,
+                             padded_count,
+                             gravity,
+                             &force_x,
+                             &force_y);
+            max_error = fmax(max_error,
+                             hypot(force_x - expected_x, force_y - expected_y) /
+                                 hypot(expected_x, expected_y));
+            force_x = 0.0f;
+            force_y = 0.0f;
+            kernels[k].moments(&dest, &moments, padded_count, gravity, &force_x, &force_y);
+            max_moments_error =
+                fmax(max_moments_error,
+                     hypot(force_x - expected_moments_x, force_y - expected_moments_y) /
+                         hypot(expected_moments_x, expected_moments_y));
+        }
+        bool passed = max_error < 1e-4 && max_moments_error < 1e-4;
+        printf("%-8s max relative error %.2e, with moments %.2e %s\n",
+               kernels[k].name,
+               max_error,
+               max_moments_error,
+               passed ? "ok" : "FAILED");
+        ok = ok && passed;
+    }
+    bodies_destroy(&sources);
+    for (size_t q = 0; q < 3; q++)
+        free(quadrupoles[q]);
+    return ok;
+}
+
+// Settings swept by the calibration, the fast multipole method sweeps its order instead of theta
+static const float        calibration_thetas[] = {0.3f, 0.5f, 0.7f, 0.9f};
+static const unsigned int calibration_orders[] = {2, 4, 6, 8};
+static const uint32_t     calibration_leaf_capacities[] = {8, 16, 32};
+static const float        calibration_thresholds[] = {0.0f, 0.00001f, 0.0001f, 0.001f};
+
+struct calibration_result
+{
+    float        theta;
+    unsigned int fmm_order;
+    uint32_t     leaf_capacity;
+    float        threshold;
+    double       seconds_per_step;
+    double       rms_error;  // of the per body relative errors
+    double       max_error;
+};
+
+static void
+print_calibration_result(const struct calibration_result *result)
+{
+    if (flag_force == FORCE_FMM)
+        printf("{\"fmm_order\": %u, ", result->fmm_order);
+    else
+        printf("{\"theta\": %.3f, ", (double)result->theta);
+    printf("\"leaf_capacity\": %u, \"too_close_threshold\": %.1e, \"seconds_per_step\": %.6f, "
+           "\"rms_error\": %.3e, \"max_error\": %.3e}",
+           result->leaf_capacity,
+           (double)result->threshold,
+           result->seconds_per_step,
+           result->rms_error,
+           result->max_error);
+}
+
+// Compare the forces of the sampled bodies, computed on the first step, against the reference
+static void
+calibration_error(const uint32_t            *samples,
+                  size_t                     samples_count,
+                  const float               *reference_x,
+                  const float               *reference_y,
+                  struct calibration_result *result)
+{
+    double sum = 0.0;
+    result->max_error = 0.0;
+    for (size_t i = 0; i < samples_count; i++)
+    {
+        uint32_t j = samples[i];
+        double   norm = hypot(reference_x[i], reference_y[i]);
+        if (norm == 0.0)
+            continue;
+        double error = hypot((double)bodies.acceleration_x[j] * bodies.mass[j] - reference_x[i],
+                             (double)bodies.acceleration_y[j] * bodies.mass[j] - reference_y[i]) /
+                       norm;
+        sum += error * error;
+        result->max_error = fmax(result->max_error, error);
+    }
+    result->rms_error = samples_count == 0 ? 0.0 : sqrt(sum / (double)samples_count);
+}
+
+// Time every combination of the swept settings from the same initial state and measure the
+// error of its forces against a direct sum without cutoff on a random sample of bodies.
+// Prints one JSON line per configuration and the fastest one within the error budget.
+static void
+calibrate(void)
+{
+    const size_t samples_count = bodies_count < 1000 ? bodies_count : 1000;
+    const size_t steps = flag_steps != 0 ? flag_steps : 3;
+
+    // The Morton sort is stable, once sorted the bodies stay in place and samples keep
+    // their index from one configuration to the next
+    compute_forces();
+    struct bodies initial;
+    bodies_init(&initial, bodies_count, pool);
+    bodies_copy(&initial, &bodies);
+
+    uint32_t *samples = xmalloc(sizeof(uint32_t) * bodies_count);
+    for (size_t i = 0; i < bodies_count; i++)
+        samples[i] = i;
+    for (size_t i = 0; i < samples_count; i++)
+    {
+        size_t   j = i + (size_t)rand() % (bodies_count - i);
+        uint32_t tmp = samples[i];
+        samples[i] = samples[j];
+        samples[j] = tmp;
+    }
+    float *reference_x = xmalloc(sizeof(float) * samples_count);
+    float *reference_y = xmalloc(sizeof(float) * samples_count);
+    float  threshold = body_too_close_threshold;
+    body_too_close_threshold = 0.0f;
+    direct_forces(&bodies, samples, samples_count, gravity, reference_x, reference_y, pool);
+    body_too_close_threshold = threshold;
+
+    size_t accuracies_count =
+        flag_force == FORCE_FMM ? ARRAY_LEN(calibration_orders) : ARRAY_LEN(calibration_thetas);
+    struct calibration_result best = {0};
+    bool                      found = false;
+    for (size_t a = 0; a < accuracies_count; a++)
+    {
+        for (size_t l = 0; l < ARRAY_LEN(calibration_leaf_capacities); l++)
+        {
+            for (size_t t = 0; t < ARRAY_LEN(calibration_thresholds); t++)
+            {
+                struct calibration_result result = {
+                    .theta = theta,
+                    .fmm_order = fmm_order,
+                    .leaf_capacity = calibration_leaf_capacities[l],
+                    .threshold = calibration_thresholds[t],
+                };
+                if (flag_force == FORCE_FMM)
+                {
+                    result.fmm_order = calibration_orders[a];
+                    fmm_destroy(&bodies_fmm);
+                    fmm_init(&bodies_fmm, result.fmm_order);
+                }
+                else
+                    result.theta = calibration_thetas[a];
+                bodies_quadtree.theta = result.theta;
+                quadtree_set_leaf_capacity(&bodies_quadtree, result.leaf_capacity);
+                body_too_close_threshold = result.threshold;
+                bodies_copy(&bodies, &initial);
+                forces_current = false;
+
+                double seconds = 0.0;
+                for (size_t i = 0; i < steps; i++)
+                {
+                    double start = time_seconds();
+                    if (!forces_current)
+                        compute_forces();
+                    seconds += time_seconds() - start;
+                    if (i == 0)
+                        calibration_error(
+                            samples, samples_count, reference_x, reference_y, &result);
+                    start = time_seconds();
+                    step();
+                    seconds += time_seconds() - start;
+                }
+                result.seconds_per_step = seconds / (double)steps;
+                print_calibration_result(&result);
+                printf("\n");
+                fflush(stdout);
+                if (result.rms_error <= calibration_budget &&
+                    (!found || result.seconds_per_step < best.seconds_per_step))
+                {
+                    best = result;
+                    found = true;
+                }
+            }
+        }
+    }
+    printf("{\"bodies\": %zu, \"workers\": %zu, \"force\": \"%s\", \"samples\": %zu, "
+           "\"steps\": %zu, \"budget\": %.3e, \"best\": ",
+           bodies_count,
+           threads_count,
+           force_names[flag_force],
+           samples_count,
+           steps,
+           calibration_budget);
+    if (found)
+        print_calibration_result(&best);
+    else
+        printf("null");
+    printf("}\n");
+    body_too_close_threshold = threshold;
+    bodies_destroy(&initial);
+    free(samples);
+    free(reference_x);
+    free(reference_y);
+}
+
+// Step until `running` is cleared. Headless runs call it on the main thread and stop after
+// flag_steps steps, with a window it has its own thread and publishes the positions after every
+// step for the main thread to draw, so neither waits for the other.
+static size_t
+simulate(size_t steps_count, bool headless)
 {
-    for (size_t i = arg->start_index; i < arg->stop_index; i++)
+    profile_thread("simulation");
+    while (atomic_load(&running))
     {
-        // body_acceleration(&bodies[i]);
-        float acceleration_x = 0.0, acceleration_y = 0.0;
-        quadtree_force(arg->quadtree, &bodies[i], gravity, &acceleration_x, &acceleration_y);
-        acceleration_x /= bodies[i].mass;
-        acceleration_y /= bodies[i].mass;
-        bodies[i].velocity_y -= acceleration_y * time_step;
-        bodies[i].velocity_x -= acceleration_x * time_step;
-        bodies[i].x += bodies[i].velocity_x * time_step;
-        bodies[i].y += bodies[i].velocity_y * time_step;
+        if (atomic_load(&paused))
+        {
+            SDL_Delay(10);
+            continue;
+        }
+        profile_step(steps_count);
+        if (!forces_current)
+            compute_forces();
+        if (diagnostics_interval != 0 && steps_count % diagnostics_interval == 0)
+            print_diagnostics(steps_count);
+        if (trajectory_path != NULL && steps_count % trajectory_interval == 0)
+            trajectory_write(
+                &trajectory, &bodies, steps_count, (double)steps_count * time_step, pool);
+        if (checkpoint_path != NULL && steps_count != first_step &&
+            steps_count % checkpoint_interval == 0)
+            checkpoint_write(checkpoint_path, &bodies, steps_count, seed);
+        if (flag_force == FORCE_FMM && headless && steps_count == first_step)
+            force_error = direct_force_error(
+                &bodies, bodies_fmm.force_x, bodies_fmm.force_y, gravity, 1000, pool);
+        if (flag_debug)
+        {
+            struct quadtree_stats stats = {0};
+            quadtree_stats(&bodies_quadtree, &stats);
+            printf("stats:\n"
+                   "\tnode count:     %5zu\n"
+                   "\tempty count:    %5zu\n"
+                   "\texternal count: %5zu, average bodies in external %5.1f\n"
+                   "\tinternal count: %5zu\n"
+                   "\tmax depth:      %5zu\n"
+                   "\tbounds:         % .2f,% .2f -> % .2f,% .2f\n"
+                   "\taverage fps:    %.2f\n",
+                   stats.node_count,
+                   stats.empty_count,
+                   stats.external_count,
+                   (double)bodies_count / (double)stats.external_count,
+                   stats.internal_count,
+                   stats.max_depth,
+                   (double)bodies_quadtree.nodes[QUADTREE_ROOT].start_x,
+                   (double)bodies_quadtree.nodes[QUADTREE_ROOT].start_y,
+                   (double)bodies_quadtree.nodes[QUADTREE_ROOT].end_x,
+                   (double)bodies_quadtree.nodes[QUADTREE_ROOT].end_y,
+                   (double)atomic_load(&fps_sum) / (double)atomic_load(&fps_count));
+        }
+        step();
+        steps_count++;
+        if (!headless)
+        {
+            // The window culls and aggregates bodies with the tree, which these forces don't build
+            if (!force_uses_tree() && !flag_debug)
+                update_tree();
+            double phase_start = phase_begin(PHASE_DRAW);
+            snapshots_publish(&snapshots, &bodies, &bodies_quadtree, steps_count);
+            phase_end(PHASE_DRAW, phase_start);
+        }
+        if (headless && steps_count == first_step + flag_steps)
+            atomic_store(&running, false);
+        // SDL_Delay(100);
     }
+    return steps_count;
+}
+
+static void *
+simulation_func(size_t *steps_count)
+{
+    if (flag_pin)
+        pool_pin_caller(pool);
+    *steps_count = simulate(*steps_count, false);
     return NULL;
 }
 
-extern void
-update_bodies_naive(struct body *bodies_cpu, size_t bodies_count, float gravity);
-extern void
-update_bodies_barnes_hut(struct body *bodies_cpu, size_t bodies_count, float gravity);
+// Draw the last published step until the window is closed, the simulation runs on its own
+// thread. SDL stays on the main thread since some platforms only allow it there.
+static void
+show_window(size_t *steps_count)
+{
+    profile_thread("window");
+    // The simulation thread owns `pool`, the window draws on its own smaller one left unpinned so
+    // it doesn't take the cores of the simulation
+    if (draw_threads_count == 0)
+        draw_threads_count = threads_count < 4 ? 1 : threads_count / 4;
+    struct pool *draw_pool = pool_new(draw_threads_count);
+    draw_init(draw_pool);
+    snapshots_init(&snapshots, bodies_count);
+    pthread_t simulation_thread;
+    if (pthread_create(&simulation_thread,
+                       NULL,
+                       (void *(*)(void *))simulation_func,
+                       steps_count) != 0)
+        die("Cannot create simulation thread");
+    double                 rate_start = time_seconds();
+    size_t                 rate_step = 0;
+    double                 steps_per_second = 0.0;
+    const struct snapshot *snapshot = NULL;
+    while (atomic_load(&running))
+    {
+        bool window_running = true;
+        bool window_paused = atomic_load(&paused);
+        bool view_changed = draw_handle_events(&window_running, &window_paused);
+        atomic_store(&paused, window_paused);
+        if (!window_running)
+            atomic_store(&running, false);
+        // The last snapshot is drawn again when the camera moves while paused
+        const struct snapshot *next = snapshots_take(&snapshots);
+        if (next != NULL)
+            snapshot = next;
+        else if (!view_changed || snapshot == NULL)
+        {
+            SDL_Delay(1);
+            continue;
+        }
+        // Simulation rate over the last second
+        double now = time_seconds();
+        if (rate_step == 0 || now - rate_start >= 1.0)
+        {
+            if (rate_step != 0)
+                steps_per_second = (double)(snapshot->step - rate_step) / (now - rate_start);
+            rate_start = now;
+            rate_step = snapshot->step;
+        }
+        // Not through phase_end, phase_seconds belongs to the simulation thread
+        double draw_start = phase_begin(PHASE_DRAW);
+        atomic_fetch_add(&fps_sum, draw_update(snapshot, flag_mass, flag_debug, steps_per_second));
+        profile_record(PHASE_DRAW, PROFILE_PHASE, draw_start, time_seconds());
+        atomic_fetch_add(&fps_count, 1);
+    }
+    pthread_join(simulation_thread, NULL);
+    snapshots_destroy(&snapshots);
+    draw_quit();
+    pool_destroy(draw_pool);
+}
 
 int
 main(int argc, char **argv)
 {
     threads_count = sysconf(_SC_NPROCESSORS_ONLN);
-    int option;
-    while ((option = getopt(argc, argv, "hb:ow:mi:g:d")) != -1)
+    const char *options = "hb:ow:mi:g:dn:s:T:f:p:t:k:Kl:c:C:B:e:I:D:E:O:F:S:W:P:r:x:X:HaLq:j:";
+    int         option;
+    while ((option = getopt(argc, argv, options)) != -1)
     {
         switch (option)
         {
@@ -71,17 +1079,91 @@ main(int argc, char **argv)
                    "\t-b Number of body (default: %zu)\n"
                    "\t-o Add a \"black hole\" in the center\n"
                    "\t-w Number of workers (default: number of cpu cores)\n"
-                   "\t-m Assign a random mass to bodies and draw that mass\n"
+                   "\t-j Number of workers drawing the window (default: a quarter of -w)\n"
+                   "\t-a Pin each worker to a CPU and give it the same part of the bodies\n"
+                   "\t\tevery step so its pages stay on its NUMA node (Linux only)\n"
+                   "\t-L Back the body arrays and the tree with transparent huge pages\n"
+                   "\t-m Assign a random mass to bodies and weight the drawing by mass\n"
                    "\t\t(all bodies have the same mass by default)\n"
                    "\t-i Body initialization method (default: circle)\n"
-                   "\t\tAvailable: uniform, circle\n"
+                   "\t\tAvailable: uniform, circle, circle_spin, two_circle, thorus\n"
                    "\t-g Gravity (default: %f)\n"
                    "\t-d Enable debug mode\n"
+                   "\t-n Run that many steps without a window and print a JSON report\n"
+                   "\t-s Random seed (default: read from /dev/random)\n"
+                   "\t-T Quadtree construction (default: morton)\n"
+                   "\t\tmorton: sort bodies by Morton key and build from the sorted ranges\n"
+                   "\t\tinsert: insert bodies one by one from the root\n"
+                   "\t\trefit:  build with morton, then move the bodies that changed leaf\n"
+                   "\t\t        and build again when the tree has degraded\n"
+                   "\t-f Force computation (default: group)\n"
+                   "\t\tgroup: walk the quadtree once per external node\n"
+                   "\t\twalk:  walk the quadtree once per body\n"
+                   "\t\tfmm:   fast multipole method, headless runs report the force error\n"
+                   "\t\tnaive: sum the forces of every pair of bodies, O(n^2)\n"
+                   "\t\tcuda:  same as naive on the GPU (when compiled in)\n"
+                   "\t-p Expansion order of the fast multipole method (default: %u, min: 1,\n"
+                   "\t\tmax: %u)\n"
+                   "\t-t Opening angle of the quadtree walks (default: %.2f)\n"
+                   "\t\tnodes narrower than theta times their distance are approximated,\n"
+                   "\t\twith fmm cells whose radiuses add up to less than that\n"
+                   "\t-k Force kernel (default: fastest supported by the CPU)\n"
+                   "\t\tAvailable: scalar, avx2, avx512 (when compiled in)\n"
+                   "\t-K Check the force kernels against a double precision sum and exit\n"
+                   "\t-l Bodies per quadtree leaf (default: %u, max: %u)\n"
+                   "\t-c Bodies closer than this on either axis don't attract (default: %g)\n"
+                   "\t\twith fmm only between the bodies of close leaves, the expansions\n"
+                   "\t\tkeep them\n"
+                   "\t-q Softening length added to the distances of the forces and the\n"
+                   "\t\tpotential (default: 0), use with -c 0 for a smooth force\n"
+                   "\t-C Sweep theta (order with fmm), leaf capacity and -c, print the error\n"
+                   "\t\tagainst a direct sum and the time per step of each configuration,\n"
+                   "\t\tthen the fastest one with a relative RMS error under the argument\n"
+                   "\t\tand exit (-n sets the steps timed per configuration, default: 3)\n"
+                   "\t-B Block time steps, bodies take steps down to 1/2^B of the time step\n"
+                   "\t\tdepending on their acceleration (default: 0, max: %u)\n"
+                   "\t-e Distance the acceleration of a body may move it in one block step\n"
+                   "\t\t(default: %g)\n"
+                   "\t-I Integrator (default: euler, leapfrog with -B)\n"
+                   "\t\teuler:    velocity then position, first order\n"
+                   "\t\tleapfrog: kick, drift, kick, second order and symplectic\n"
+                   "\t\tyoshida:  3 leapfrog steps, fourth order and symplectic\n"
+                   "\t-D Time step (default: %g)\n"
+                   "\t-E Print the energy, momentum and angular momentum every that many\n"
+                   "\t\tsteps as JSON (default: 0, never)\n"
+                   "\t-O Record the trajectory of the bodies in that binary file\n"
+                   "\t-F Steps between the frames of the trajectory (default: 1)\n"
+                   "\t-S Fields recorded in the trajectory (default: x,y)\n"
+                   "\t\tAvailable: x, y, velocity_x, velocity_y, mass\n"
+                   "\t-W Write a checkpoint of the bodies to that file every -P steps and\n"
+                   "\t\tat the end\n"
+                   "\t-P Steps between checkpoints (default: %zu)\n"
+                   "\t-r Restart from a checkpoint, -b, -o, -i, -m and -s are ignored and\n"
+                   "\t\t-n counts the steps from the checkpoint\n"
+                   "\t-x Write the phases of every thread as a Chrome trace to that file\n"
+                   "\t-X Write the seconds of each phase by step and thread as CSV to that\n"
+                   "\t\tfile\n"
+                   "\t-H Count cycles, instructions, cache and branch misses of each phase and\n"
+                   "\t\tworker with perf_event_open and add them to the report, per\n"
+                   "\t\tinteraction with the group and naive forces\n"
                    "UI Controls:\n"
-                   "\tEscape/Q: Quit\n"
-                   "\tSpace:    Pause\n",
+                   "\tEscape/Q:    Quit\n"
+                   "\tSpace:       Pause\n"
+                   "\tWheel/+/-:   Zoom\n"
+                   "\tDrag/Arrows: Pan\n"
+                   "\tR:           Reset the camera\n",
                    bodies_count,
-                   gravity);
+                   gravity,
+                   fmm_order,
+                   FMM_MAX_ORDER,
+                   (double)theta,
+                   leaf_capacity,
+                   QUADTREE_MAX_BODIES_COUNT,
+                   (double)body_too_close_threshold,
+                   BLOCK_MAX_LEVELS,
+                   (double)block_accuracy,
+                   (double)time_step,
+                   checkpoint_interval);
             exit(EXIT_SUCCESS);
             break;
         case 'b':
@@ -97,19 +1179,19 @@ main(int argc, char **argv)
             if (errno != 0)
                 die("Invalid argument to -w: %s", optarg);
             break;
+        case 'j':
+            errno = 0;
+            draw_threads_count = strtoul(optarg, NULL, 10);
+            if (errno != 0 || draw_threads_count == 0)
+                die("Invalid argument to -j: %s", optarg);
+            break;
         case 'm': flag_mass = true; break;
         case 'i':
-            if (strcmp(optarg, "uniform") == 0)
-                flag_bodies_initialization_function = body_init_random_uniform;
-            else if (strcmp(optarg, "circle") == 0)
-                flag_bodies_initialization_function = body_init_random_circle;
-            else if (strcmp(optarg, "circle_spin") == 0)
-                flag_bodies_initialization_function = body_init_random_circle_spin;
-            else if (strcmp(optarg, "two_circle") == 0)
-                flag_bodies_initialization_function = body_init_random_two_circle;
-            else if (strcmp(optarg, "thorus") == 0)
-                flag_bodies_initialization_function = body_init_random_thorus;
-            else
+            flag_initialization = ARRAY_LEN(initializations);
+            for (size_t i = 0; i < ARRAY_LEN(initializations); i++)
+                if (strcmp(optarg, initializations[i].name) == 0)
+                    flag_initialization = i;
+            if (flag_initialization == ARRAY_LEN(initializations))
                 die("'%s' is not a valid body initialization", optarg);
             break;
         case 'g':
@@ -119,104 +1201,262 @@ main(int argc, char **argv)
                 die("Invalid argument to -w: %s", optarg);
             break;
         case 'd': flag_debug = true; break;
+        case 'n':
+            errno = 0;
+            flag_steps = strtoul(optarg, NULL, 10);
+            if (errno != 0 || flag_steps == 0)
+                die("Invalid argument to -n: %s", optarg);
+            break;
+        case 's':
+            errno = 0;
+            seed = strtoul(optarg, NULL, 10);
+            if (errno != 0)
+                die("Invalid argument to -s: %s", optarg);
+            flag_seed = true;
+            break;
+        case 'T':
+            flag_insert = strcmp(optarg, "insert") == 0;
+            flag_refit = strcmp(optarg, "refit") == 0;
+            if (!flag_insert && !flag_refit && strcmp(optarg, "morton") != 0)
+                die("'%s' is not a valid quadtree construction", optarg);
+            break;
+        case 'f':
+            flag_force = FORCE_COUNT;
+            for (size_t i = 0; i < FORCE_COUNT; i++)
+                if (strcmp(optarg, force_names[i]) == 0)
+                    flag_force = i;
+            if (flag_force == FORCE_COUNT)
+                die("'%s' is not a valid force computation", optarg);
+#ifndef HAVE_CUDA
+            if (flag_force == FORCE_CUDA)
+                die("n-body was built without CUDA");
+#endif
+            break;
+        case 'p':
+            errno = 0;
+            fmm_order = strtoul(optarg, NULL, 10);
+            // Order 0 has no gradient, the far field would be dropped
+            if (errno != 0 || fmm_order < 1 || fmm_order > FMM_MAX_ORDER)
+                die("Invalid argument to -p: %s", optarg);
+            break;
+        case 't':
+            errno = 0;
+            theta = strtof(optarg, NULL);
+            if (errno != 0 || !(theta > 0.0f))
+                die("Invalid argument to -t: %s", optarg);
+            break;
+        case 'k': flag_kernel = optarg; break;
+        case 'K': flag_check_kernels = true; break;
+        case 'l':
+            errno = 0;
+            leaf_capacity = strtoul(optarg, NULL, 10);
+            if (errno != 0 || leaf_capacity == 0 || leaf_capacity > QUADTREE_MAX_BODIES_COUNT)
+                die("Invalid argument to -l: %s", optarg);
+            break;
+        case 'c':
+            errno = 0;
+            body_too_close_threshold = strtof(optarg, NULL);
+            if (errno != 0 || body_too_close_threshold < 0.0f)
+                die("Invalid argument to -c: %s", optarg);
+            break;
+        case 'q':
+            errno = 0;
+            body_softening = strtof(optarg, NULL);
+            if (errno != 0 || !(body_softening >= 0.0f))
+                die("Invalid argument to -q: %s", optarg);
+            break;
+        case 'B':
+            errno = 0;
+            block_levels = strtoul(optarg, NULL, 10);
+            if (errno != 0 || block_levels > BLOCK_MAX_LEVELS)
+                die("Invalid argument to -B: %s", optarg);
+            break;
+        case 'e':
+            errno = 0;
+            block_accuracy = strtof(optarg, NULL);
+            if (errno != 0 || !(block_accuracy > 0.0f))
+                die("Invalid argument to -e: %s", optarg);
+            break;
+        case 'I':
+            flag_integrator = INTEGRATOR_COUNT;
+            for (size_t i = 0; i < INTEGRATOR_COUNT; i++)
+                if (strcmp(optarg, integrator_names[i]) == 0)
+                    flag_integrator = i;
+            if (flag_integrator == INTEGRATOR_COUNT)
+                die("'%s' is not a valid integrator", optarg);
+            break;
+        case 'D':
+            errno = 0;
+            time_step = strtof(optarg, NULL);
+            if (errno != 0 || !(time_step > 0.0f))
+                die("Invalid argument to -D: %s", optarg);
+            break;
+        case 'E':
+            errno = 0;
+            diagnostics_interval = strtoul(optarg, NULL, 10);
+            if (errno != 0)
+                die("Invalid argument to -E: %s", optarg);
+            break;
+        case 'O': trajectory_path = optarg; break;
+        case 'F':
+            errno = 0;
+            trajectory_interval = strtoul(optarg, NULL, 10);
+            if (errno != 0 || trajectory_interval == 0)
+                die("Invalid argument to -F: %s", optarg);
+            break;
+        case 'S':
+            trajectory_fields = trajectory_fields_parse(optarg);
+            if (trajectory_fields == 0)
+                die("Invalid argument to -S: %s", optarg);
+            break;
+        case 'W': checkpoint_path = optarg; break;
+        case 'P':
+            errno = 0;
+            checkpoint_interval = strtoul(optarg, NULL, 10);
+            if (errno != 0 || checkpoint_interval == 0)
+                die("Invalid argument to -P: %s", optarg);
+            break;
+        case 'r': restart_path = optarg; break;
+        case 'x': trace_path = optarg; break;
+        case 'X': profile_csv_path = optarg; break;
+        case 'H': flag_counters = true; break;
+        case 'a': flag_pin = true; break;
+        case 'L': huge_pages = true; break;
+        case 'C':
+            errno = 0;
+            calibration_budget = strtod(optarg, NULL);
+            if (errno != 0 || !(calibration_budget > 0.0))
+                die("Invalid argument to -C: %s", optarg);
+            break;
         }
     }
     if (flag_black_hole)
         bodies_count++;
+    // Block time steps are a leapfrog for each body
+    if (flag_integrator == INTEGRATOR_COUNT)
+        flag_integrator = block_levels != 0 ? INTEGRATOR_LEAPFROG : INTEGRATOR_EULER;
+    if (block_levels != 0 && flag_integrator != INTEGRATOR_LEAPFROG)
+        die("Block time steps only work with the leapfrog integrator");
+    // The expansions are of the unsoftened potential, which is off by far more than their error
+    // for cells about the softening length apart
+    if (body_softening != 0.0f && flag_force == FORCE_FMM)
+        die("-q doesn't work with -f fmm");
+    if (calibration_budget > 0.0 && !force_uses_tree())
+        die("-C only calibrates the quadtree force computations");
+    body_kernel_select(flag_kernel);
 
-    // Get a random seed from the system
-    FILE *random_file = fopen("/dev/random", "r");
-    if (random_file == NULL)
-        die("Cannot open /dev/random");
-    unsigned int seed;
-    fread(&seed, sizeof seed, 1, random_file);
-    if (ferror(random_file))
-        die("Cannot read /dev/random");
-    fclose(random_file);
-    srand(seed);
-    // Initialize the bodies
-    bodies = xmalloc(sizeof(struct body) * bodies_count);
-    for (size_t i = 0; i < bodies_count; i++)
-    {
-        flag_bodies_initialization_function(&bodies[i]);
-        if (flag_mass)
-            bodies[i].mass = frand() + 0.3f;
-    }
-    if (flag_black_hole)
+    // Initialize the workers, they stay parked between steps. The main thread is worker 0 in
+    // headless runs, the simulation thread pins itself otherwise.
+    bool calibrating = calibration_budget > 0.0;
+    bool headless = flag_steps != 0 || calibrating;
+    pool = pool_new(threads_count);
+    if (flag_pin)
+        pool_pin(pool);
+    if (flag_pin && (headless || flag_check_kernels))
+        pool_pin_caller(pool);
+    if (flag_check_kernels)
+        exit(check_kernels() ? EXIT_SUCCESS : EXIT_FAILURE);
+    if (restart_path != NULL)
     {
-        bodies[0].x = 0.5;
-        bodies[0].y = 0.5;
-        bodies[0].mass = 100.0f;
+        // The bodies are used from the mapping, pages are read as the first step touches them
+        uint64_t checkpoint_step;
+        uint32_t checkpoint_seed;
+        checkpoint_map(restart_path, &bodies, &checkpoint_step, &checkpoint_seed);
+        bodies_count = bodies.count;
+        // Checkpoints are between steps, where every kick is closed: the levels only matter to
+        // body_active and can be lowered to a -B smaller than the one of the checkpoint
+        for (size_t i = 0; i < bodies_count; i++)
+            if (bodies.step_level[i] > block_levels)
+                bodies.step_level[i] = block_levels;
+        first_step = checkpoint_step;
+        seed = checkpoint_seed;
+        srand(seed);
     }
-
-    // Initialize threads
-    threads = xmalloc(sizeof(pthread_t *) * threads_count);
-    threads_args = xmalloc(sizeof(struct worker_arg) * threads_count);
-
-    long int fps_sum = 0;
-    long int fps_count = 0;
-    draw_init();
-    bool running = true;
-    bool paused = false;
-    while (running)
+    else
     {
-        draw_handle_events(&running, &paused);
-        if (paused)
-        {
-            SDL_Delay(10);
-            continue;
-        }
-        // update_bodies_naive(bodies, bodies_count, gravity);
-        update_bodies_barnes_hut(bodies, bodies_count, gravity);
-        //
-        // Create a quadtree
-        struct quadtree *bodies_quadtree = quadtree_new(bodies, bodies_count);
-        for (size_t i = 0; i < bodies_count; i++)
-            quadtree_insert(bodies_quadtree, bodies[i]);
-        quadtree_update_mass(bodies_quadtree);
-        if (flag_debug)
+        // Get a random seed from the system
+        if (!flag_seed)
         {
-            struct quadtree_stats stats = {0};
-            quadtree_stats(bodies_quadtree, &stats);
-            printf("stats:\n"
-                   "\tnode count:     %5zu\n"
-                   "\tempty count:    %5zu\n"
-                   "\texternal count: %5zu, average bodies in external %5.1f\n"
-                   "\tinternal count: %5zu\n"
-                   "\tbounds:         % .2f,% .2f -> % .2f,% .2f\n"
-                   "\taverage fps:    %.2f\n",
-                   stats.node_count,
-                   stats.empty_count,
-                   stats.external_count,
-                   (double)bodies_count / (double)stats.external_count,
-                   stats.internal_count,
-                   (double)bodies_quadtree->start_x,
-                   (double)bodies_quadtree->start_y,
-                   (double)bodies_quadtree->end_x,
-                   (double)bodies_quadtree->end_y,
-                   (double)fps_sum / (double)fps_count);
+            FILE *random_file = fopen("/dev/random", "r");
+            if (random_file == NULL)
+                die("Cannot open /dev/random");
+            fread(&seed, sizeof seed, 1, random_file);
+            if (ferror(random_file))
+                die("Cannot read /dev/random");
+            fclose(random_file);
         }
-        // Create threads to compute the gravitational forces
-        size_t stride = bodies_count / threads_count;
-        for (size_t i = 0, start_index = 0; i < threads_count; i++, start_index += stride)
+        srand(seed);
+        // Initialize the bodies
+        bodies_init(&bodies, bodies_count, pool);
+        pool_run_owned(pool, (pool_func)init_func, &bodies, bodies_count, 4096);
+        if (flag_black_hole)
         {
-            threads_args[i] = (struct worker_arg){
-                .start_index = start_index,
-                .stop_index = start_index + stride,
-                .quadtree = bodies_quadtree,
-            };
-            pthread_create(&threads[i], NULL, (void *(*)(void *))worker_func, &threads_args[i]);
+            bodies.x[0] = 0.5;
+            bodies.y[0] = 0.5;
+            bodies.mass[0] = 100.0f;
         }
-        for (size_t i = 0; i < threads_count; i++)
-            pthread_join(threads[i], NULL);
-        fps_sum += draw_update(bodies, bodies_count, flag_mass, flag_debug ? bodies_quadtree : NULL);
-        fps_count++;
-        quadtree_destroy(bodies_quadtree);
-        // SDL_Delay(100);
     }
-    free(threads);
-    free(threads_args);
-    free(bodies);
-    draw_quit();
+
+    quadtree_init(&bodies_quadtree);
+    bodies_quadtree.theta = theta;
+    quadtree_set_leaf_capacity(&bodies_quadtree, leaf_capacity);
+    if (flag_refit)
+        bodies_quadtree.root_margin = 0.05f;
+    workers_lists = xmalloc(sizeof(struct quadtree_list) * threads_count);
+    for (size_t i = 0; i < threads_count; i++)
+        quadtree_list_init(&workers_lists[i]);
+    workers_interactions = xaligned_alloc(64, sizeof(size_t) * 8 * threads_count);
+    memset(workers_interactions, 0, sizeof(size_t) * 8 * threads_count);
+    morton_init(&bodies_morton);
+    fmm_init(&bodies_fmm, fmm_order);
+    if (!flag_insert)
+        bodies_init(&bodies_scratch, bodies_count, pool);
+
+    size_t steps_count = first_step;
+    if (calibrating)
+        calibrate();
+    else if (trajectory_path != NULL)
+    {
+        trajectory_open(&trajectory, trajectory_path, trajectory_fields, bodies_count);
+        pool_unpin(pool, trajectory.thread);
+    }
+    atomic_store(&running, !calibrating);
+    if ((trace_path != NULL || profile_csv_path != NULL || flag_counters) &&
+        !profile_init(phase_names, PHASE_COUNT, flag_counters))
+        fprintf(stderr, "No performance counter available, the profile only has times\n");
+    double start_time = time_seconds();
+    if (headless)
+        steps_count = simulate(steps_count, true);
+    else
+        show_window(&steps_count);
+    if (headless && diagnostics_interval != 0 && steps_count % diagnostics_interval == 0)
+        print_diagnostics(steps_count);
+    if (trajectory_path != NULL && !calibrating)
+    {
+        if (headless && steps_count % trajectory_interval == 0)
+            trajectory_write(
+                &trajectory, &bodies, steps_count, (double)steps_count * time_step, pool);
+        trajectory_close(&trajectory);
+    }
+    if (checkpoint_path != NULL && !calibrating && steps_count != first_step)
+        checkpoint_write(checkpoint_path, &bodies, steps_count, seed);
+    if (headless && !calibrating)
+        print_report(steps_count - first_step, time_seconds() - start_time);
+    if (trace_path != NULL)
+        profile_write_trace(trace_path);
+    if (profile_csv_path != NULL)
+        profile_write_csv(profile_csv_path);
+    profile_destroy();
+    pool_destroy(pool);
+    quadtree_destroy(&bodies_quadtree);
+    for (size_t i = 0; i < threads_count; i++)
+        quadtree_list_destroy(&workers_lists[i]);
+    free(workers_lists);
+    free(workers_interactions);
+    morton_destroy(&bodies_morton);
+    fmm_destroy(&bodies_fmm);
+    if (!flag_insert)
+        bodies_destroy(&bodies_scratch);
+    bodies_destroy(&bodies);
     return EXIT_SUCCESS;
 }
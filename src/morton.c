@@ -0,0 +1,190 @@
+#include "morton.h"
+#include "utils.h"
+
+void
+morton_init(struct morton *morton)
+{
+    memset(morton, 0, sizeof *morton);
+}
+
+void
+morton_destroy(struct morton *morton)
+{
+    free(morton->keys);
+    free(morton->order);
+    free(morton->keys_tmp);
+    free(morton->order_tmp);
+    free(morton->histograms);
+    memset(morton, 0, sizeof *morton);
+}
+
+// Spread the lower 16 bits of `x` to the even bits
+static uint32_t
+spread_bits(uint32_t x)
+{
+    x &= 0x0000ffff;
+    x = (x | (x << 8)) & 0x00ff00ff;
+    x = (x | (x << 4)) & 0x0f0f0f0f;
+    x = (x | (x << 2)) & 0x33333333;
+    x = (x | (x << 1)) & 0x55555555;
+    return x;
+}
+
+static uint32_t
+quantize(float value, float start, float end)
+{
+    const float cells = (float)(1 << MORTON_LEVELS);
+    float       cell = (value - start) / (end - start) * cells;
+    if (!(cell > 0.0f))  // also catches NaN of an empty range
+        return 0;
+    if (cell >= cells)
+        return (1 << MORTON_LEVELS) - 1;
+    return (uint32_t)cell;
+}
+
+uint32_t
+morton_encode(float x, float y, float start_x, float start_y, float end_x, float end_y)
+{
+    return spread_bits(quantize(x, start_x, end_x)) |
+           (spread_bits(quantize(y, start_y, end_y)) << 1);
+}
+
+struct morton_job
+{
+    struct morton       *morton;
+    const struct bodies *bodies;
+    float                start_x;
+    float                start_y;
+    float                end_x;
+    float                end_y;
+    unsigned int         shift;
+};
+
+static void
+morton_keys_func(const struct morton_job *job, size_t start, size_t stop, size_t worker)
+{
+    (void)worker;
+    for (size_t i = start; i < stop; i++)
+    {
+        job->morton->keys[i] = morton_encode(job->bodies->x[i],
+                                             job->bodies->y[i],
+                                             job->start_x,
+                                             job->start_y,
+                                             job->end_x,
+                                             job->end_y);
+        job->morton->order[i] = i;
+    }
+}
+
+static void
+morton_partition(const struct morton_job *job, size_t partition, size_t *start, size_t *stop)
+{
+    size_t count = job->bodies->count;
+    *start = count * partition / job->morton->partitions_count;
+    *stop = count * (partition + 1) / job->morton->partitions_count;
+}
+
+static void
+morton_histogram_func(const struct morton_job *job, size_t start, size_t stop, size_t worker)
+{
+    (void)worker;
+    const struct morton *morton = job->morton;
+    for (size_t partition = start; partition < stop; partition++)
+    {
+        size_t *histogram = morton->histograms[partition];
+        size_t  first, last;
+        morton_partition(job, partition, &first, &last);
+        memset(histogram, 0, sizeof(size_t) * 256);
+        for (size_t i = first; i < last; i++)
+            histogram[(morton->keys[i] >> job->shift) & 0xff]++;
+    }
+}
+
+static void
+morton_scatter_func(const struct morton_job *job, size_t start, size_t stop, size_t worker)
+{
+    (void)worker;
+    const struct morton *morton = job->morton;
+    for (size_t partition = start; partition < stop; partition++)
+    {
+        size_t *offsets = morton->histograms[partition];
+        size_t  first, last;
+        morton_partition(job, partition, &first, &last);
+        for (size_t i = first; i < last; i++)
+        {
+            size_t j = offsets[(morton->keys[i] >> job->shift) & 0xff]++;
+            morton->keys_tmp[j] = morton->keys[i];
+            morton->order_tmp[j] = morton->order[i];
+        }
+    }
+}
+
+// Compute the keys of all bodies and sort them with a LSD radix sort, 8 bits per pass.
+// Each worker counts and scatters the digits of its own partition of the keys, partitions
+// scatter to disjoint ranges in partition order so the sort stays stable.
+void
+morton_sort(struct morton       *morton,
+            const struct bodies *bodies,
+            float                start_x,
+            float                start_y,
+            float                end_x,
+            float                end_y,
+            struct pool         *pool)
+{
+    size_t count = bodies->count;
+    if (count > morton->capacity)
+    {
+        free(morton->keys);
+        free(morton->order);
+        free(morton->keys_tmp);
+        free(morton->order_tmp);
+        morton->capacity = count;
+        morton->keys = xmalloc(sizeof(uint32_t) * count);
+        morton->order = xmalloc(sizeof(uint32_t) * count);
+        morton->keys_tmp = xmalloc(sizeof(uint32_t) * count);
+        morton->order_tmp = xmalloc(sizeof(uint32_t) * count);
+    }
+    if (morton->partitions_count != pool_workers_count(pool))
+    {
+        morton->partitions_count = pool_workers_count(pool);
+        free(morton->histograms);
+        morton->histograms = xmalloc(sizeof(size_t[256]) * morton->partitions_count);
+    }
+    if (count == 0)
+        return;
+    struct morton_job job = {
+        .morton = morton,
+        .bodies = bodies,
+        .start_x = start_x,
+        .start_y = start_y,
+        .end_x = end_x,
+        .end_y = end_y,
+    };
+    pool_run(pool, (pool_func)morton_keys_func, &job, count, 0);
+    for (job.shift = 0; job.shift < 32; job.shift += 8)
+    {
+        pool_run(pool, (pool_func)morton_histogram_func, &job, morton->partitions_count, 1);
+        // Turn the histograms into the first destination of each digit in each partition
+        size_t sum = 0;
+        for (size_t digit = 0; digit < 256; digit++)
+        {
+            for (size_t partition = 0; partition < morton->partitions_count; partition++)
+            {
+                size_t digit_count = morton->histograms[partition][digit];
+                morton->histograms[partition][digit] = sum;
+                sum += digit_count;
+            }
+        }
+        size_t first_digit = (morton->keys[0] >> job.shift) & 0xff;
+        if (morton->histograms[0][first_digit] == 0 &&
+            (first_digit == 255 || morton->histograms[0][first_digit + 1] == count))
+            continue;  // every key has the same digit, the pass wouldn't change anything
+        pool_run(pool, (pool_func)morton_scatter_func, &job, morton->partitions_count, 1);
+        uint32_t *tmp = morton->keys;
+        morton->keys = morton->keys_tmp;
+        morton->keys_tmp = tmp;
+        tmp = morton->order;
+        morton->order = morton->order_tmp;
+        morton->order_tmp = tmp;
+    }
+}
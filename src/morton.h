@@ -0,0 +1,45 @@
+#ifndef MORTON_H
+#define MORTON_H
+
+#include "body.h"
+#include "pool.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Z-order keys interleave MORTON_LEVELS bits of x (even bits) and y (odd bits).
+// The 2 bits of a level select the same quadrant as the quadtree: 0 nw, 1 ne, 2 sw, 3 se.
+#define MORTON_LEVELS 16
+
+struct morton
+{
+    size_t    capacity;
+    uint32_t *keys;
+    uint32_t *order;  // order[i] is the index of the body with the i-th smallest key
+    uint32_t *keys_tmp;
+    uint32_t *order_tmp;
+    size_t    partitions_count;
+    size_t (*histograms)[256];  // digit histogram of each partition of the radix sort
+};
+
+void
+morton_init(struct morton *morton);
+void
+morton_destroy(struct morton *morton);
+uint32_t
+morton_encode(float x, float y, float start_x, float start_y, float end_x, float end_y);
+void
+morton_sort(struct morton       *morton,
+            const struct bodies *bodies,
+            float                start_x,
+            float                start_y,
+            float                end_x,
+            float                end_y,
+            struct pool         *pool);
+
+static inline unsigned int
+morton_quadrant(uint32_t key, unsigned int level)
+{
+    return (key >> (2 * (MORTON_LEVELS - 1 - level))) & 3;
+}
+
+#endif
@@ -0,0 +1,269 @@
+#define _GNU_SOURCE
+#include "pool.h"
+#include "profile.h"
+#include "utils.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Persistent worker pool.
+// Workers are created once and park on a condition variable between jobs.
+// A job is a range of items handed out in chunks through an atomic counter, so a
+// worker that finishes early keeps taking chunks instead of waiting for a slow one.
+
+struct pool_worker
+{
+    struct pool *pool;
+    size_t       id;
+};
+
+struct pool
+{
+    size_t              workers_count;
+    pthread_t          *threads;
+    struct pool_worker *workers;
+    pthread_mutex_t     mutex;
+    pthread_cond_t      start_cond;
+    pthread_cond_t      done_cond;
+    uint64_t            generation;
+    size_t              running_count;
+    bool                quit;
+    int                *cpus;  // of each worker once pinned, NULL before
+#ifdef __linux__
+    cpu_set_t           process_cpus;  // before pinning, for the threads started afterwards
+#endif
+    // Current job
+    pool_func     func;
+    void         *arg;
+    size_t        count;
+    size_t        chunk;
+    bool          blocks;  // a contiguous block per worker instead of chunks
+    atomic_size_t next;
+    uint16_t      phase;  // of the thread calling pool_run, for the profile
+};
+
+static void
+pool_work(struct pool *pool, size_t worker)
+{
+    double work_start = 0.0;
+    if (profile_enabled)
+    {
+        profile_mark(pool->phase, PROFILE_WORK);
+        work_start = time_seconds();
+    }
+    if (pool->blocks)
+    {
+        size_t start = pool->count * worker / pool->workers_count;
+        size_t stop = pool->count * (worker + 1) / pool->workers_count;
+        if (start < stop)
+            pool->func(pool->arg, start, stop, worker);
+    }
+    size_t start;
+    while (!pool->blocks && (start = atomic_fetch_add_explicit(
+                                 &pool->next, pool->chunk, memory_order_relaxed)) < pool->count)
+    {
+        size_t stop = start + pool->chunk;
+        if (stop > pool->count)
+            stop = pool->count;
+        pool->func(pool->arg, start, stop, worker);
+    }
+    if (profile_enabled)
+        profile_record(pool->phase, PROFILE_WORK, work_start, time_seconds());
+}
+
+static void *
+pool_worker_func(struct pool_worker *worker)
+{
+    struct pool *pool = worker->pool;
+    uint64_t     seen_generation = 0;
+    profile_thread("worker");
+    while (true)
+    {
+        pthread_mutex_lock(&pool->mutex);
+        while (pool->generation == seen_generation && !pool->quit)
+            pthread_cond_wait(&pool->start_cond, &pool->mutex);
+        if (pool->quit)
+        {
+            pthread_mutex_unlock(&pool->mutex);
+            break;
+        }
+        seen_generation = pool->generation;
+        pthread_mutex_unlock(&pool->mutex);
+
+        pool_work(pool, worker->id);
+
+        pthread_mutex_lock(&pool->mutex);
+        pool->running_count--;
+        if (pool->running_count == 0)
+            pthread_cond_signal(&pool->done_cond);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+    return NULL;
+}
+
+struct pool *
+pool_new(size_t workers_count)
+{
+    if (workers_count == 0)
+        workers_count = 1;
+    struct pool *pool = xmalloc(sizeof(struct pool));
+    memset(pool, 0, sizeof *pool);
+    pool->workers_count = workers_count;
+    pool->threads = xmalloc(sizeof(pthread_t) * workers_count);
+    pool->workers = xmalloc(sizeof(struct pool_worker) * workers_count);
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->start_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    atomic_init(&pool->next, 0);
+    // Worker 0 is the thread calling pool_run
+    for (size_t i = 1; i < workers_count; i++)
+    {
+        pool->workers[i] = (struct pool_worker){.pool = pool, .id = i};
+        if (pthread_create(
+                &pool->threads[i], NULL, (void *(*)(void *))pool_worker_func, &pool->workers[i]) !=
+            0)
+            die("Cannot create worker thread");
+    }
+    return pool;
+}
+
+void
+pool_destroy(struct pool *pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->start_cond);
+    pthread_mutex_unlock(&pool->mutex);
+    for (size_t i = 1; i < pool->workers_count; i++)
+        pthread_join(pool->threads[i], NULL);
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->start_cond);
+    pthread_cond_destroy(&pool->done_cond);
+    free(pool->threads);
+    free(pool->workers);
+    free(pool->cpus);
+    free(pool);
+}
+
+size_t
+pool_workers_count(const struct pool *pool)
+{
+    return pool->workers_count;
+}
+
+static void
+pool_dispatch(struct pool *pool, pool_func func, void *arg, size_t count, size_t chunk, bool blocks)
+{
+    if (count == 0)
+        return;
+    if (chunk == 0)
+    {
+        chunk = count / (pool->workers_count * 16);
+        if (chunk == 0)
+            chunk = 1;
+    }
+    pthread_mutex_lock(&pool->mutex);
+    pool->func = func;
+    pool->arg = arg;
+    pool->count = count;
+    pool->chunk = chunk;
+    pool->blocks = blocks;
+    pool->phase = profile_phase();
+    atomic_store_explicit(&pool->next, 0, memory_order_relaxed);
+    pool->running_count = pool->workers_count - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start_cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    pool_work(pool, 0);
+
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->running_count > 0)
+        pthread_cond_wait(&pool->done_cond, &pool->mutex);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+// Run `func` over [0, count) on all workers and wait for every item to be processed.
+// `chunk` is the number of items taken at once, 0 picks one that gives each worker
+// several chunks to balance non-uniform work.
+void
+pool_run(struct pool *pool, pool_func func, void *arg, size_t count, size_t chunk)
+{
+    pool_dispatch(pool, func, arg, count, chunk, false);
+}
+
+// Like pool_run for items of the same cost, but once the workers are pinned each one always
+// gets the same contiguous block: it touches first the pages of its block and finds them on its
+// own NUMA node the next times.
+void
+pool_run_owned(struct pool *pool, pool_func func, void *arg, size_t count, size_t chunk)
+{
+    pool_dispatch(pool, func, arg, count, chunk, pool->cpus != NULL);
+}
+
+static void
+pool_pin_thread(pthread_t thread, int cpu)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(thread, sizeof set, &set) != 0)
+        die("Cannot pin a worker to CPU %d", cpu);
+#else
+    (void)thread;
+    (void)cpu;
+#endif
+}
+
+// Pin worker i to the i-th CPU the calling thread may run on (wrapping around when there are
+// more workers), worker 0 is pinned by pool_pin_caller from the thread running the jobs
+void
+pool_pin(struct pool *pool)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof set, &set) != 0)
+        die("Cannot get the CPUs of the process");
+    pool->process_cpus = set;
+    size_t cpus_count = CPU_COUNT(&set);
+    int   *cpus = xmalloc(sizeof(int) * cpus_count);
+    for (int cpu = 0, i = 0; i < (int)cpus_count; cpu++)
+        if (CPU_ISSET(cpu, &set))
+            cpus[i++] = cpu;
+    free(pool->cpus);
+    pool->cpus = xmalloc(sizeof(int) * pool->workers_count);
+    for (size_t i = 0; i < pool->workers_count; i++)
+        pool->cpus[i] = cpus[i % cpus_count];
+    free(cpus);
+    for (size_t i = 1; i < pool->workers_count; i++)
+        pool_pin_thread(pool->threads[i], pool->cpus[i]);
+#else
+    (void)pool;
+    die("Pinning the workers is only supported on Linux");
+#endif
+}
+
+// Threads created by the caller afterwards start on the same CPU
+void
+pool_pin_caller(struct pool *pool)
+{
+    pool_pin_thread(pthread_self(), pool->cpus[0]);
+}
+
+// Threads started by a pinned caller inherit its single CPU, let them run on all the CPUs the
+// process had instead of competing with worker 0
+void
+pool_unpin(struct pool *pool, pthread_t thread)
+{
+#ifdef __linux__
+    if (pool->cpus != NULL &&
+        pthread_setaffinity_np(thread, sizeof pool->process_cpus, &pool->process_cpus) != 0)
+        die("Cannot unpin a thread");
+#else
+    (void)pool;
+    (void)thread;
+#endif
+}
@@ -0,0 +1,30 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+// Called with a range of items [start, stop) and the index of the worker running it
+// (0 is always the thread calling `pool_run`).
+typedef void (*pool_func)(void *arg, size_t start, size_t stop, size_t worker);
+
+struct pool;
+
+struct pool *
+pool_new(size_t workers_count);
+void
+pool_destroy(struct pool *pool);
+size_t
+pool_workers_count(const struct pool *pool);
+void
+pool_run(struct pool *pool, pool_func func, void *arg, size_t count, size_t chunk);
+void
+pool_run_owned(struct pool *pool, pool_func func, void *arg, size_t count, size_t chunk);
+void
+pool_pin(struct pool *pool);
+void
+pool_pin_caller(struct pool *pool);
+void
+pool_unpin(struct pool *pool, pthread_t thread);
+
+#endif
@@ -0,0 +1,340 @@
+#include "profile.h"
+#include "counters.h"
+#include "utils.h"
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+struct profile_totals
+{
+    double   seconds;
+    size_t   spans;
+    uint64_t counters[COUNTER_COUNT];
+};
+
+struct profile_ring
+{
+    struct profile_event  *events;
+    size_t                 head;  // events recorded, the last PROFILE_RING_CAPACITY are kept
+    char                   name[32];
+    struct counters        counters;
+    uint64_t             (*marks)[COUNTER_COUNT];  // by kind and phase, see profile_mark
+    struct profile_totals *totals;                 // by kind and phase
+};
+
+bool profile_enabled = false;
+
+static const char *const   *profile_phase_names = NULL;
+static size_t               profile_phases_count = 0;
+static double               profile_origin = 0.0;
+static atomic_uint          profile_current_step;
+static pthread_mutex_t      profile_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct profile_ring **profile_rings = NULL;
+static size_t               profile_rings_count = 0;
+static size_t               profile_rings_capacity = 0;
+static bool                 profile_counters = false;
+
+static _Thread_local struct profile_ring *profile_thread_ring = NULL;
+static _Thread_local const char          *profile_thread_name = "thread";
+static _Thread_local uint16_t             profile_thread_phase = 0;
+
+static const char *profile_kind_names[] = {"phase", "work"};
+
+static struct profile_ring *
+profile_own_ring(void);
+
+bool
+profile_init(const char *const *phase_names, size_t phases_count, bool counters)
+{
+    profile_phase_names = phase_names;
+    profile_phases_count = phases_count;
+    profile_origin = time_seconds();
+    atomic_init(&profile_current_step, 0);
+    profile_counters = counters;
+    profile_enabled = true;
+    return !counters || profile_own_ring()->counters.available != 0;
+}
+
+void
+profile_destroy(void)
+{
+    profile_enabled = false;
+    for (size_t i = 0; i < profile_rings_count; i++)
+    {
+        counters_close(&profile_rings[i]->counters);
+        free(profile_rings[i]->events);
+        free(profile_rings[i]->marks);
+        free(profile_rings[i]->totals);
+        free(profile_rings[i]);
+    }
+    free(profile_rings);
+    profile_rings = NULL;
+    profile_rings_count = 0;
+    profile_rings_capacity = 0;
+}
+
+static void
+profile_ring_name(struct profile_ring *ring, size_t index)
+{
+    snprintf(ring->name, sizeof ring->name, "%s %zu", profile_thread_name, index);
+}
+
+// Ring of the calling thread, created on its first span
+static struct profile_ring *
+profile_own_ring(void)
+{
+    if (profile_thread_ring != NULL)
+        return profile_thread_ring;
+    struct profile_ring *ring = xmalloc(sizeof(struct profile_ring));
+    ring->events = xmalloc(sizeof(struct profile_event) * PROFILE_RING_CAPACITY);
+    ring->head = 0;
+    size_t spans_count = ARRAY_LEN(profile_kind_names) * profile_phases_count;
+    ring->marks = xmalloc(sizeof(uint64_t[COUNTER_COUNT]) * spans_count);
+    ring->totals = xmalloc(sizeof(struct profile_totals) * spans_count);
+    memset(ring->totals, 0, sizeof(struct profile_totals) * spans_count);
+    // counters_open leaves every fd at -1 when it fails
+    if (!profile_counters)
+    {
+        ring->counters.leader = -1;
+        ring->counters.available = 0;
+        for (size_t i = 0; i < COUNTER_COUNT; i++)
+            ring->counters.fds[i] = -1;
+    }
+    else
+        counters_open(&ring->counters);
+    pthread_mutex_lock(&profile_mutex);
+    if (profile_rings_count == profile_rings_capacity)
+    {
+        size_t                capacity =
+            profile_rings_capacity == 0 ? 16 : profile_rings_capacity * 2;
+        struct profile_ring **rings = xmalloc(sizeof(struct profile_ring *) * capacity);
+        memcpy(rings, profile_rings, sizeof(struct profile_ring *) * profile_rings_count);
+        free(profile_rings);
+        profile_rings = rings;
+        profile_rings_capacity = capacity;
+    }
+    profile_ring_name(ring, profile_rings_count);
+    profile_rings[profile_rings_count++] = ring;
+    pthread_mutex_unlock(&profile_mutex);
+    profile_thread_ring = ring;
+    return ring;
+}
+
+void
+profile_thread(const char *name)
+{
+    profile_thread_name = name;
+    if (profile_thread_ring != NULL)
+    {
+        pthread_mutex_lock(&profile_mutex);
+        size_t index = 0;
+        while (profile_rings[index] != profile_thread_ring)
+            index++;
+        profile_ring_name(profile_thread_ring, index);
+        pthread_mutex_unlock(&profile_mutex);
+    }
+}
+
+void
+profile_step(uint32_t step)
+{
+    atomic_store_explicit(&profile_current_step, step, memory_order_relaxed);
+}
+
+void
+profile_set_phase(uint16_t phase)
+{
+    profile_thread_phase = phase;
+}
+
+uint16_t
+profile_phase(void)
+{
+    return profile_thread_phase;
+}
+
+void
+profile_mark(uint16_t phase, enum profile_kind kind)
+{
+    if (!profile_counters)
+        return;
+    struct profile_ring *ring = profile_own_ring();
+    counters_read(&ring->counters, ring->marks[kind * profile_phases_count + phase]);
+}
+
+void
+profile_record(uint16_t phase, enum profile_kind kind, double start, double end)
+{
+    if (!profile_enabled)
+        return;
+    struct profile_ring   *ring = profile_own_ring();
+    struct profile_totals *totals = &ring->totals[kind * profile_phases_count + phase];
+    totals->seconds += end - start;
+    totals->spans++;
+    if (profile_counters)
+    {
+        uint64_t        counts[COUNTER_COUNT];
+        const uint64_t *mark = ring->marks[kind * profile_phases_count + phase];
+        counters_read(&ring->counters, counts);
+        for (size_t i = 0; i < COUNTER_COUNT; i++)
+            totals->counters[i] += counts[i] - mark[i];
+    }
+    ring->events[ring->head++ & (PROFILE_RING_CAPACITY - 1)] = (struct profile_event){
+        .start = start - profile_origin,
+        .end = end - profile_origin,
+        .step = atomic_load_explicit(&profile_current_step, memory_order_relaxed),
+        .phase = phase,
+        .kind = kind,
+    };
+}
+
+// Index of the oldest event still in the ring
+static size_t
+profile_ring_first(const struct profile_ring *ring)
+{
+    return ring->head > PROFILE_RING_CAPACITY ? ring->head - PROFILE_RING_CAPACITY : 0;
+}
+
+void
+profile_write_trace(const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+        die("Cannot open %s", path);
+    fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    for (size_t r = 0; r < profile_rings_count; r++)
+    {
+        const struct profile_ring *ring = profile_rings[r];
+        fprintf(file,
+                "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %zu, "
+                "\"args\": {\"name\": \"%s\"}}",
+                r == 0 ? "" : ",\n",
+                r,
+                ring->name);
+        for (size_t i = profile_ring_first(ring); i < ring->head; i++)
+        {
+            const struct profile_event *event = &ring->events[i & (PROFILE_RING_CAPACITY - 1)];
+            // Timestamps are in microseconds
+            fprintf(file,
+                    ",\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 1, "
+                    "\"tid\": %zu, \"ts\": %.3f, \"dur\": %.3f, \"args\": {\"step\": %u}}",
+                    profile_phase_names[event->phase],
+                    profile_kind_names[event->kind],
+                    r,
+                    event->start * 1e6,
+                    (event->end - event->start) * 1e6,
+                    event->step);
+        }
+    }
+    fprintf(file, "\n]}\n");
+    if (fclose(file) != 0)
+        die("Cannot write %s", path);
+}
+
+void
+profile_write_csv(const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+        die("Cannot open %s", path);
+    fprintf(file, "step,thread,kind,phase,seconds\n");
+    // Steps still in one of the rings
+    uint32_t first_step = UINT32_MAX, last_step = 0;
+    for (size_t r = 0; r < profile_rings_count; r++)
+        for (size_t i = profile_ring_first(profile_rings[r]); i < profile_rings[r]->head; i++)
+        {
+            uint32_t step = profile_rings[r]->events[i & (PROFILE_RING_CAPACITY - 1)].step;
+            first_step = step < first_step ? step : first_step;
+            last_step = step > last_step ? step : last_step;
+        }
+    if (first_step > last_step)
+    {
+        fclose(file);
+        return;
+    }
+    // Seconds by ring, step, kind and phase
+    size_t  kinds_count = ARRAY_LEN(profile_kind_names);
+    size_t  steps_count = (size_t)(last_step - first_step) + 1;
+    size_t  ring_size = steps_count * kinds_count * profile_phases_count;
+    double *seconds = xmalloc(sizeof(double) * profile_rings_count * ring_size);
+    memset(seconds, 0, sizeof(double) * profile_rings_count * ring_size);
+    for (size_t r = 0; r < profile_rings_count; r++)
+        for (size_t i = profile_ring_first(profile_rings[r]); i < profile_rings[r]->head; i++)
+        {
+            const struct profile_event *event =
+                &profile_rings[r]->events[i & (PROFILE_RING_CAPACITY - 1)];
+            size_t step = event->step - first_step;
+            seconds[r * ring_size + (step * kinds_count + event->kind) * profile_phases_count +
+                    event->phase] += event->end - event->start;
+        }
+    for (size_t step = 0; step < steps_count; step++)
+        for (size_t r = 0; r < profile_rings_count; r++)
+            for (size_t kind = 0; kind < kinds_count; kind++)
+                for (size_t phase = 0; phase < profile_phases_count; phase++)
+                {
+                    double value =
+                        seconds[r * ring_size + (step * kinds_count + kind) * profile_phases_count +
+                                phase];
+                    if (value > 0.0)
+                        fprintf(file,
+                                "%zu,%s,%s,%s,%.9f\n",
+                                step + first_step,
+                                profile_rings[r]->name,
+                                profile_kind_names[kind],
+                                profile_phase_names[phase],
+                                value);
+                }
+    free(seconds);
+    if (fclose(file) != 0)
+        die("Cannot write %s", path);
+}
+
+void
+profile_print_totals(FILE *file, size_t interactions)
+{
+    fprintf(file, "[");
+    bool first = true;
+    for (size_t r = 0; r < profile_rings_count; r++)
+    {
+        const struct profile_ring *ring = profile_rings[r];
+        for (size_t kind = 0; kind < ARRAY_LEN(profile_kind_names); kind++)
+            for (size_t phase = 0; phase < profile_phases_count; phase++)
+            {
+                const struct profile_totals *totals =
+                    &ring->totals[kind * profile_phases_count + phase];
+                if (totals->spans == 0)
+                    continue;
+                fprintf(file,
+                        "%s{\"thread\": \"%s\", \"kind\": \"%s\", \"phase\": \"%s\", "
+                        "\"spans\": %zu, \"seconds\": %.6f",
+                        first ? "" : ", ",
+                        ring->name,
+                        profile_kind_names[kind],
+                        profile_phase_names[phase],
+                        totals->spans,
+                        totals->seconds);
+                first = false;
+                // Counters missing on this machine are left out rather than reported as 0
+                for (size_t i = 0; i < COUNTER_COUNT; i++)
+                {
+                    if (!(ring->counters.available & (1u << i)))
+                        continue;
+                    fprintf(file, ", \"%s\": %" PRIu64, counter_names[i], totals->counters[i]);
+                    if (interactions != 0)
+                        fprintf(file,
+                                ", \"%s_per_interaction\": %.4f",
+                                counter_names[i],
+                                (double)totals->counters[i] / (double)interactions);
+                }
+                uint32_t ipc = 1u << COUNTER_CYCLES | 1u << COUNTER_INSTRUCTIONS;
+                if ((ring->counters.available & ipc) == ipc &&
+                    totals->counters[COUNTER_CYCLES] != 0)
+                    fprintf(file,
+                            ", \"instructions_per_cycle\": %.3f",
+                            (double)totals->counters[COUNTER_INSTRUCTIONS] /
+                                (double)totals->counters[COUNTER_CYCLES]);
+                fprintf(file, "}");
+            }
+    }
+    fprintf(file, "]");
+}
@@ -0,0 +1,66 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Spans of the step phases recorded by every thread in its own ring buffer, the oldest ones are
+// overwritten once it's full. Recording is a store in memory of the thread only, the rings are
+// read when exporting after the threads are done.
+#define PROFILE_RING_CAPACITY (1u << 16)
+
+enum profile_kind
+{
+    PROFILE_PHASE,  // whole phase on the thread running it
+    PROFILE_WORK,   // part of a pool job run by a worker
+};
+
+struct profile_event
+{
+    double   start;  // seconds since profile_init
+    double   end;
+    uint32_t step;
+    uint16_t phase;  // index in the names given to profile_init
+    uint8_t  kind;
+};
+
+// Nothing is recorded until then
+extern bool profile_enabled;
+
+// With `counters` every thread also opens its performance counters and the spans add up the
+// counts, false if the calling thread couldn't open any (the spans are still timed)
+bool
+profile_init(const char *const *phase_names, size_t phases_count, bool counters);
+void
+profile_destroy(void);
+// Name the ring of the calling thread in the exports
+void
+profile_thread(const char *name);
+// Step of the spans recorded from now on, by any thread
+void
+profile_step(uint32_t step);
+// Phase run by the calling thread, given to the pool jobs it starts
+void
+profile_set_phase(uint16_t phase);
+uint16_t
+profile_phase(void);
+// Counters at the start of a span, profile_record adds what was counted since
+void
+profile_mark(uint16_t phase, enum profile_kind kind);
+// `start` and `end` come from time_seconds
+void
+profile_record(uint16_t phase, enum profile_kind kind, double start, double end);
+// Chrome trace event JSON, to open in chrome://tracing or ui.perfetto.dev
+void
+profile_write_trace(const char *path);
+// One line per step, thread, kind and phase with the seconds spent
+void
+profile_write_csv(const char *path);
+// JSON array of the totals by thread, kind and phase over the whole run, the counters are also
+// divided by `interactions`
+void
+profile_print_totals(FILE *file, size_t interactions);
+
+#endif
@@ -2,177 +2,940 @@
 #include <stdlib.h>
 #include "quadtree.h"
 #include "body.h"
+#include "morton.h"
 #include "utils.h"
 
 static bool
-in_boundary(struct quadtree *quadtree, struct body body)
+in_boundary(const struct quadtree_node *node, float x, float y)
 {
-    return body.x <= quadtree->end_x && body.x >= quadtree->start_x && body.y <= quadtree->end_y &&
-           body.y >= quadtree->start_y;
+    return x <= node->end_x && x >= node->start_x && y <= node->end_y && y >= node->start_y;
 }
 
-static struct quadtree *
-quadtree_new_no_bounding_box()
+// Make room for `count` more nodes.
+// Pointers to nodes are invalidated when the arena grows, only indices are stable.
+static void
+quadtree_nodes_reserve(struct quadtree *quadtree, uint32_t count)
 {
-    struct quadtree *quadtree = malloc(sizeof(struct quadtree));
-    assert(quadtree != NULL);
-    memset(quadtree, 0, sizeof *quadtree);
-    quadtree->type = QUADTREE_EMPTY;
-    return quadtree;
+    if (quadtree->nodes_count + count <= quadtree->nodes_capacity)
+        return;
+    uint32_t capacity = quadtree->nodes_capacity == 0 ? 1024 : quadtree->nodes_capacity * 2;
+    while (capacity < quadtree->nodes_count + count)
+        capacity *= 2;
+    quadtree->nodes = xaligned_realloc(quadtree->nodes,
+                                       64,
+                                       sizeof(struct quadtree_node) * quadtree->nodes_capacity,
+                                       sizeof(struct quadtree_node) * capacity);
+    quadtree->nodes_capacity = capacity;
+}
+
+static void
+quadtree_node_clear(struct quadtree_node *node)
+{
+    node->type = QUADTREE_EMPTY;
+    node->total_mass = 0.0f;
+    node->center_of_mass_x = 0.0f;
+    node->center_of_mass_y = 0.0f;
+    node->quadrupole_xx = 0.0f;
+    node->quadrupole_xy = 0.0f;
+    node->quadrupole_yy = 0.0f;
+}
+
+// Take `count` consecutive empty nodes from the arena, growing it if needed.
+static uint32_t
+quadtree_node_alloc(struct quadtree *quadtree, uint32_t count)
+{
+    quadtree_nodes_reserve(quadtree, count);
+    uint32_t index = quadtree->nodes_count;
+    quadtree->nodes_count += count;
+    for (uint32_t i = index; i < quadtree->nodes_count; i++)
+        quadtree_node_clear(&quadtree->nodes[i]);
+    return index;
 }
 
-struct quadtree *
-quadtree_new(struct body *bodies, size_t bodies_count)
+// Make room for `count` more buckets
+static void
+quadtree_buckets_reserve(struct quadtree *quadtree, uint32_t count)
 {
-    struct quadtree *quadtree = quadtree_new_no_bounding_box();
-    quadtree->start_x = INFINITY;
-    quadtree->start_y = INFINITY;
-    quadtree->end_x = -INFINITY;
-    quadtree->end_y = -INFINITY;
-    for (size_t i = 0; i < bodies_count; i++)
+    if (quadtree->buckets_count + count <= quadtree->buckets_capacity)
+        return;
+    uint32_t capacity = quadtree->buckets_capacity == 0 ? 1024 : quadtree->buckets_capacity * 2;
+    while (capacity < quadtree->buckets_count + count)
+        capacity *= 2;
+    size_t old_size = sizeof(float) * quadtree->buckets_capacity * quadtree->bucket_lanes;
+    size_t size = sizeof(float) * capacity * quadtree->bucket_lanes;
+    quadtree->bucket_x = xaligned_realloc(quadtree->bucket_x, 32, old_size, size);
+    quadtree->bucket_y = xaligned_realloc(quadtree->bucket_y, 32, old_size, size);
+    quadtree->bucket_mass = xaligned_realloc(quadtree->bucket_mass, 32, old_size, size);
+    quadtree->bucket_index = xaligned_realloc(quadtree->bucket_index, 32, old_size, size);
+    free(quadtree->free_buckets);
+    quadtree->free_buckets = xmalloc(sizeof(uint32_t) * capacity);
+    quadtree->buckets_capacity = capacity;
+}
+
+// Take an empty bucket, returns the index of its first lane
+static uint32_t
+quadtree_bucket_alloc(struct quadtree *quadtree)
+{
+    uint32_t bucket;
+    if (quadtree->free_buckets_count > 0)
+        bucket = quadtree->free_buckets[--quadtree->free_buckets_count];
+    else
     {
-        if (bodies[i].x < quadtree->start_x)
-            quadtree->start_x = bodies[i].x;
-        if (bodies[i].y < quadtree->start_y)
-            quadtree->start_y = bodies[i].y;
-        if (bodies[i].x > quadtree->end_x)
-            quadtree->end_x = bodies[i].x;
-        if (bodies[i].y > quadtree->end_y)
-            quadtree->end_y = bodies[i].y;
+        quadtree_buckets_reserve(quadtree, 1);
+        bucket = quadtree->buckets_count++ * quadtree->bucket_lanes;
     }
-    return quadtree;
+    for (uint32_t i = bucket; i < bucket + quadtree->bucket_lanes; i++)
+    {
+        quadtree->bucket_x[i] = 0.0f;
+        quadtree->bucket_y[i] = 0.0f;
+        quadtree->bucket_mass[i] = 0.0f;
+    }
+    return bucket;
+}
+
+void
+quadtree_init(struct quadtree *quadtree)
+{
+    memset(quadtree, 0, sizeof *quadtree);
+    quadtree->theta = QUADTREE_DEFAULT_THETA;
+    quadtree->leaf_capacity = QUADTREE_DEFAULT_LEAF_CAPACITY;
+    quadtree->bucket_lanes = QUADTREE_DEFAULT_LEAF_CAPACITY;
 }
 
 void
 quadtree_destroy(struct quadtree *quadtree)
 {
-    if (quadtree->type == QUADTREE_INTERNAL)
+    free(quadtree->nodes);
+    free(quadtree->bucket_x);
+    free(quadtree->bucket_y);
+    free(quadtree->bucket_mass);
+    free(quadtree->bucket_index);
+    free(quadtree->free_buckets);
+    free(quadtree->tasks);
+    free(quadtree->worker_bounds);
+    free(quadtree->flat);
+    free(quadtree->moved);
+    memset(quadtree, 0, sizeof *quadtree);
+}
+
+// Buckets are reallocated with the new stride on the next reset, which needs to come before the
+// next refit
+void
+quadtree_set_leaf_capacity(struct quadtree *quadtree, uint32_t capacity)
+{
+    if (capacity == 0 || capacity > QUADTREE_MAX_BODIES_COUNT)
+        die("leaf capacity must be between 1 and %d", QUADTREE_MAX_BODIES_COUNT);
+    if (capacity == quadtree->leaf_capacity)
+        return;
+    free(quadtree->bucket_x);
+    free(quadtree->bucket_y);
+    free(quadtree->bucket_mass);
+    free(quadtree->bucket_index);
+    free(quadtree->free_buckets);
+    quadtree->bucket_x = NULL;
+    quadtree->bucket_y = NULL;
+    quadtree->bucket_mass = NULL;
+    quadtree->bucket_index = NULL;
+    quadtree->free_buckets = NULL;
+    quadtree->buckets_count = 0;
+    quadtree->buckets_capacity = 0;
+    quadtree->free_buckets_count = 0;
+    quadtree->nodes_count = 0;  // the tree refers to the old buckets, it can't be refitted
+    quadtree->leaf_capacity = capacity;
+    quadtree->bucket_lanes = (capacity + 7) / 8 * 8;
+}
+
+struct quadtree_bounds_job
+{
+    struct quadtree     *quadtree;
+    const struct bodies *bodies;
+};
+
+static void
+quadtree_bounds_func(const struct quadtree_bounds_job *job,
+                     size_t                            start,
+                     size_t                            stop,
+                     size_t                            worker)
+{
+    const struct bodies    *bodies = job->bodies;
+    struct quadtree_bounds *bounds = &job->quadtree->worker_bounds[worker];
+    for (size_t i = start; i < stop; i++)
     {
-        quadtree_destroy(quadtree->internal.nw);
-        quadtree_destroy(quadtree->internal.ne);
-        quadtree_destroy(quadtree->internal.sw);
-        quadtree_destroy(quadtree->internal.se);
+        if (bodies->x[i] < bounds->start_x)
+            bounds->start_x = bodies->x[i];
+        if (bodies->y[i] < bounds->start_y)
+            bounds->start_y = bodies->y[i];
+        if (bodies->x[i] > bounds->end_x)
+            bounds->end_x = bodies->x[i];
+        if (bodies->y[i] > bounds->end_y)
+            bounds->end_y = bodies->y[i];
     }
-    free(quadtree);
 }
 
+// Clear the tree and set the root cell to the bounding box of the bodies,
+// each worker reduces the box of the chunks it takes before they are merged.
 void
-quadtree_insert(struct quadtree *quadtree, struct body body)
+quadtree_reset(struct quadtree *quadtree, const struct bodies *bodies, struct pool *pool)
 {
-    struct quadtree *child = NULL;
-    if (!in_boundary(quadtree, body))
+    quadtree->nodes_count = 0;
+    quadtree->buckets_count = 0;
+    quadtree->free_buckets_count = 0;
+    quadtree->tasks_count = 0;
+    quadtree->top_nodes_count = 0;
+    size_t workers_count = pool_workers_count(pool);
+    if (quadtree->worker_bounds_count != workers_count)
+    {
+        free(quadtree->worker_bounds);
+        quadtree->worker_bounds =
+            xaligned_alloc(64, sizeof(struct quadtree_bounds) * workers_count);
+        quadtree->worker_bounds_count = workers_count;
+    }
+    for (size_t i = 0; i < workers_count; i++)
+        quadtree->worker_bounds[i] = (struct quadtree_bounds){
+            .start_x = INFINITY,
+            .start_y = INFINITY,
+            .end_x = -INFINITY,
+            .end_y = -INFINITY,
+        };
+    struct quadtree_bounds_job job = {.quadtree = quadtree, .bodies = bodies};
+    pool_run(pool, (pool_func)quadtree_bounds_func, &job, bodies->count, 0);
+
+    uint32_t              root_index = quadtree_node_alloc(quadtree, 1);
+    struct quadtree_node *root = &quadtree->nodes[root_index];
+    root->start_x = INFINITY;
+    root->start_y = INFINITY;
+    root->end_x = -INFINITY;
+    root->end_y = -INFINITY;
+    for (size_t i = 0; i < workers_count; i++)
+    {
+        const struct quadtree_bounds *bounds = &quadtree->worker_bounds[i];
+        if (bounds->start_x < root->start_x)
+            root->start_x = bounds->start_x;
+        if (bounds->start_y < root->start_y)
+            root->start_y = bounds->start_y;
+        if (bounds->end_x > root->end_x)
+            root->end_x = bounds->end_x;
+        if (bounds->end_y > root->end_y)
+            root->end_y = bounds->end_y;
+    }
+    float margin_x = (root->end_x - root->start_x) * quadtree->root_margin;
+    float margin_y = (root->end_y - root->start_y) * quadtree->root_margin;
+    root->start_x -= margin_x;
+    root->start_y -= margin_y;
+    root->end_x += margin_x;
+    root->end_y += margin_y;
+}
+
+// Turn a node into an internal node with its 4 children at `children`,
+// the children are cleared and cover the quadrants of the node.
+static void
+quadtree_split_at(struct quadtree *quadtree, uint32_t index, uint32_t children)
+{
+    struct quadtree_node *node = &quadtree->nodes[index];
+    for (uint32_t i = children; i < children + 4; i++)
+        quadtree_node_clear(&quadtree->nodes[i]);
+    node->type = QUADTREE_INTERNAL;
+    node->internal.nw = children + 0;
+    node->internal.ne = children + 1;
+    node->internal.sw = children + 2;
+    node->internal.se = children + 3;
+    struct quadtree_node *nw = &quadtree->nodes[node->internal.nw];
+    struct quadtree_node *ne = &quadtree->nodes[node->internal.ne];
+    struct quadtree_node *sw = &quadtree->nodes[node->internal.sw];
+    struct quadtree_node *se = &quadtree->nodes[node->internal.se];
+    float                 mid_x = node->start_x + (node->end_x - node->start_x) / 2.0f;
+    float                 mid_y = node->start_y + (node->end_y - node->start_y) / 2.0f;
+    // nw
+    nw->start_x = node->start_x;
+    nw->end_x = mid_x;
+    nw->start_y = node->start_y;
+    nw->end_y = mid_y;
+    // ne
+    ne->start_x = mid_x;
+    ne->end_x = node->end_x;
+    ne->start_y = node->start_y;
+    ne->end_y = mid_y;
+    // sw
+    sw->start_x = node->start_x;
+    sw->end_x = mid_x;
+    sw->start_y = mid_y;
+    sw->end_y = node->end_y;
+    // se
+    se->start_x = mid_x;
+    se->end_x = node->end_x;
+    se->start_y = mid_y;
+    se->end_y = node->end_y;
+}
+
+static void
+quadtree_task_push(struct quadtree *quadtree, struct quadtree_task task)
+{
+    if (quadtree->tasks_count == quadtree->tasks_capacity)
+    {
+        quadtree->tasks_capacity =
+            quadtree->tasks_capacity == 0 ? 64 : quadtree->tasks_capacity * 2;
+        quadtree->tasks =
+            realloc(quadtree->tasks, sizeof(struct quadtree_task) * quadtree->tasks_capacity);
+        if (quadtree->tasks == NULL)
+            die("Cannot grow quadtree tasks");
+    }
+    quadtree->tasks[quadtree->tasks_count++] = task;
+}
+
+static void
+quadtree_task_push_once(struct quadtree *quadtree, uint32_t index)
+{
+    for (size_t i = 0; i < quadtree->tasks_count; i++)
+        if (quadtree->tasks[i].index == index)
+            return;
+    quadtree_task_push(quadtree, (struct quadtree_task){.index = index});
+}
+
+static void
+quadtree_split(struct quadtree *quadtree, uint32_t index)
+{
+    uint32_t children = quadtree_node_alloc(quadtree, 4);
+    quadtree_split_at(quadtree, index, children);
+}
+
+static void
+quadtree_insert_node(
+    struct quadtree *quadtree, uint32_t index, float x, float y, float mass, uint32_t body_index)
+{
+    struct quadtree_node *node = &quadtree->nodes[index];
+    uint32_t              child = QUADTREE_ROOT;
+    uint32_t              lane;
+    if (!in_boundary(node, x, y))
         return;
-    switch (quadtree->type)
+    switch (node->type)
     {
     case QUADTREE_EMPTY:
-        quadtree->type = QUADTREE_EXTERNAL;
-        quadtree->external.bodies[0] = body;
-        quadtree->external.bodies_count = 1;
-        break;
+        // Top nodes left empty by a parallel build aren't under any task, the mass of the
+        // subtree that starts here needs one
+        if (index < quadtree->top_nodes_count)
+            quadtree_task_push_once(quadtree, index);
+        node->type = QUADTREE_EXTERNAL;
+        node->external.bucket = quadtree_bucket_alloc(quadtree);
+        node->external.bodies_count = 0;
+        // fallthrough
     case QUADTREE_EXTERNAL:
-        if (quadtree->external.bodies_count < QUADTREE_MAX_BODIES_COUNT)
+        if (node->external.bodies_count < quadtree->leaf_capacity)
         {
-            quadtree->external.bodies[quadtree->external.bodies_count] = body;
-            quadtree->external.bodies_count++;
+            lane = node->external.bucket + node->external.bodies_count;
+            quadtree->bucket_x[lane] = x;
+            quadtree->bucket_y[lane] = y;
+            quadtree->bucket_mass[lane] = mass;
+            quadtree->bucket_index[lane] = body_index;
+            node->external.bodies_count++;
             break;
         }
-        quadtree->type = QUADTREE_INTERNAL;
-        struct body original_bodies[QUADTREE_MAX_BODIES_COUNT];
-        memcpy(original_bodies, quadtree->external.bodies, sizeof original_bodies);
-        quadtree->internal.nw = quadtree_new_no_bounding_box();
-        quadtree->internal.ne = quadtree_new_no_bounding_box();
-        quadtree->internal.sw = quadtree_new_no_bounding_box();
-        quadtree->internal.se = quadtree_new_no_bounding_box();
-        float mid_x = quadtree->start_x + (quadtree->end_x - quadtree->start_x) / 2.0f;
-        float mid_y = quadtree->start_y + (quadtree->end_y - quadtree->start_y) / 2.0f;
-        // nw
-        quadtree->internal.nw->start_x = quadtree->start_x;
-        quadtree->internal.nw->end_x = mid_x;
-        quadtree->internal.nw->start_y = quadtree->start_y;
-        quadtree->internal.nw->end_y = mid_y;
-        // ne
-        quadtree->internal.ne->start_x = mid_x;
-        quadtree->internal.ne->end_x = quadtree->end_x;
-        quadtree->internal.ne->start_y = quadtree->start_y;
-        quadtree->internal.ne->end_y = mid_y;
-        // sw
-        quadtree->internal.sw->start_x = quadtree->start_x;
-        quadtree->internal.sw->end_x = mid_x;
-        quadtree->internal.sw->start_y = mid_y;
-        quadtree->internal.sw->end_y = quadtree->end_y;
-        // se
-        quadtree->internal.se->start_x = mid_x;
-        quadtree->internal.se->end_x = quadtree->end_x;
-        quadtree->internal.se->start_y = mid_y;
-        quadtree->internal.se->end_y = quadtree->end_y;
-        // reinsert the original bodies
-        for (size_t i = 0; i < QUADTREE_MAX_BODIES_COUNT; i++)
-            quadtree_insert(quadtree, original_bodies[i]);
-        quadtree_insert(quadtree, body);  // treated as an internal node now
+        uint32_t bucket = node->external.bucket;
+        uint32_t original_count = node->external.bodies_count;
+        quadtree_split(quadtree, index);
+        // reinsert the original bodies, the bucket is released first so a child can reuse it
+        float    original_x[QUADTREE_MAX_BODIES_COUNT];
+        float    original_y[QUADTREE_MAX_BODIES_COUNT];
+        float    original_mass[QUADTREE_MAX_BODIES_COUNT];
+        uint32_t original_index[QUADTREE_MAX_BODIES_COUNT];
+        memcpy(original_x, &quadtree->bucket_x[bucket], sizeof(float) * original_count);
+        memcpy(original_y, &quadtree->bucket_y[bucket], sizeof(float) * original_count);
+        memcpy(original_mass, &quadtree->bucket_mass[bucket], sizeof(float) * original_count);
+        memcpy(original_index, &quadtree->bucket_index[bucket], sizeof(uint32_t) * original_count);
+        quadtree->free_buckets[quadtree->free_buckets_count++] = bucket;
+        for (size_t i = 0; i < original_count; i++)
+            quadtree_insert_node(
+                quadtree, index, original_x[i], original_y[i], original_mass[i], original_index[i]);
+        // treated as an internal node now
+        quadtree_insert_node(quadtree, index, x, y, mass, body_index);
         break;
     case QUADTREE_INTERNAL:
-        if (in_boundary(quadtree->internal.nw, body))
-            child = quadtree->internal.nw;
-        else if (in_boundary(quadtree->internal.ne, body))
-            child = quadtree->internal.ne;
-        else if (in_boundary(quadtree->internal.sw, body))
-            child = quadtree->internal.sw;
-        else if (in_boundary(quadtree->internal.se, body))
-            child = quadtree->internal.se;
-        quadtree_insert(child, body);
+        if (in_boundary(&quadtree->nodes[node->internal.nw], x, y))
+            child = node->internal.nw;
+        else if (in_boundary(&quadtree->nodes[node->internal.ne], x, y))
+            child = node->internal.ne;
+        else if (in_boundary(&quadtree->nodes[node->internal.sw], x, y))
+            child = node->internal.sw;
+        else if (in_boundary(&quadtree->nodes[node->internal.se], x, y))
+            child = node->internal.se;
+        if (child != QUADTREE_ROOT)
+            quadtree_insert_node(quadtree, child, x, y, mass, body_index);
         break;
     }
 }
 
 void
-quadtree_update_mass(struct quadtree *quadtree)
+quadtree_insert(struct quadtree *quadtree, const struct bodies *bodies, size_t index)
+{
+    quadtree_insert_node(
+        quadtree, QUADTREE_ROOT, bodies->x[index], bodies->y[index], bodies->mass[index], index);
+}
+
+// Split bodies [first, first + count) sorted by Morton key between the 4 quadrants of their
+// cell at `level`, quadrant `i` gets [bounds[i], bounds[i + 1]).
+static void
+quadtree_build_bounds(
+    const uint32_t *keys, uint32_t first, uint32_t count, unsigned int level, uint32_t bounds[5])
 {
-    switch (quadtree->type)
+    bounds[0] = first;
+    bounds[4] = first + count;
+    if (level >= MORTON_LEVELS)
+    {
+        // Out of key bits, the bodies are too close to be separated: split the range evenly
+        for (unsigned int quadrant = 1; quadrant < 4; quadrant++)
+            bounds[quadrant] = first + (uint32_t)((uint64_t)count * quadrant / 4);
+        return;
+    }
+    // Keys in the range share the bits above `level` so their quadrant is sorted too
+    for (unsigned int quadrant = 1; quadrant < 4; quadrant++)
+    {
+        uint32_t low = bounds[quadrant - 1], high = first + count;
+        while (low < high)
+        {
+            uint32_t mid = low + (high - low) / 2;
+            if (morton_quadrant(keys[mid], level) < quadrant)
+                low = mid + 1;
+            else
+                high = mid;
+        }
+        bounds[quadrant] = low;
+    }
+}
+
+// Split a node for the Morton construction, past the last key level the children cover the
+// whole cell of their parent.
+static void
+quadtree_build_split(struct quadtree *quadtree,
+                     uint32_t         index,
+                     uint32_t         children,
+                     unsigned int     level)
+{
+    quadtree_split_at(quadtree, index, children);
+    if (level < MORTON_LEVELS)
+        return;
+    const struct quadtree_node *node = &quadtree->nodes[index];
+    for (uint32_t i = children; i < children + 4; i++)
+    {
+        quadtree->nodes[i].start_x = node->start_x;
+        quadtree->nodes[i].start_y = node->start_y;
+        quadtree->nodes[i].end_x = node->end_x;
+        quadtree->nodes[i].end_y = node->end_y;
+    }
+}
+
+// Number of nodes and buckets under a node built from a range of sorted bodies
+static void
+quadtree_build_count(const uint32_t *keys,
+                     uint32_t        first,
+                     uint32_t        count,
+                     unsigned int    level,
+                     uint32_t        leaf_capacity,
+                     uint32_t       *nodes_count,
+                     uint32_t       *buckets_count)
+{
+    if (count == 0)
+        return;
+    if (count <= leaf_capacity)
+    {
+        (*buckets_count)++;
+        return;
+    }
+    uint32_t bounds[5];
+    quadtree_build_bounds(keys, first, count, level, bounds);
+    *nodes_count += 4;
+    for (unsigned int quadrant = 0; quadrant < 4; quadrant++)
+        quadtree_build_count(keys,
+                             bounds[quadrant],
+                             bounds[quadrant + 1] - bounds[quadrant],
+                             level + 1,
+                             leaf_capacity,
+                             nodes_count,
+                             buckets_count);
+}
+
+// Build the subtree of `index` from bodies [first, first + count) sorted by Morton key,
+// every body of the range is inside the node's cell at `level`.
+// Nodes and buckets are taken from the ranges reserved for the subtree in `task`.
+static void
+quadtree_build_node(struct quadtree      *quadtree,
+                    struct quadtree_task *task,
+                    uint32_t              index,
+                    const struct bodies  *bodies,
+                    const uint32_t       *keys,
+                    uint32_t              first,
+                    uint32_t              count,
+                    unsigned int          level)
+{
+    struct quadtree_node *node = &quadtree->nodes[index];
+    if (count == 0)
+        return;
+    if (count <= quadtree->leaf_capacity)
+    {
+        uint32_t bucket = task->buckets++ * quadtree->bucket_lanes;
+        node->type = QUADTREE_EXTERNAL;
+        node->external.bucket = bucket;
+        node->external.bodies_count = count;
+        memcpy(&quadtree->bucket_x[bucket], &bodies->x[first], sizeof(float) * count);
+        memcpy(&quadtree->bucket_y[bucket], &bodies->y[first], sizeof(float) * count);
+        memcpy(&quadtree->bucket_mass[bucket], &bodies->mass[first], sizeof(float) * count);
+        for (uint32_t i = 0; i < count; i++)
+            quadtree->bucket_index[bucket + i] = first + i;
+        for (uint32_t i = bucket + count; i < bucket + quadtree->bucket_lanes; i++)
+        {
+            quadtree->bucket_x[i] = 0.0f;
+            quadtree->bucket_y[i] = 0.0f;
+            quadtree->bucket_mass[i] = 0.0f;
+        }
+        return;
+    }
+    uint32_t children = task->nodes;
+    uint32_t bounds[5];
+    task->nodes += 4;
+    quadtree_build_split(quadtree, index, children, level);
+    quadtree_build_bounds(keys, first, count, level, bounds);
+    for (unsigned int quadrant = 0; quadrant < 4; quadrant++)
+        quadtree_build_node(quadtree,
+                            task,
+                            children + quadrant,
+                            bodies,
+                            keys,
+                            bounds[quadrant],
+                            bounds[quadrant + 1] - bounds[quadrant],
+                            level + 1);
+}
+
+// Split the top of the tree on the calling thread until there are enough subtrees to keep the
+// workers busy, the subtrees are recorded as tasks.
+static void
+quadtree_build_top(struct quadtree *quadtree,
+                   const uint32_t  *keys,
+                   uint32_t         index,
+                   uint32_t         first,
+                   uint32_t         count,
+                   unsigned int     level,
+                   unsigned int     depth)
+{
+    if (count == 0)
+        return;
+    if (depth == 0 || count <= quadtree->leaf_capacity)
+    {
+        quadtree_task_push(quadtree,
+                           (struct quadtree_task){
+                               .index = index,
+                               .first = first,
+                               .count = count,
+                               .level = level,
+                           });
+        return;
+    }
+    uint32_t children = quadtree_node_alloc(quadtree, 4);
+    uint32_t bounds[5];
+    quadtree_build_split(quadtree, index, children, level);
+    quadtree_build_bounds(keys, first, count, level, bounds);
+    for (unsigned int quadrant = 0; quadrant < 4; quadrant++)
+        quadtree_build_top(quadtree,
+                           keys,
+                           children + quadrant,
+                           bounds[quadrant],
+                           bounds[quadrant + 1] - bounds[quadrant],
+                           level + 1,
+                           depth - 1);
+}
+
+struct quadtree_build_job
+{
+    struct quadtree     *quadtree;
+    const struct bodies *bodies;
+    const uint32_t      *keys;
+};
+
+static void
+quadtree_build_count_func(const struct quadtree_build_job *job,
+                          size_t                           start,
+                          size_t                           stop,
+                          size_t                           worker)
+{
+    (void)worker;
+    for (size_t i = start; i < stop; i++)
+    {
+        struct quadtree_task *task = &job->quadtree->tasks[i];
+        task->nodes = 0;
+        task->buckets = 0;
+        quadtree_build_count(
+            job->keys,
+            task->first,
+            task->count,
+            task->level,
+            job->quadtree->leaf_capacity,
+            &task->nodes,
+            &task->buckets);
+    }
+}
+
+static void
+quadtree_build_func(const struct quadtree_build_job *job,
+                    size_t                           start,
+                    size_t                           stop,
+                    size_t                           worker)
+{
+    (void)worker;
+    for (size_t i = start; i < stop; i++)
+    {
+        struct quadtree_task *task = &job->quadtree->tasks[i];
+        struct quadtree_task  cursor = *task;
+        quadtree_build_node(job->quadtree,
+                            &cursor,
+                            task->index,
+                            job->bodies,
+                            job->keys,
+                            task->first,
+                            task->count,
+                            task->level);
+    }
+}
+
+// Build the tree from bodies sorted by the Morton keys of the root cell set by `quadtree_reset`.
+// Sorted bodies of a cell are contiguous so each node is a range split by binary searches,
+// no body is inserted one by one.
+// The top levels are split serially, then each worker counts the nodes of the subtrees it
+// takes so they can be given disjoint ranges of the arena and built in parallel.
+void
+quadtree_build(struct quadtree     *quadtree,
+               const struct bodies *bodies,
+               const uint32_t      *keys,
+               struct pool         *pool)
+{
+    unsigned int depth = 1;
+    for (size_t subtrees = 4; subtrees < 8 * pool_workers_count(pool); subtrees *= 4)
+        depth++;
+    quadtree_build_top(quadtree, keys, QUADTREE_ROOT, 0, bodies->count, 0, depth);
+    quadtree->top_nodes_count = quadtree->nodes_count;
+
+    struct quadtree_build_job job = {.quadtree = quadtree, .bodies = bodies, .keys = keys};
+    pool_run(pool, (pool_func)quadtree_build_count_func, &job, quadtree->tasks_count, 1);
+    uint32_t nodes_count = 0, buckets_count = 0;
+    for (size_t i = 0; i < quadtree->tasks_count; i++)
+    {
+        struct quadtree_task *task = &quadtree->tasks[i];
+        uint32_t              task_nodes_count = task->nodes;
+        uint32_t              task_buckets_count = task->buckets;
+        task->nodes = quadtree->nodes_count + nodes_count;
+        task->buckets = quadtree->buckets_count + buckets_count;
+        nodes_count += task_nodes_count;
+        buckets_count += task_buckets_count;
+    }
+    quadtree_nodes_reserve(quadtree, nodes_count);
+    quadtree_buckets_reserve(quadtree, buckets_count);
+    quadtree->nodes_count += nodes_count;
+    quadtree->buckets_count += buckets_count;
+    pool_run(pool, (pool_func)quadtree_build_func, &job, quadtree->tasks_count, 1);
+}
+
+struct quadtree_refit_job
+{
+    struct quadtree     *quadtree;
+    const struct bodies *bodies;
+};
+
+// Copy the new positions in the buckets and take out the bodies that left the cell of their
+// leaf, a leaf left without bodies becomes empty. Its bucket isn't recycled until the next build.
+static void
+quadtree_refit_func(const struct quadtree_refit_job *job,
+                    size_t                           start,
+                    size_t                           stop,
+                    size_t                           worker)
+{
+    (void)worker;
+    struct quadtree     *quadtree = job->quadtree;
+    const struct bodies *bodies = job->bodies;
+    for (size_t i = start; i < stop; i++)
+    {
+        struct quadtree_node *node = &quadtree->nodes[i];
+        if (node->type != QUADTREE_EXTERNAL)
+            continue;
+        uint32_t bucket = node->external.bucket;
+        uint32_t kept = 0;
+        for (uint32_t lane = bucket; lane < bucket + node->external.bodies_count; lane++)
+        {
+            uint32_t j = quadtree->bucket_index[lane];
+            if (!in_boundary(node, bodies->x[j], bodies->y[j]))
+            {
+                quadtree->moved[j] = 1;
+                continue;
+            }
+            quadtree->bucket_x[bucket + kept] = bodies->x[j];
+            quadtree->bucket_y[bucket + kept] = bodies->y[j];
+            quadtree->bucket_mass[bucket + kept] = bodies->mass[j];
+            quadtree->bucket_index[bucket + kept] = j;
+            kept++;
+        }
+        for (uint32_t lane = bucket + kept; lane < bucket + node->external.bodies_count; lane++)
+        {
+            quadtree->bucket_x[lane] = 0.0f;
+            quadtree->bucket_y[lane] = 0.0f;
+            quadtree->bucket_mass[lane] = 0.0f;
+        }
+        node->external.bodies_count = kept;
+        if (kept == 0)
+            quadtree_node_clear(node);
+    }
+}
+
+// Update the tree built on the previous step to the new positions of the same bodies instead
+// of building it again. Bodies still in the cell of their leaf are updated in place by the
+// workers, the ones that left it are inserted again from the root.
+// Returns false when the tree needs to be built again: a body left the root cell, too many
+// bodies changed leaf for the insertions to be cheaper than a build, or the tree was reset.
+// The masses need to be updated after a refit.
+bool
+quadtree_refit(struct quadtree *quadtree, const struct bodies *bodies, struct pool *pool)
+{
+    if (quadtree->nodes_count == 0)
+        return false;
+    if (quadtree->moved_capacity < bodies->count)
+    {
+        free(quadtree->moved);
+        quadtree->moved = xmalloc(bodies->count);
+        quadtree->moved_capacity = bodies->count;
+    }
+    memset(quadtree->moved, 0, bodies->count);
+    struct quadtree_refit_job job = {.quadtree = quadtree, .bodies = bodies};
+    pool_run(pool, (pool_func)quadtree_refit_func, &job, quadtree->nodes_count, 256);
+
+    const struct quadtree_node *root = &quadtree->nodes[QUADTREE_ROOT];
+    size_t                      moved_count = 0;
+    for (size_t i = 0; i < bodies->count; i++)
+    {
+        if (!quadtree->moved[i])
+            continue;
+        if (!in_boundary(root, bodies->x[i], bodies->y[i]) || ++moved_count > bodies->count / 8)
+            return false;
+        quadtree_insert(quadtree, bodies, i);
+        root = &quadtree->nodes[QUADTREE_ROOT];
+    }
+    return true;
+}
+
+// Set the mass of an internal node from the mass of its children
+static void
+quadtree_update_mass_internal(struct quadtree *quadtree, uint32_t index)
+{
+    struct quadtree_node       *node = &quadtree->nodes[index];
+    const struct quadtree_node *nw = &quadtree->nodes[node->internal.nw];
+    const struct quadtree_node *ne = &quadtree->nodes[node->internal.ne];
+    const struct quadtree_node *sw = &quadtree->nodes[node->internal.sw];
+    const struct quadtree_node *se = &quadtree->nodes[node->internal.se];
+    node->total_mass = nw->total_mass + ne->total_mass + sw->total_mass + se->total_mass;
+    // x center of mass
+    node->center_of_mass_x =
+        nw->center_of_mass_x * nw->total_mass + ne->center_of_mass_x * ne->total_mass +
+        sw->center_of_mass_x * sw->total_mass + se->center_of_mass_x * se->total_mass;
+    node->center_of_mass_x /= node->total_mass;
+    // y center of mass
+    node->center_of_mass_y =
+        nw->center_of_mass_y * nw->total_mass + ne->center_of_mass_y * ne->total_mass +
+        sw->center_of_mass_y * sw->total_mass + se->center_of_mass_y * se->total_mass;
+    node->center_of_mass_y /= node->total_mass;
+    // quadrupole, moved from the center of mass of each child with the parallel axis theorem
+    node->quadrupole_xx = 0.0f;
+    node->quadrupole_xy = 0.0f;
+    node->quadrupole_yy = 0.0f;
+    const struct quadtree_node *children[4] = {nw, ne, sw, se};
+    for (unsigned int i = 0; i < 4; i++)
+    {
+        float dx = children[i]->center_of_mass_x - node->center_of_mass_x;
+        float dy = children[i]->center_of_mass_y - node->center_of_mass_y;
+        node->quadrupole_xx += children[i]->quadrupole_xx + children[i]->total_mass * dx * dx;
+        node->quadrupole_xy += children[i]->quadrupole_xy + children[i]->total_mass * dx * dy;
+        node->quadrupole_yy += children[i]->quadrupole_yy + children[i]->total_mass * dy * dy;
+    }
+}
+
+static void
+quadtree_update_mass_node(struct quadtree *quadtree, uint32_t index);
+
+// Turn an internal node back into a leaf when bodies left it during a refit and its children
+// are leaves holding few enough bodies, they are moved to the bucket of the first child.
+// The other buckets aren't recycled until the next build.
+static bool
+quadtree_merge(struct quadtree *quadtree, uint32_t index)
+{
+    struct quadtree_node *node = &quadtree->nodes[index];
+    uint32_t              children[4] = {
+        node->internal.nw, node->internal.ne, node->internal.sw, node->internal.se};
+    uint32_t count = 0;
+    for (unsigned int i = 0; i < 4; i++)
+    {
+        const struct quadtree_node *child = &quadtree->nodes[children[i]];
+        if (child->type == QUADTREE_INTERNAL)
+            return false;
+        if (child->type == QUADTREE_EXTERNAL)
+            count += child->external.bodies_count;
+    }
+    if (count > quadtree->leaf_capacity)
+        return false;
+    uint32_t bucket = 0;
+    count = 0;
+    for (unsigned int i = 0; i < 4; i++)
+    {
+        struct quadtree_node *child = &quadtree->nodes[children[i]];
+        if (child->type != QUADTREE_EXTERNAL)
+            continue;
+        uint32_t from = child->external.bucket;
+        if (count == 0)
+            bucket = from;
+        else
+            for (uint32_t lane = 0; lane < child->external.bodies_count; lane++)
+            {
+                quadtree->bucket_x[bucket + count + lane] = quadtree->bucket_x[from + lane];
+                quadtree->bucket_y[bucket + count + lane] = quadtree->bucket_y[from + lane];
+                quadtree->bucket_mass[bucket + count + lane] = quadtree->bucket_mass[from + lane];
+                quadtree->bucket_index[bucket + count + lane] = quadtree->bucket_index[from + lane];
+            }
+        count += child->external.bodies_count;
+        quadtree_node_clear(child);
+    }
+    quadtree_node_clear(node);
+    if (count == 0)
+        return true;
+    node->type = QUADTREE_EXTERNAL;
+    node->external.bucket = bucket;
+    node->external.bodies_count = count;
+    quadtree_update_mass_node(quadtree, index);
+    return true;
+}
+
+static void
+quadtree_update_mass_node(struct quadtree *quadtree, uint32_t index)
+{
+    struct quadtree_node *node = &quadtree->nodes[index];
+    switch (node->type)
     {
     case QUADTREE_EMPTY: break;
     case QUADTREE_EXTERNAL:
-        quadtree->total_mass = 0.0;
-        quadtree->center_of_mass_x = 0.0;
-        quadtree->center_of_mass_y = 0.0;
-        for (size_t i = 0; i < quadtree->external.bodies_count; i++)
+        node->total_mass = 0.0;
+        node->center_of_mass_x = 0.0;
+        node->center_of_mass_y = 0.0;
+        for (uint32_t i = node->external.bucket;
+             i < node->external.bucket + node->external.bodies_count;
+             i++)
+        {
+            node->total_mass += quadtree->bucket_mass[i];
+            node->center_of_mass_x += quadtree->bucket_x[i] * quadtree->bucket_mass[i];
+            node->center_of_mass_y += quadtree->bucket_y[i] * quadtree->bucket_mass[i];
+        }
+        node->center_of_mass_x /= node->total_mass;
+        node->center_of_mass_y /= node->total_mass;
+        node->quadrupole_xx = 0.0f;
+        node->quadrupole_xy = 0.0f;
+        node->quadrupole_yy = 0.0f;
+        for (uint32_t i = node->external.bucket;
+             i < node->external.bucket + node->external.bodies_count;
+             i++)
         {
-            quadtree->total_mass += quadtree->external.bodies[i].mass;
-            quadtree->center_of_mass_x +=
-                quadtree->external.bodies[i].x * quadtree->external.bodies[i].mass;
-            quadtree->center_of_mass_y +=
-                quadtree->external.bodies[i].y * quadtree->external.bodies[i].mass;
+            float dx = quadtree->bucket_x[i] - node->center_of_mass_x;
+            float dy = quadtree->bucket_y[i] - node->center_of_mass_y;
+            node->quadrupole_xx += quadtree->bucket_mass[i] * dx * dx;
+            node->quadrupole_xy += quadtree->bucket_mass[i] * dx * dy;
+            node->quadrupole_yy += quadtree->bucket_mass[i] * dy * dy;
         }
-        quadtree->center_of_mass_x /= quadtree->total_mass;
-        quadtree->center_of_mass_y /= quadtree->total_mass;
         break;
     case QUADTREE_INTERNAL:
-        quadtree_update_mass(quadtree->internal.nw);
-        quadtree_update_mass(quadtree->internal.ne);
-        quadtree_update_mass(quadtree->internal.sw);
-        quadtree_update_mass(quadtree->internal.se);
-        quadtree->total_mass =
-            quadtree->internal.nw->total_mass + quadtree->internal.ne->total_mass +
-            quadtree->internal.sw->total_mass + quadtree->internal.se->total_mass;
-        // x center of mass
-        quadtree->center_of_mass_x =
-            quadtree->internal.nw->center_of_mass_x * quadtree->internal.nw->total_mass +
-            quadtree->internal.ne->center_of_mass_x * quadtree->internal.ne->total_mass +
-            quadtree->internal.sw->center_of_mass_x * quadtree->internal.sw->total_mass +
-            quadtree->internal.se->center_of_mass_x * quadtree->internal.se->total_mass;
-        quadtree->center_of_mass_x /= quadtree->total_mass;
-        // y center of mass
-        quadtree->center_of_mass_y =
-            quadtree->internal.nw->center_of_mass_y * quadtree->internal.nw->total_mass +
-            quadtree->internal.ne->center_of_mass_y * quadtree->internal.ne->total_mass +
-            quadtree->internal.sw->center_of_mass_y * quadtree->internal.sw->total_mass +
-            quadtree->internal.se->center_of_mass_y * quadtree->internal.se->total_mass;
-        quadtree->center_of_mass_y /= quadtree->total_mass;
+        quadtree_update_mass_node(quadtree, node->internal.nw);
+        quadtree_update_mass_node(quadtree, node->internal.ne);
+        quadtree_update_mass_node(quadtree, node->internal.sw);
+        quadtree_update_mass_node(quadtree, node->internal.se);
+        if (!quadtree_merge(quadtree, index))
+            quadtree_update_mass_internal(quadtree, index);
         break;
     }
 }
 
-static const float approximate_distance_threshold = 0.5;
+static void
+quadtree_update_mass_func(struct quadtree *quadtree, size_t start, size_t stop, size_t worker)
+{
+    (void)worker;
+    for (size_t i = start; i < stop; i++)
+        quadtree_update_mass_node(quadtree, quadtree->tasks[i].index);
+}
 
+// Compute the total mass, center of mass and quadrupole of every node, and merge the leaves
+// a refit left with few bodies.
+// Subtrees of a parallel build are done by the workers, then the top nodes are done from the
+// last allocated to the first so children are always done before their parent.
+void
+quadtree_update_mass(struct quadtree *quadtree, struct pool *pool)
+{
+    if (quadtree->tasks_count == 0)
+    {
+        quadtree_update_mass_node(quadtree, QUADTREE_ROOT);
+        return;
+    }
+    pool_run(pool, (pool_func)quadtree_update_mass_func, quadtree, quadtree->tasks_count, 1);
+    for (uint32_t i = quadtree->top_nodes_count; i-- > 0;)
+    {
+        const struct quadtree_node *node = &quadtree->nodes[i];
+        if (node->type != QUADTREE_INTERNAL || node->internal.nw >= quadtree->top_nodes_count)
+            continue;
+        // A merged top node is a leaf no task covers, later refits move its bodies or split it
+        // and need one to update its mass. Tasks are only pushed here, not by the workers.
+        if (quadtree_merge(quadtree, i))
+            quadtree_task_push_once(quadtree, i);
+        else
+            quadtree_update_mass_internal(quadtree, i);
+    }
+}
+
+static void
+quadtree_flatten_node(struct quadtree *quadtree, uint32_t index)
+{
+    const struct quadtree_node *node = &quadtree->nodes[index];
+    if (node->type == QUADTREE_EMPTY)
+        return;
+    uint32_t                   flat_index = quadtree->flat_count++;
+    struct quadtree_flat_node *flat = &quadtree->flat[flat_index];
+    float                      area_width = node->end_x - node->start_x;
+    flat->center_of_mass_x = node->center_of_mass_x;
+    flat->center_of_mass_y = node->center_of_mass_y;
+    flat->total_mass = node->total_mass;
+    flat->quadrupole_xx = node->quadrupole_xx;
+    flat->quadrupole_xy = node->quadrupole_xy;
+    flat->quadrupole_yy = node->quadrupole_yy;
+    flat->open_square = area_width * area_width / (quadtree->theta * quadtree->theta);
+    flat->node = index;
+    if (node->type == QUADTREE_EXTERNAL)
+    {
+        flat->bucket = node->external.bucket;
+        flat->bodies_count = node->external.bodies_count;
+    }
+    else
+    {
+        flat->bucket = 0;
+        flat->bodies_count = 0;
+        quadtree_flatten_node(quadtree, node->internal.nw);
+        quadtree_flatten_node(quadtree, node->internal.ne);
+        quadtree_flatten_node(quadtree, node->internal.sw);
+        quadtree_flatten_node(quadtree, node->internal.se);
+    }
+    quadtree->flat[flat_index].skip = quadtree->flat_count;
+}
+
+// Copy the tree in pre-order with skip links for the stackless walks,
+// needs to be called again after the masses are updated.
+void
+quadtree_flatten(struct quadtree *quadtree)
+{
+    if (quadtree->flat_capacity < quadtree->nodes_count)
+    {
+        free(quadtree->flat);
+        quadtree->flat = xmalloc(sizeof(struct quadtree_flat_node) * quadtree->nodes_count);
+        quadtree->flat_capacity = quadtree->nodes_count;
+    }
+    quadtree->flat_count = 0;
+    quadtree_flatten_node(quadtree, QUADTREE_ROOT);
+}
+
+// Walk the flattened tree: leaves go through the force kernel, internal nodes far enough
+// are approximated by their moments and the others are descended into.
 void
 quadtree_force(const struct quadtree *quadtree,
                const struct body     *body,
@@ -180,64 +943,285 @@ quadtree_force(const struct quadtree *quadtree,
                float                 *force_x,
                float                 *force_y)
 {
-    if (quadtree->type == QUADTREE_EMPTY)
-        return;
-    if (quadtree->type == QUADTREE_EXTERNAL)  // quadtree is a group bodies
-    {
-#if QUADTREE_MAX_BODIES_COUNT == 8
-        body_gravitational_force_avx2(body, quadtree->external.bodies, gravity, force_x, force_y);
-#elif QUADTREE_MAX_BODIES_COUNT == 16
-        body_gravitational_force_avx2(body, quadtree->external.bodies, gravity, force_x, force_y);
-        body_gravitational_force_avx2(body, quadtree->external.bodies + 8, gravity, force_x, force_y);
-#elif QUADTREE_MAX_BODIES_COUNT == 32
-        body_gravitational_force_avx2(body, quadtree->external.bodies, gravity, force_x, force_y);
-        body_gravitational_force_avx2(body, quadtree->external.bodies + 8, gravity, force_x, force_y);
-        body_gravitational_force_avx2(body, quadtree->external.bodies + 16, gravity, force_x, force_y);
-#endif
-        return;
+    const struct quadtree_flat_node *flat = quadtree->flat;
+    uint32_t                         i = 0;
+    *force_x = 0.0f;
+    *force_y = 0.0f;
+    while (i < quadtree->flat_count)
+    {
+        const struct quadtree_flat_node *node = &flat[i];
+        if (node->bodies_count != 0)
+        {
+            // Unused lanes of the bucket have no mass, round up to whole vectors
+            body_kernel->force(body,
+                               &quadtree->bucket_x[node->bucket],
+                               &quadtree->bucket_y[node->bucket],
+                               &quadtree->bucket_mass[node->bucket],
+                               (node->bodies_count + 7) / 8 * 8,
+                               gravity,
+                               force_x,
+                               force_y);
+            i = node->skip;
+            continue;
+        }
+        float distance_x = body->x - node->center_of_mass_x;
+        float distance_y = body->y - node->center_of_mass_y;
+        float distance_square = distance_x * distance_x + distance_y * distance_y;
+        if (distance_square <= node->open_square)
+        {
+            i++;
+            continue;
+        }
+        const struct body_moments moments = {
+            .x = &node->center_of_mass_x,
+            .y = &node->center_of_mass_y,
+            .mass = &node->total_mass,
+            .xx = &node->quadrupole_xx,
+            .xy = &node->quadrupole_xy,
+            .yy = &node->quadrupole_yy,
+        };
+        body_gravitational_moments_scalar(body, &moments, 1, gravity, force_x, force_y);
+        i = node->skip;
     }
-    // Check if we can approximate internal node
-    float area_width = fabsf(quadtree->end_x - quadtree->start_x);
-    float distance_x = quadtree->center_of_mass_x - body->x;
-    float distance_y = quadtree->center_of_mass_y - body->y;
-    float inverse_distance = rsqrt(distance_x * distance_x + distance_y * distance_y);
-    float ratio = area_width * inverse_distance;
-    if (ratio < approximate_distance_threshold)
-    {
-        body_gravitational_force(body,
-                                 &(struct body){.x = quadtree->center_of_mass_x,
-                                                .y = quadtree->center_of_mass_y,
-                                                .mass = quadtree->total_mass},
-                                 gravity,
-                                 force_x,
-                                 force_y);
+}
+
+// Potential energy of `body` with every other body, -G m1 m2 / r for each pair, with the same
+// walk and cutoff as `quadtree_force`. Accepted nodes add the quadrupole term of the expansion
+// around their center of mass, (3 r.Q.r - tr(Q) r^2) / (2 r^5).
+double
+quadtree_potential(const struct quadtree *quadtree, const struct body *body, const float gravity)
+{
+    const struct quadtree_flat_node *flat = quadtree->flat;
+    uint32_t                         i = 0;
+    double                           potential = 0.0;
+    double                           softening_square = (double)body_softening * body_softening;
+    while (i < quadtree->flat_count)
+    {
+        const struct quadtree_flat_node *node = &flat[i];
+        if (node->bodies_count != 0)
+        {
+            for (uint32_t lane = node->bucket; lane < node->bucket + node->bodies_count; lane++)
+            {
+                double dx = (double)body->x - quadtree->bucket_x[lane];
+                double dy = (double)body->y - quadtree->bucket_y[lane];
+                if (fabs(dx) <= body_too_close_threshold || fabs(dy) <= body_too_close_threshold)
+                    continue;
+                potential -=
+                    quadtree->bucket_mass[lane] / sqrt(dx * dx + dy * dy + softening_square);
+            }
+            i = node->skip;
+            continue;
+        }
+        double dx = (double)body->x - node->center_of_mass_x;
+        double dy = (double)body->y - node->center_of_mass_y;
+        double distance_square = dx * dx + dy * dy;
+        if (distance_square <= node->open_square)
+        {
+            i++;
+            continue;
+        }
+        if (fabs(dx) > body_too_close_threshold && fabs(dy) > body_too_close_threshold)
+        {
+            distance_square += softening_square;
+            double distance = sqrt(distance_square);
+            double quadrupole = dx * dx * node->quadrupole_xx +
+                                2.0 * dx * dy * node->quadrupole_xy +
+                                dy * dy * node->quadrupole_yy;
+            double trace = (double)node->quadrupole_xx + node->quadrupole_yy;
+            potential -= node->total_mass / distance +
+                         (3.0 * quadrupole - trace * distance_square) /
+                             (2.0 * distance_square * distance_square * distance);
+        }
+        i = node->skip;
+    }
+    return potential * gravity * body->mass;
+}
+
+void
+quadtree_list_init(struct quadtree_list *list)
+{
+    memset(list, 0, sizeof *list);
+}
+
+void
+quadtree_list_destroy(struct quadtree_list *list)
+{
+    free(list->x);
+    free(list->y);
+    free(list->mass);
+    free(list->cell_x);
+    free(list->cell_y);
+    free(list->cell_mass);
+    free(list->cell_xx);
+    free(list->cell_xy);
+    free(list->cell_yy);
+    memset(list, 0, sizeof *list);
+}
+
+static void
+quadtree_list_reserve(struct quadtree_list *list, size_t count)
+{
+    if (list->count + count <= list->capacity)
         return;
+    size_t capacity = list->capacity == 0 ? 1024 : list->capacity * 2;
+    while (capacity < list->count + count)
+        capacity *= 2;
+    size_t old_size = sizeof(float) * list->capacity;
+    size_t size = sizeof(float) * capacity;
+    list->x = xaligned_realloc(list->x, 32, old_size, size);
+    list->y = xaligned_realloc(list->y, 32, old_size, size);
+    list->mass = xaligned_realloc(list->mass, 32, old_size, size);
+    list->capacity = capacity;
+}
+
+static void
+quadtree_list_push_cell(struct quadtree_list *list, const struct quadtree_flat_node *cell)
+{
+    if (list->cells_count == list->cells_capacity)
+    {
+        size_t capacity = list->cells_capacity == 0 ? 256 : list->cells_capacity * 2;
+        size_t old_size = sizeof(float) * list->cells_capacity;
+        size_t size = sizeof(float) * capacity;
+        list->cell_x = xaligned_realloc(list->cell_x, 32, old_size, size);
+        list->cell_y = xaligned_realloc(list->cell_y, 32, old_size, size);
+        list->cell_mass = xaligned_realloc(list->cell_mass, 32, old_size, size);
+        list->cell_xx = xaligned_realloc(list->cell_xx, 32, old_size, size);
+        list->cell_xy = xaligned_realloc(list->cell_xy, 32, old_size, size);
+        list->cell_yy = xaligned_realloc(list->cell_yy, 32, old_size, size);
+        list->cells_capacity = capacity;
     }
-    // Compute force for all region
-    float nw_force_x = 0.0, nw_force_y = 0.0, ne_force_x = 0.0, ne_force_y = 0.0, sw_force_x = 0.0,
-          sw_force_y = 0.0, se_force_x = 0.0, se_force_y = 0.0;
-    quadtree_force(quadtree->internal.nw, body, gravity, &nw_force_x, &nw_force_y);
-    quadtree_force(quadtree->internal.ne, body, gravity, &ne_force_x, &ne_force_y);
-    quadtree_force(quadtree->internal.sw, body, gravity, &sw_force_x, &sw_force_y);
-    quadtree_force(quadtree->internal.se, body, gravity, &se_force_x, &se_force_y);
-    *force_x = nw_force_x + ne_force_x + sw_force_x + se_force_x;
-    *force_y = nw_force_y + ne_force_y + sw_force_y + se_force_y;
+    list->cell_x[list->cells_count] = cell->center_of_mass_x;
+    list->cell_y[list->cells_count] = cell->center_of_mass_y;
+    list->cell_mass[list->cells_count] = cell->total_mass;
+    list->cell_xx[list->cells_count] = cell->quadrupole_xx;
+    list->cell_xy[list->cells_count] = cell->quadrupole_xy;
+    list->cell_yy[list->cells_count] = cell->quadrupole_yy;
+    list->cells_count++;
+}
+
+// Distance between a point and the closest point of a box, 0 inside the box
+static float
+box_distance(const struct quadtree_node *box, float x, float y)
+{
+    float distance_x = fmaxf(fmaxf(box->start_x - x, x - box->end_x), 0.0f);
+    float distance_y = fmaxf(fmaxf(box->start_y - y, y - box->end_y), 0.0f);
+    return sqrtf(distance_x * distance_x + distance_y * distance_y);
 }
 
+// Collect everything the bodies of the external node `leaf` interact with: bodies of the
+// external nodes that are too close and the moments of the nodes far enough.
+// The list includes the leaf's own bodies, the kernel ignores a body acting on itself.
 void
-quadtree_stats(const struct quadtree *quadtree, struct quadtree_stats *stats)
+quadtree_list_build(const struct quadtree *quadtree, uint32_t leaf, struct quadtree_list *list)
 {
+    const struct quadtree_node *node = &quadtree->nodes[leaf];
+    struct quadtree_node        group = {
+        .start_x = INFINITY,
+        .start_y = INFINITY,
+        .end_x = -INFINITY,
+        .end_y = -INFINITY,
+    };
+    for (uint32_t i = node->external.bucket;
+         i < node->external.bucket + node->external.bodies_count;
+         i++)
+    {
+        group.start_x = fminf(group.start_x, quadtree->bucket_x[i]);
+        group.start_y = fminf(group.start_y, quadtree->bucket_y[i]);
+        group.end_x = fmaxf(group.end_x, quadtree->bucket_x[i]);
+        group.end_y = fmaxf(group.end_y, quadtree->bucket_y[i]);
+    }
+    // A node is approximated if it would be for every body of the group: the opening test is
+    // done with the distance to the closest point of the group's box.
+    list->count = 0;
+    list->cells_count = 0;
+    for (uint32_t i = 0; i < quadtree->flat_count;)
+    {
+        const struct quadtree_flat_node *flat = &quadtree->flat[i];
+        if (flat->bodies_count != 0)
+        {
+            quadtree_list_reserve(list, flat->bodies_count);
+            memcpy(&list->x[list->count],
+                   &quadtree->bucket_x[flat->bucket],
+                   sizeof(float) * flat->bodies_count);
+            memcpy(&list->y[list->count],
+                   &quadtree->bucket_y[flat->bucket],
+                   sizeof(float) * flat->bodies_count);
+            memcpy(&list->mass[list->count],
+                   &quadtree->bucket_mass[flat->bucket],
+                   sizeof(float) * flat->bodies_count);
+            list->count += flat->bodies_count;
+            i = flat->skip;
+            continue;
+        }
+        float distance = box_distance(&group, flat->center_of_mass_x, flat->center_of_mass_y);
+        if (distance * distance <= flat->open_square)
+        {
+            i++;
+            continue;
+        }
+        quadtree_list_push_cell(list, flat);
+        i = flat->skip;
+    }
+    // Pad to a multiple of 8 lanes without mass
+    quadtree_list_reserve(list, 8);
+    while (list->count % 8 != 0)
+    {
+        list->x[list->count] = 0.0f;
+        list->y[list->count] = 0.0f;
+        list->mass[list->count] = 0.0f;
+        list->count++;
+    }
+    while (list->cells_count % 8 != 0)
+        quadtree_list_push_cell(list, &(struct quadtree_flat_node){0});
+}
+
+void
+quadtree_list_force(const struct quadtree_list *list,
+                    const struct body          *body,
+                    const float                 gravity,
+                    float                      *force_x,
+                    float                      *force_y)
+{
+    const struct body_moments moments = {
+        .x = list->cell_x,
+        .y = list->cell_y,
+        .mass = list->cell_mass,
+        .xx = list->cell_xx,
+        .xy = list->cell_xy,
+        .yy = list->cell_yy,
+    };
+    *force_x = 0.0f;
+    *force_y = 0.0f;
+    body_kernel->moments(body, &moments, list->cells_count, gravity, force_x, force_y);
+    body_kernel->force(body, list->x, list->y, list->mass, list->count, gravity, force_x, force_y);
+}
+
+static void
+quadtree_stats_node(const struct quadtree *quadtree,
+                    uint32_t               index,
+                    size_t                 depth,
+                    struct quadtree_stats *stats)
+{
+    const struct quadtree_node *node = &quadtree->nodes[index];
     stats->node_count++;
-    switch (quadtree->type)
+    if (depth > stats->max_depth)
+        stats->max_depth = depth;
+    switch (node->type)
     {
     case QUADTREE_EMPTY: stats->empty_count++; break;
     case QUADTREE_EXTERNAL: stats->external_count++; break;
     case QUADTREE_INTERNAL:
         stats->internal_count++;
-        quadtree_stats(quadtree->internal.nw, stats);
-        quadtree_stats(quadtree->internal.ne, stats);
-        quadtree_stats(quadtree->internal.sw, stats);
-        quadtree_stats(quadtree->internal.se, stats);
+        quadtree_stats_node(quadtree, node->internal.nw, depth + 1, stats);
+        quadtree_stats_node(quadtree, node->internal.ne, depth + 1, stats);
+        quadtree_stats_node(quadtree, node->internal.sw, depth + 1, stats);
+        quadtree_stats_node(quadtree, node->internal.se, depth + 1, stats);
         break;
     }
 }
+
+void
+quadtree_stats(const struct quadtree *quadtree, struct quadtree_stats *stats)
+{
+    quadtree_stats_node(quadtree, QUADTREE_ROOT, 0, stats);
+}
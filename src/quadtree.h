@@ -2,8 +2,10 @@
 #define QUADTREE_H
 
 #include "body.h"
+#include "pool.h"
 #include <assert.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -14,19 +16,27 @@ enum quadtree_type
     QUADTREE_INTERNAL = 2,
 };
 
+// Upper bound of the leaf capacity chosen at runtime with `quadtree_set_leaf_capacity`
 #ifndef QUADTREE_MAX_BODIES_COUNT
-# define QUADTREE_MAX_BODIES_COUNT 8
+# define QUADTREE_MAX_BODIES_COUNT 32
 #endif
 #if QUADTREE_MAX_BODIES_COUNT % 8 != 0 || QUADTREE_MAX_BODIES_COUNT > 32
 # error "Bodies count in quadtree leafs need to be a multiple of 8 and lower than 32 for SIMD"
 #endif
+#define QUADTREE_DEFAULT_LEAF_CAPACITY 8
 
-struct quadtree
+// Nodes live in one array owned by `struct quadtree` and refer to each other by index.
+// The array is reset, not freed, between frames so rebuilding the tree doesn't allocate.
+struct quadtree_node
 {
     enum quadtree_type type;
     float              total_mass;
     float              center_of_mass_x;
     float              center_of_mass_y;
+    // Second moments of the masses around the center of mass
+    float              quadrupole_xx;
+    float              quadrupole_xy;
+    float              quadrupole_yy;
     float              start_x;
     float              start_y;
     float              end_x;
@@ -35,41 +45,171 @@ struct quadtree
     {
         struct
         {
-            struct body bodies[QUADTREE_MAX_BODIES_COUNT];
-            size_t      bodies_count;
+            uint32_t bucket;  // index of the first lane of the node in the bucket arrays
+            uint32_t bodies_count;
         } external;
         struct
         {
-            struct quadtree *nw;
-            struct quadtree *ne;
-            struct quadtree *sw;
-            struct quadtree *se;
+            uint32_t nw;
+            uint32_t ne;
+            uint32_t sw;
+            uint32_t se;
         } internal;
     };
 };
 
+#define QUADTREE_ROOT 0
+
+// A node is approximated by its moments when its width is less than theta times its distance
+#define QUADTREE_DEFAULT_THETA 0.5f
+
+// Subtree built by a single worker in a parallel build.
+// `nodes` and `buckets` are the first node and bucket reserved for it.
+struct quadtree_task
+{
+    uint32_t index;
+    uint32_t first;
+    uint32_t count;
+    uint32_t level;
+    uint32_t nodes;
+    uint32_t buckets;
+};
+
+// Node of the tree flattened in pre-order without the empty nodes. The first child of an
+// internal node is the next node and `skip` is the node after its subtree, so a walk is a loop
+// that either goes to the next node to descend or jumps to `skip` to leave the subtree.
+struct quadtree_flat_node
+{
+    float    center_of_mass_x;
+    float    center_of_mass_y;
+    float    total_mass;
+    float    quadrupole_xx;
+    float    quadrupole_xy;
+    float    quadrupole_yy;
+    float    open_square;  // approximate the node if its squared distance is greater
+    uint32_t skip;
+    uint32_t bucket;
+    uint32_t bodies_count;  // 0 for internal nodes
+    uint32_t node;          // index in `struct quadtree.nodes`
+};
+
+// Bounding box of the bodies seen by a worker, on its own cache line
+struct quadtree_bounds
+{
+    _Alignas(64) float start_x;
+    float start_y;
+    float end_x;
+    float end_y;
+};
+
+// Bodies of external nodes are copied in buckets of `bucket_lanes` lanes, the leaf capacity
+// rounded up to a multiple of 8, stored as 32 bytes aligned structure of arrays.
+// Unused lanes have a mass of 0.
+struct quadtree
+{
+    struct quadtree_node *nodes;
+    uint32_t              nodes_count;
+    uint32_t              nodes_capacity;
+    float                *bucket_x;
+    float                *bucket_y;
+    float                *bucket_mass;
+    uint32_t             *bucket_index;  // index of the body in `struct bodies`
+    uint32_t              buckets_count;
+    uint32_t              buckets_capacity;
+    uint32_t             *free_buckets;
+    uint32_t              free_buckets_count;
+    uint32_t              leaf_capacity;
+    uint32_t              bucket_lanes;
+    // Parallel construction, nodes before `top_nodes_count` are split by the calling thread
+    struct quadtree_task   *tasks;
+    size_t                  tasks_count;
+    size_t                  tasks_capacity;
+    uint32_t                top_nodes_count;
+    struct quadtree_bounds *worker_bounds;
+    size_t                  worker_bounds_count;
+    // Opening angle of the walks, QUADTREE_DEFAULT_THETA unless changed after `quadtree_init`
+    float theta;
+    // Fraction of the extent of the bodies added around the root cell by `quadtree_reset`,
+    // leaves room for the bodies to move when the tree is refitted
+    float root_margin;
+    // Bodies that left their leaf during `quadtree_refit`, indexed like `struct bodies`
+    uint8_t *moved;
+    size_t   moved_capacity;
+    // Pre-order copy of the tree used by the force computation, see `quadtree_flatten`
+    struct quadtree_flat_node *flat;
+    uint32_t                   flat_count;
+    uint32_t                   flat_capacity;
+};
+
+// Interaction list of a group of bodies: the bodies acting on the group, stored as 32 bytes
+// aligned lanes padded with massless bodies, and the moments of the nodes far enough.
+struct quadtree_list
+{
+    float *x;
+    float *y;
+    float *mass;
+    size_t count;
+    size_t capacity;
+    float *cell_x;
+    float *cell_y;
+    float *cell_mass;
+    float *cell_xx;
+    float *cell_xy;
+    float *cell_yy;
+    size_t cells_count;
+    size_t cells_capacity;
+};
+
 struct quadtree_stats
 {
     size_t node_count;
     size_t empty_count;
     size_t external_count;
     size_t internal_count;
+    size_t max_depth;
 };
 
-struct quadtree *
-quadtree_new(struct body *bodies, size_t bodies_count);
+void
+quadtree_init(struct quadtree *quadtree);
 void
 quadtree_destroy(struct quadtree *quadtree);
 void
-quadtree_insert(struct quadtree *quadtree, struct body body);
+quadtree_set_leaf_capacity(struct quadtree *quadtree, uint32_t capacity);
+void
+quadtree_reset(struct quadtree *quadtree, const struct bodies *bodies, struct pool *pool);
 void
-quadtree_update_mass(struct quadtree *quadtree);
+quadtree_insert(struct quadtree *quadtree, const struct bodies *bodies, size_t index);
+void
+quadtree_build(struct quadtree     *quadtree,
+               const struct bodies *bodies,
+               const uint32_t      *keys,
+               struct pool         *pool);
+bool
+quadtree_refit(struct quadtree *quadtree, const struct bodies *bodies, struct pool *pool);
+void
+quadtree_update_mass(struct quadtree *quadtree, struct pool *pool);
+void
+quadtree_flatten(struct quadtree *quadtree);
 void
 quadtree_force(const struct quadtree *quadtree,
                const struct body     *body,
                const float            gravity,
                float                 *force_x,
                float                 *force_y);
+double
+quadtree_potential(const struct quadtree *quadtree, const struct body *body, const float gravity);
+void
+quadtree_list_init(struct quadtree_list *list);
+void
+quadtree_list_destroy(struct quadtree_list *list);
+void
+quadtree_list_build(const struct quadtree *quadtree, uint32_t leaf, struct quadtree_list *list);
+void
+quadtree_list_force(const struct quadtree_list *list,
+                    const struct body          *body,
+                    const float                 gravity,
+                    float                      *force_x,
+                    float                      *force_y);
 void
 quadtree_stats(const struct quadtree *quadtree, struct quadtree_stats *stats);
 
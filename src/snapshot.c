@@ -0,0 +1,104 @@
+#include "snapshot.h"
+#include "utils.h"
+
+// Set in `middle` when it holds a snapshot the window hasn't taken yet
+#define SNAPSHOT_FRESH 4u
+
+void
+snapshots_init(struct snapshots *snapshots, size_t count)
+{
+    for (size_t i = 0; i < 3; i++)
+    {
+        struct snapshot *snapshot = &snapshots->buffers[i];
+        snapshot->count = 0;
+        snapshot->x = xmalloc(sizeof(float) * count);
+        snapshot->y = xmalloc(sizeof(float) * count);
+        snapshot->mass = xmalloc(sizeof(float) * count);
+        snapshot->nodes = NULL;
+        snapshot->nodes_bodies_count = NULL;
+        snapshot->nodes_count = 0;
+        snapshot->nodes_capacity = 0;
+        snapshot->bucket_index = NULL;
+        snapshot->bucket_lanes_capacity = 0;
+        snapshot->step = 0;
+    }
+    snapshots->back = 0;
+    snapshots->front = 1;
+    atomic_init(&snapshots->middle, 2);
+}
+
+void
+snapshots_destroy(struct snapshots *snapshots)
+{
+    for (size_t i = 0; i < 3; i++)
+    {
+        free(snapshots->buffers[i].x);
+        free(snapshots->buffers[i].y);
+        free(snapshots->buffers[i].mass);
+        free(snapshots->buffers[i].nodes);
+        free(snapshots->buffers[i].nodes_bodies_count);
+        free(snapshots->buffers[i].bucket_index);
+    }
+}
+
+// The tree only has the masses, the window needs the number of bodies to draw densities
+static uint32_t
+snapshot_count_bodies(struct snapshot *snapshot, uint32_t index)
+{
+    const struct quadtree_node *node = &snapshot->nodes[index];
+    uint32_t                    count = 0;
+    if (node->type == QUADTREE_EXTERNAL)
+        count = node->external.bodies_count;
+    else if (node->type == QUADTREE_INTERNAL)
+        count = snapshot_count_bodies(snapshot, node->internal.nw) +
+                snapshot_count_bodies(snapshot, node->internal.ne) +
+                snapshot_count_bodies(snapshot, node->internal.sw) +
+                snapshot_count_bodies(snapshot, node->internal.se);
+    snapshot->nodes_bodies_count[index] = count;
+    return count;
+}
+
+void
+snapshots_publish(struct snapshots      *snapshots,
+                  const struct bodies   *bodies,
+                  const struct quadtree *quadtree,
+                  size_t                 step)
+{
+    struct snapshot *snapshot = &snapshots->buffers[snapshots->back];
+    snapshot->count = bodies->count;
+    memcpy(snapshot->x, bodies->x, sizeof(float) * bodies->count);
+    memcpy(snapshot->y, bodies->y, sizeof(float) * bodies->count);
+    memcpy(snapshot->mass, bodies->mass, sizeof(float) * bodies->count);
+    if (quadtree->nodes_count > snapshot->nodes_capacity)
+    {
+        free(snapshot->nodes);
+        free(snapshot->nodes_bodies_count);
+        snapshot->nodes_capacity = quadtree->nodes_count;
+        snapshot->nodes = xmalloc(sizeof(struct quadtree_node) * snapshot->nodes_capacity);
+        snapshot->nodes_bodies_count = xmalloc(sizeof(uint32_t) * snapshot->nodes_capacity);
+    }
+    memcpy(snapshot->nodes, quadtree->nodes, sizeof(struct quadtree_node) * quadtree->nodes_count);
+    snapshot->nodes_count = quadtree->nodes_count;
+    snapshot_count_bodies(snapshot, QUADTREE_ROOT);
+    size_t lanes_count = (size_t)quadtree->buckets_count * quadtree->bucket_lanes;
+    if (lanes_count > snapshot->bucket_lanes_capacity)
+    {
+        free(snapshot->bucket_index);
+        snapshot->bucket_lanes_capacity = lanes_count;
+        snapshot->bucket_index = xmalloc(sizeof(uint32_t) * lanes_count);
+    }
+    memcpy(snapshot->bucket_index, quadtree->bucket_index, sizeof(uint32_t) * lanes_count);
+    snapshot->step = step;
+    uint32_t previous = atomic_exchange(&snapshots->middle, snapshots->back | SNAPSHOT_FRESH);
+    snapshots->back = previous & ~SNAPSHOT_FRESH;
+}
+
+const struct snapshot *
+snapshots_take(struct snapshots *snapshots)
+{
+    if (!(atomic_load(&snapshots->middle) & SNAPSHOT_FRESH))
+        return NULL;
+    uint32_t previous = atomic_exchange(&snapshots->middle, snapshots->front);
+    snapshots->front = previous & ~SNAPSHOT_FRESH;
+    return &snapshots->buffers[snapshots->front];
+}
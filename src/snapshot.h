@@ -0,0 +1,52 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "body.h"
+#include "quadtree.h"
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// What the window needs to draw one step, copied from the simulation
+struct snapshot
+{
+    size_t                count;
+    float                *x;
+    float                *y;
+    float                *mass;
+    // Copy of the tree, the lanes of a leaf bucket give the index of its bodies in x, y and mass
+    struct quadtree_node *nodes;
+    uint32_t             *nodes_bodies_count;  // in the subtree of each node
+    uint32_t              nodes_count;
+    size_t                nodes_capacity;
+    uint32_t             *bucket_index;
+    size_t                bucket_lanes_capacity;
+    size_t                step;
+};
+
+// Triple buffer between the simulation and the window: the simulation fills `back` and swaps it
+// with `middle`, the window swaps `front` with `middle` when it holds a newer snapshot. Neither
+// side waits for the other, the window always gets the last published step.
+struct snapshots
+{
+    struct snapshot buffers[3];
+    uint32_t        back;   // simulation side
+    uint32_t        front;  // window side
+    atomic_uint     middle;
+};
+
+void
+snapshots_init(struct snapshots *snapshots, size_t count);
+void
+snapshots_destroy(struct snapshots *snapshots);
+// Copy the bodies and their quadtree in the back snapshot and publish it
+void
+snapshots_publish(struct snapshots      *snapshots,
+                  const struct bodies   *bodies,
+                  const struct quadtree *quadtree,
+                  size_t                 step);
+// Latest snapshot if one was published since the last call, NULL otherwise
+const struct snapshot *
+snapshots_take(struct snapshots *snapshots);
+
+#endif
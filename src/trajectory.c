@@ -0,0 +1,243 @@
+#define _POSIX_C_SOURCE 200809L
+#include "trajectory.h"
+#include "utils.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+const char *trajectory_field_names[TRAJECTORY_FIELD_COUNT] = {
+    "x",
+    "y",
+    "velocity_x",
+    "velocity_y",
+    "mass",
+};
+
+uint32_t
+trajectory_fields_parse(const char *list)
+{
+    uint32_t fields = 0;
+    while (*list != '\0')
+    {
+        size_t length = strcspn(list, ",");
+        size_t field = 0;
+        while (field < TRAJECTORY_FIELD_COUNT &&
+               (strlen(trajectory_field_names[field]) != length ||
+                strncmp(list, trajectory_field_names[field], length) != 0))
+            field++;
+        if (field == TRAJECTORY_FIELD_COUNT)
+            return 0;
+        fields |= 1u << field;
+        list += length;
+        if (*list == ',')
+            list++;
+    }
+    return fields;
+}
+
+static size_t
+trajectory_fields_count(uint32_t fields)
+{
+    return __builtin_popcount(fields);
+}
+
+static size_t
+trajectory_frame_size(uint32_t fields, size_t count)
+{
+    return sizeof(struct trajectory_frame) +
+           sizeof(float) * trajectory_fields_count(fields) * count;
+}
+
+// Write the buffers in the order they are filled until the writer is closed and both are empty
+static void *
+trajectory_writer_func(struct trajectory *trajectory)
+{
+    size_t next = 0;
+    pthread_mutex_lock(&trajectory->mutex);
+    while (true)
+    {
+        while (!trajectory->full[next] && !trajectory->quit)
+            pthread_cond_wait(&trajectory->cond, &trajectory->mutex);
+        if (!trajectory->full[next])
+            break;
+        pthread_mutex_unlock(&trajectory->mutex);
+        xwrite(trajectory->fd, trajectory->buffers[next], trajectory->frame_size);
+        pthread_mutex_lock(&trajectory->mutex);
+        trajectory->full[next] = false;
+        pthread_cond_broadcast(&trajectory->cond);
+        next ^= 1;
+    }
+    pthread_mutex_unlock(&trajectory->mutex);
+    return NULL;
+}
+
+void
+trajectory_open(struct trajectory *trajectory, const char *path, uint32_t fields, size_t count)
+{
+    memset(trajectory, 0, sizeof *trajectory);
+    trajectory->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (trajectory->fd < 0)
+        die("Cannot open %s", path);
+    trajectory->fields = fields;
+    trajectory->count = count;
+    trajectory->frame_size = trajectory_frame_size(fields, count);
+    struct trajectory_header header = {
+        .version = TRAJECTORY_VERSION,
+        .fields = fields,
+        .count = count,
+        .frame_size = trajectory->frame_size,
+    };
+    memcpy(header.magic, TRAJECTORY_MAGIC, sizeof header.magic);
+    xwrite(trajectory->fd, &header, sizeof header);
+    for (size_t i = 0; i < 2; i++)
+        trajectory->buffers[i] = xmalloc(trajectory->frame_size);
+    pthread_mutex_init(&trajectory->mutex, NULL);
+    pthread_cond_init(&trajectory->cond, NULL);
+    if (pthread_create(&trajectory->thread,
+                       NULL,
+                       (void *(*)(void *))trajectory_writer_func,
+                       trajectory) != 0)
+        die("Cannot create trajectory writer thread");
+}
+
+struct trajectory_write_job
+{
+    const struct bodies *bodies;
+    float               *fields[TRAJECTORY_FIELD_COUNT];  // NULL when not recorded
+};
+
+static void
+trajectory_write_func(const struct trajectory_write_job *job,
+                      size_t                             start,
+                      size_t                             stop,
+                      size_t                             worker)
+{
+    (void)worker;
+    const struct bodies *bodies = job->bodies;
+    const float         *sources[TRAJECTORY_FIELD_COUNT] = {
+        bodies->x,
+        bodies->y,
+        bodies->velocity_x,
+        bodies->velocity_y,
+        bodies->mass,
+    };
+    for (size_t field = 0; field < TRAJECTORY_FIELD_COUNT; field++)
+    {
+        if (job->fields[field] == NULL)
+            continue;
+        for (size_t i = start; i < stop; i++)
+            job->fields[field][bodies->id[i]] = sources[field][i];
+    }
+}
+
+void
+trajectory_write(struct trajectory   *trajectory,
+                 const struct bodies *bodies,
+                 uint64_t             step,
+                 double               time,
+                 struct pool         *pool)
+{
+    double wait_start = time_seconds();
+    pthread_mutex_lock(&trajectory->mutex);
+    while (trajectory->full[trajectory->fill])
+        pthread_cond_wait(&trajectory->cond, &trajectory->mutex);
+    pthread_mutex_unlock(&trajectory->mutex);
+    trajectory->wait_seconds += time_seconds() - wait_start;
+
+    struct trajectory_frame *frame = trajectory->buffers[trajectory->fill];
+    *frame = (struct trajectory_frame){.step = step, .time = time, .count = trajectory->count};
+    struct trajectory_write_job job = {.bodies = bodies};
+    float                      *values = (float *)(frame + 1);
+    for (size_t field = 0; field < TRAJECTORY_FIELD_COUNT; field++)
+    {
+        if (!(trajectory->fields & (1u << field)))
+            continue;
+        job.fields[field] = values;
+        values += trajectory->count;
+    }
+    pool_run(pool, (pool_func)trajectory_write_func, &job, bodies->count, 4096);
+
+    pthread_mutex_lock(&trajectory->mutex);
+    trajectory->full[trajectory->fill] = true;
+    pthread_cond_broadcast(&trajectory->cond);
+    pthread_mutex_unlock(&trajectory->mutex);
+    trajectory->fill ^= 1;
+    trajectory->frames_count++;
+}
+
+void
+trajectory_close(struct trajectory *trajectory)
+{
+    pthread_mutex_lock(&trajectory->mutex);
+    trajectory->quit = true;
+    pthread_cond_broadcast(&trajectory->cond);
+    pthread_mutex_unlock(&trajectory->mutex);
+    pthread_join(trajectory->thread, NULL);
+    if (close(trajectory->fd) != 0)
+        die("Cannot close trajectory");
+    pthread_mutex_destroy(&trajectory->mutex);
+    pthread_cond_destroy(&trajectory->cond);
+    for (size_t i = 0; i < 2; i++)
+        free(trajectory->buffers[i]);
+}
+
+void
+trajectory_file_open(struct trajectory_file *file, const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        die("Cannot open %s", path);
+    struct stat stat;
+    if (fstat(fd, &stat) != 0)
+        die("Cannot stat %s", path);
+    file->size = stat.st_size;
+    if (file->size < sizeof(struct trajectory_header))
+        die("%s is not a trajectory", path);
+    void *map = mmap(NULL, file->size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        die("Cannot map %s", path);
+    close(fd);
+    file->header = map;
+    if (memcmp(file->header->magic, TRAJECTORY_MAGIC, sizeof file->header->magic) != 0)
+        die("%s is not a trajectory", path);
+    if (file->header->version != TRAJECTORY_VERSION)
+        die("%s has version %u, expected %u",
+            path,
+            file->header->version,
+            TRAJECTORY_VERSION);
+    if (file->header->frame_size !=
+        trajectory_frame_size(file->header->fields, file->header->count))
+        die("%s has an invalid frame size", path);
+    // A frame cut short by a crash is left out
+    file->frames_count = (file->size - sizeof(struct trajectory_header)) / file->header->frame_size;
+}
+
+void
+trajectory_file_close(struct trajectory_file *file)
+{
+    munmap((void *)file->header, file->size);
+    memset(file, 0, sizeof *file);
+}
+
+const struct trajectory_frame *
+trajectory_file_frame(const struct trajectory_file *file, size_t index)
+{
+    if (index >= file->frames_count)
+        return NULL;
+    const char *frames = (const char *)(file->header + 1);
+    return (const struct trajectory_frame *)(frames + index * file->header->frame_size);
+}
+
+const float *
+trajectory_frame_field(const struct trajectory_file  *file,
+                       const struct trajectory_frame *frame,
+                       enum trajectory_field          field)
+{
+    uint32_t fields = file->header->fields;
+    if (!(fields & (1u << field)))
+        return NULL;
+    // Recorded fields before this one
+    size_t before = trajectory_fields_count(fields & ((1u << field) - 1));
+    return (const float *)(frame + 1) + before * file->header->count;
+}
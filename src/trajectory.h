@@ -0,0 +1,103 @@
+#ifndef TRAJECTORY_H
+#define TRAJECTORY_H
+
+#include "body.h"
+#include "pool.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Binary trajectory file: a header followed by frames that all have the same size, so frame k
+// starts at `sizeof(struct trajectory_header) + k * frame_size`. A frame is a
+// `struct trajectory_frame` followed by `count` floats for each recorded field, in the order
+// of `enum trajectory_field`, indexed by the id of the bodies. Numbers are stored in the byte
+// order of the machine that wrote the file.
+#define TRAJECTORY_MAGIC "NBODYTRJ"
+#define TRAJECTORY_VERSION 1
+
+enum trajectory_field
+{
+    TRAJECTORY_X,
+    TRAJECTORY_Y,
+    TRAJECTORY_VELOCITY_X,
+    TRAJECTORY_VELOCITY_Y,
+    TRAJECTORY_MASS,
+    TRAJECTORY_FIELD_COUNT,
+};
+
+extern const char *trajectory_field_names[TRAJECTORY_FIELD_COUNT];
+
+struct trajectory_header
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t fields;      // bit (1 << field) for each recorded field
+    uint64_t count;       // bodies in a frame
+    uint64_t frame_size;  // bytes, frame header included
+};
+
+struct trajectory_frame
+{
+    uint64_t step;
+    double   time;
+    uint64_t count;
+};
+
+// Parse a comma separated list of field names into a mask, 0 when a name is invalid
+uint32_t
+trajectory_fields_parse(const char *list);
+
+// Writer, frames are copied in one of two buffers by the simulation and written to disk by a
+// background thread while the other buffer is filled.
+struct trajectory
+{
+    int             fd;
+    uint32_t        fields;
+    size_t          count;
+    size_t          frame_size;
+    void           *buffers[2];
+    bool            full[2];
+    size_t          fill;  // buffer filled by the next `trajectory_write`
+    bool            quit;
+    pthread_t       thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+    double          wait_seconds;  // spent waiting on the writer thread
+    size_t          frames_count;
+};
+
+void
+trajectory_open(struct trajectory *trajectory, const char *path, uint32_t fields, size_t count);
+// Copy the current state of the bodies as a frame, only waits if both buffers are still queued
+void
+trajectory_write(struct trajectory   *trajectory,
+                 const struct bodies *bodies,
+                 uint64_t             step,
+                 double               time,
+                 struct pool         *pool);
+// Write the queued frames and close the file
+void
+trajectory_close(struct trajectory *trajectory);
+
+// Reader, the file is memory mapped and frames point into the mapping
+struct trajectory_file
+{
+    const struct trajectory_header *header;
+    size_t                          size;
+    size_t                          frames_count;
+};
+
+void
+trajectory_file_open(struct trajectory_file *file, const char *path);
+void
+trajectory_file_close(struct trajectory_file *file);
+const struct trajectory_frame *
+trajectory_file_frame(const struct trajectory_file *file, size_t index);
+// Values of a field in a frame, NULL when the field isn't recorded
+const float *
+trajectory_frame_field(const struct trajectory_file  *file,
+                       const struct trajectory_frame *frame,
+                       enum trajectory_field          field);
+
+#endif
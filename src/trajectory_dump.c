@@ -0,0 +1,77 @@
+#include "trajectory.h"
+#include "utils.h"
+
+// Print the header of a trajectory file, or one of its frames as CSV
+int
+main(int argc, char **argv)
+{
+    if (argc != 2 && argc != 3)
+    {
+        fprintf(stderr,
+                "Usage: %s FILE [FRAME]\n"
+                "\tWithout FRAME print the header and the number of frames as JSON\n"
+                "\tWith FRAME print the recorded fields of the bodies in that frame as CSV,\n"
+                "\tnegative frames count from the end (-1 is the last one)\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+    struct trajectory_file file;
+    trajectory_file_open(&file, argv[1]);
+    if (argc == 2)
+    {
+        printf("{\"version\": %u, \"bodies\": %llu, \"frames\": %zu, \"fields\": [",
+               file.header->version,
+               (unsigned long long)file.header->count,
+               file.frames_count);
+        const char *separator = "";
+        for (size_t i = 0; i < TRAJECTORY_FIELD_COUNT; i++)
+        {
+            if (!(file.header->fields & (1u << i)))
+                continue;
+            printf("%s\"%s\"", separator, trajectory_field_names[i]);
+            separator = ", ";
+        }
+        printf("]");
+        const struct trajectory_frame *first = trajectory_file_frame(&file, 0);
+        const struct trajectory_frame *last = trajectory_file_frame(&file, file.frames_count - 1);
+        if (first != NULL)
+            printf(", \"first_step\": %llu, \"last_step\": %llu",
+                   (unsigned long long)first->step,
+                   (unsigned long long)last->step);
+        printf("}\n");
+        trajectory_file_close(&file);
+        return EXIT_SUCCESS;
+    }
+
+    errno = 0;
+    long long index = strtoll(argv[2], NULL, 10);
+    if (errno != 0)
+        die("Invalid frame: %s", argv[2]);
+    if (index < 0)
+        index += file.frames_count;
+    const struct trajectory_frame *frame =
+        index < 0 ? NULL : trajectory_file_frame(&file, (size_t)index);
+    if (frame == NULL)
+        die("No frame %s in %s (%zu frames)", argv[2], argv[1], file.frames_count);
+    const float *fields[TRAJECTORY_FIELD_COUNT];
+    printf("# step %llu, time %f\nid",
+           (unsigned long long)frame->step,
+           frame->time);
+    for (size_t i = 0; i < TRAJECTORY_FIELD_COUNT; i++)
+    {
+        fields[i] = trajectory_frame_field(&file, frame, i);
+        if (fields[i] != NULL)
+            printf(",%s", trajectory_field_names[i]);
+    }
+    printf("\n");
+    for (size_t j = 0; j < frame->count; j++)
+    {
+        printf("%zu", j);
+        for (size_t i = 0; i < TRAJECTORY_FIELD_COUNT; i++)
+            if (fields[i] != NULL)
+                printf(",%.9g", (double)fields[i][j]);
+        printf("\n");
+    }
+    trajectory_file_close(&file);
+    return EXIT_SUCCESS;
+}
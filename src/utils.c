@@ -1,4 +1,10 @@
+#define _DEFAULT_SOURCE
 #include "utils.h"
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+bool huge_pages = false;
 
 void
 die(const char *format, ...)
@@ -21,12 +27,88 @@ xmalloc(size_t size)
     return x;
 }
 
+// `size` is rounded up to a multiple of `alignment` as required by aligned_alloc
+void *
+xaligned_alloc(size_t alignment, size_t size)
+{
+    bool huge = huge_pages && size >= HUGE_PAGE_SIZE;
+    if (huge)
+        alignment = HUGE_PAGE_SIZE;
+    size = (size + alignment - 1) / alignment * alignment;
+    void *x = aligned_alloc(alignment, size == 0 ? alignment : size);
+    if (x == NULL)
+        die("Invalid aligned_alloc");
+#ifdef MADV_HUGEPAGE
+    // Only a hint, the kernel may have transparent huge pages disabled
+    if (huge)
+        madvise(x, size, MADV_HUGEPAGE);
+#endif
+    return x;
+}
+
+void *
+xaligned_realloc(void *ptr, size_t alignment, size_t old_size, size_t size)
+{
+    void *x = xaligned_alloc(alignment, size);
+    if (ptr != NULL)
+        memcpy(x, ptr, old_size < size ? old_size : size);
+    free(ptr);
+    return x;
+}
+
+// Write all of `data`, retrying short writes
+void
+xwrite(int fd, const void *data, size_t size)
+{
+    const char *bytes = data;
+    while (size > 0)
+    {
+        ssize_t written = write(fd, bytes, size);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written < 0)
+            die("Invalid write");
+        bytes += written;
+        size -= written;
+    }
+}
+
 float
 frand(void)
 {
     return (float)rand() / (float)RAND_MAX;
 }
 
+static uint64_t
+rng_mix(uint64_t x)
+{
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+    return x ^ (x >> 31);
+}
+
+// The mix is a bijection, different streams of a seed get different keys
+void
+rng_init(struct rng *rng, uint64_t seed, uint64_t stream)
+{
+    rng->key = rng_mix(rng_mix(seed) ^ stream);
+    rng->counter = 0;
+}
+
+uint64_t
+rng_next(struct rng *rng)
+{
+    rng->counter++;
+    return rng_mix(rng->key + rng->counter * 0x9e3779b97f4a7c15);
+}
+
+// Uniform in [0, 1), from the 24 high bits so every value is exact in a float
+float
+rng_float(struct rng *rng)
+{
+    return (float)(rng_next(rng) >> 40) * 0x1p-24f;
+}
+
 // from: https://en.wikipedia.org/wiki/Fast_inverse_square_root
 // TODO: watch the famous YT video on it
 float
@@ -41,3 +123,11 @@ rsqrt(float number)
     conv.f *= 1.5F - (number * 0.5F * conv.f * conv.f);
     return conv.f;
 }
+
+double
+time_seconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
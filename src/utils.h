@@ -3,20 +3,49 @@
 
 #include <errno.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #define ARRAY_LEN(a) (sizeof(a) / sizeof(a[0]))
+#define HUGE_PAGE_SIZE (2u << 20)
+
+// When set, xaligned_alloc puts arrays of at least a huge page on their own huge pages so the
+// bodies and the tree take fewer TLB entries
+extern bool huge_pages;
+
+// Counter-based random number generator: the n-th number of a stream is a hash of its key and n,
+// streams keyed by (seed, index) can be drawn on any thread in any order and give the same
+// numbers. The hash is the splitmix64 finalizer.
+struct rng
+{
+    uint64_t key;
+    uint64_t counter;
+};
 
 void
 die(const char *format, ...);
 void *
 xmalloc(size_t size);
+void *
+xaligned_alloc(size_t alignment, size_t size);
+void *
+xaligned_realloc(void *ptr, size_t alignment, size_t old_size, size_t size);
+void
+xwrite(int fd, const void *data, size_t size);
 float
 frand(void);
+void
+rng_init(struct rng *rng, uint64_t seed, uint64_t stream);
+uint64_t
+rng_next(struct rng *rng);
+float
+rng_float(struct rng *rng);
 float
 rsqrt(float number);
+double
+time_seconds(void);
 
 #endif
@@ -0,0 +1,134 @@
+// Refit the tree of bodies moving a little at every step with many more workers than top
+// nodes, and check the mass and center of mass of every node against the bodies under it
+#include "body.h"
+#include "morton.h"
+#include "pool.h"
+#include "quadtree.h"
+#include "utils.h"
+#include <math.h>
+
+#define BODIES_COUNT 400
+#define WORKERS_COUNT 64
+#define STEPS_COUNT 50
+
+static struct bodies   bodies;
+static struct bodies   bodies_scratch;
+static struct quadtree quadtree;
+static struct morton   morton;
+static struct pool    *pool;
+static uint8_t         seen[BODIES_COUNT];
+
+static void
+build(void)
+{
+    quadtree_reset(&quadtree, &bodies, pool);
+    const struct quadtree_node *root = &quadtree.nodes[QUADTREE_ROOT];
+    morton_sort(&morton, &bodies, root->start_x, root->start_y, root->end_x, root->end_y, pool);
+    bodies_permute(&bodies, &bodies_scratch, morton.order, pool);
+    quadtree_build(&quadtree, &bodies, morton.keys, pool);
+}
+
+static bool
+close_enough(double value, double expected)
+{
+    return fabs(value - expected) <= 1e-4 * fmax(1.0, fabs(expected));
+}
+
+// Sum the masses and the positions weighted by mass of the bodies under `index` and count the
+// nodes whose moments don't match them
+static size_t
+check_node(uint32_t index, double *mass, double *x, double *y)
+{
+    const struct quadtree_node *node = &quadtree.nodes[index];
+    size_t                      errors = 0;
+    *mass = 0.0;
+    *x = 0.0;
+    *y = 0.0;
+    if (node->type == QUADTREE_EMPTY)
+        return 0;
+    if (node->type == QUADTREE_EXTERNAL)
+    {
+        uint32_t bucket = node->external.bucket;
+        for (uint32_t lane = bucket; lane < bucket + node->external.bodies_count; lane++)
+        {
+            uint32_t j = quadtree.bucket_index[lane];
+            if (seen[j]++ || quadtree.bucket_x[lane] != bodies.x[j] ||
+                quadtree.bucket_y[lane] != bodies.y[j] ||
+                quadtree.bucket_mass[lane] != bodies.mass[j])
+                errors++;
+            *mass += bodies.mass[j];
+            *x += (double)bodies.x[j] * bodies.mass[j];
+            *y += (double)bodies.y[j] * bodies.mass[j];
+        }
+    }
+    else
+    {
+        uint32_t children[4] = {
+            node->internal.nw, node->internal.ne, node->internal.sw, node->internal.se};
+        for (unsigned int i = 0; i < 4; i++)
+        {
+            double child_mass, child_x, child_y;
+            errors += check_node(children[i], &child_mass, &child_x, &child_y);
+            *mass += child_mass;
+            *x += child_x;
+            *y += child_y;
+        }
+    }
+    if (*mass == 0.0 || !close_enough(node->total_mass, *mass) ||
+        !close_enough(node->center_of_mass_x, *x / *mass) ||
+        !close_enough(node->center_of_mass_y, *y / *mass))
+        errors++;
+    return errors;
+}
+
+int
+main(void)
+{
+    pool = pool_new(WORKERS_COUNT);
+    bodies_init(&bodies, BODIES_COUNT, pool);
+    bodies_init(&bodies_scratch, BODIES_COUNT, pool);
+    struct rng rng;
+    rng_init(&rng, 42, 0);
+    for (size_t i = 0; i < BODIES_COUNT; i++)
+    {
+        struct body body = {0};
+        body_init_random_uniform(&body, &rng);
+        body.mass = rng_float(&rng) + 0.3f;
+        bodies_set(&bodies, i, &body);
+    }
+    quadtree_init(&quadtree);
+    quadtree.root_margin = 0.05f;
+    morton_init(&morton);
+
+    build();
+    quadtree_update_mass(&quadtree, pool);
+    size_t refits_count = 0, errors = 0;
+    for (size_t step = 0; step < STEPS_COUNT && errors == 0; step++)
+    {
+        for (size_t i = 0; i < BODIES_COUNT; i++)
+        {
+            bodies.x[i] += (rng_float(&rng) - 0.5f) * 0.01f;
+            bodies.y[i] += (rng_float(&rng) - 0.5f) * 0.01f;
+        }
+        if (quadtree_refit(&quadtree, &bodies, pool))
+            refits_count++;
+        else
+            build();
+        quadtree_update_mass(&quadtree, pool);
+        memset(seen, 0, sizeof seen);
+        double mass, x, y;
+        errors = check_node(QUADTREE_ROOT, &mass, &x, &y);
+        for (size_t i = 0; i < BODIES_COUNT; i++)
+            errors += seen[i] != 1;
+        if (errors != 0)
+            fprintf(stderr, "step %zu: %zu nodes or bodies don't match\n", step, errors);
+    }
+    printf("%zu refits, %zu errors\n", refits_count, errors);
+
+    morton_destroy(&morton);
+    quadtree_destroy(&quadtree);
+    bodies_destroy(&bodies);
+    bodies_destroy(&bodies_scratch);
+    pool_destroy(pool);
+    return errors == 0 && refits_count != 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}